@@ -4,18 +4,22 @@
 #include "ray.hpp"
 #include "vec3.hpp"
 
-class aabb {
+template <class T> class basic_aabb {
 public:
+  using interval = basic_interval<T>;
+  using point3 = basic_vec3<T>;
+
   interval x, y, z;
 
-  aabb() {} // The default AABB is empty, since intervals are empty by default.
+  // The default AABB is empty, since intervals are empty by default.
+  basic_aabb() {}
 
-  aabb(const interval& x, const interval& y, const interval& z)
+  basic_aabb(const interval& x, const interval& y, const interval& z)
       : x(x), y(y), z(z) {
     pad_to_minimums();
   }
 
-  aabb(const point3& a, const point3& b) {
+  basic_aabb(const point3& a, const point3& b) {
     // Treat the two points a and b as extrema for the bounding box, so we don't
     // require a particular minimum/maximum coordinate order.
 
@@ -24,7 +28,7 @@ public:
     z = (a[2] <= b[2]) ? interval(a[2], b[2]) : interval(b[2], a[2]);
   }
 
-  aabb(const aabb& box0, const aabb& box1) {
+  basic_aabb(const basic_aabb& box0, const basic_aabb& box1) {
     x = interval(box0.x, box1.x);
     y = interval(box0.y, box1.y);
     z = interval(box0.z, box1.z);
@@ -44,15 +48,15 @@ public:
       return y.size() > z.size() ? 1 : 2;
   }
 
-  static const aabb empty, universe;
+  static const basic_aabb empty, universe;
 
-  bool hit(const ray& r, interval ray_t) const {
+  bool hit(const basic_ray<T>& r, interval ray_t) const {
     const point3& ray_orig = r.origin();
-    const vec3& ray_dir = r.direction();
+    const point3& ray_dir = r.direction();
 
     for (int axis = 0; axis < 3; ++axis) {
       const interval& ax = axis_interval(axis);
-      const double adinv = 1.0 / ray_dir[axis];
+      const T adinv = 1 / ray_dir[axis];
 
       auto t0 = (ax.min - ray_orig[axis]) * adinv;
       auto t1 = (ax.max - ray_orig[axis]) * adinv;
@@ -74,24 +78,33 @@ private:
   void pad_to_minimums() {
     // Adjust the AABB so that no side is narrower than some delta, padding if
     // necessary.
-    double delta = 0.0001;
+    T delta = T(0.0001);
     if (x.size() < delta) x = x.expand(delta);
     if (y.size() < delta) y = y.expand(delta);
     if (z.size() < delta) z = z.expand(delta);
   }
 };
 
-inline const aabb aabb::empty =
-    aabb(interval::empty, interval::empty, interval::empty);
-inline const aabb aabb::universe =
-    aabb(interval::universe, interval::universe, interval::universe);
-
-inline aabb operator+(const aabb& bbox, const vec3& offset) {
-  return aabb(bbox.x + offset.x(), bbox.y + offset.y(), bbox.z + offset.z());
+template <class T>
+inline const basic_aabb<T> basic_aabb<T>::empty =
+    basic_aabb<T>(interval::empty, interval::empty, interval::empty);
+template <class T>
+inline const basic_aabb<T> basic_aabb<T>::universe =
+    basic_aabb<T>(interval::universe, interval::universe, interval::universe);
+
+template <class T>
+inline basic_aabb<T> operator+(const basic_aabb<T>& bbox,
+                               const basic_vec3<T>& offset) {
+  return basic_aabb<T>(bbox.x + offset.x(), bbox.y + offset.y(),
+                       bbox.z + offset.z());
 }
 
-inline aabb operator+(const vec3& offset, const aabb& bbox) {
+template <class T>
+inline basic_aabb<T> operator+(const basic_vec3<T>& offset,
+                               const basic_aabb<T>& bbox) {
   return bbox + offset;
 }
 
+using aabb = basic_aabb<real>;
+
 #endif
@@ -3,6 +3,7 @@
 #include "aabb.hpp"
 #include "hittable.hpp"
 #include "hittable_list.hpp"
+#include "thread_pool.hpp"
 #include <algorithm>
 
 class bvh_node : public hittable {
@@ -11,10 +12,10 @@ public:
 
   bvh_node(std::vector<shared_ptr<hittable>>& objects, size_t start, size_t end);
 
-  bool hit(const ray& r, interval ray_t, hit_record& rec) const override {
+  bool hit(const ray& r, interval ray_t, hit_record& rec, sampler& smp) const override {
     if (!bbox_.hit(r, ray_t)) return false;
-    bool hit_left = left_->hit(r, ray_t, rec);
-    bool hit_right = right_->hit(r, interval(ray_t.min, hit_left ? rec.t : ray_t.max), rec);
+    bool hit_left = left_->hit(r, ray_t, rec, smp);
+    bool hit_right = right_->hit(r, interval(ray_t.min, hit_left ? rec.t : ray_t.max), rec, smp);
     return hit_left || hit_right;
   }
 
@@ -23,6 +24,9 @@ public:
   std::shared_ptr<hittable> right() { return right_; }
 
 private:
+  // Subtrees at least this large are built as separate thread pool tasks
+  static constexpr size_t parallel_build_span = 1024;
+
   shared_ptr<hittable> left_;
   shared_ptr<hittable> right_;
   aabb bbox_;
@@ -56,8 +60,16 @@ inline bvh_node::bvh_node(std::vector<shared_ptr<hittable>>& objects, size_t sta
   } else {
     std::sort(std::begin(objects) + start, std::begin(objects) + end, comparator);
     auto mid = start + object_span / 2;
-    left_ = make_shared<bvh_node>(objects, start, mid);
-    right_ = make_shared<bvh_node>(objects, mid, end);
+    if (object_span < parallel_build_span) {
+      left_ = make_shared<bvh_node>(objects, start, mid);
+      right_ = make_shared<bvh_node>(objects, mid, end);
+    } else {
+      // The halves are disjoint ranges of 'objects', so they build side by side
+      thread_pool& pool = thread_pool::global();
+      auto right = pool.submit([&objects, mid, end] { return make_shared<bvh_node>(objects, mid, end); });
+      left_ = make_shared<bvh_node>(objects, start, mid);
+      right_ = pool.wait(right);
+    }
   }
 }
 
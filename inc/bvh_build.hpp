@@ -0,0 +1,128 @@
+#ifndef BVH_BUILD_HPP
+#define BVH_BUILD_HPP
+
+#include "aabb.hpp"
+#include "cuda_structs.hpp"
+
+#include <algorithm>
+#include <cmath>
+#include <limits>
+#include <vector>
+
+// Pieces shared by the BVH builders (sah_builder.hpp, lbvh_builder.hpp,
+// sbvh_builder.hpp), which all write the LinearBVHNode / PrimitiveGPU layout
+// hit_linear_bvh traverses.
+
+// Most primitives one leaf can hold (LinearBVHNode::n_primitives is 16 bits)
+constexpr int max_leaf_primitives = 65535;
+
+// What a BVH builder sees of one primitive: its world-space bounds, the centre
+// of those bounds, and the primitive's position in the collected PrimitiveGPU
+// array. Builders shuffle these instead of the primitives themselves.
+struct primitive_ref {
+  aabb bounds;
+  point3 centroid;
+  int index;
+};
+
+// Store 'box' as float node bounds. Zero-thickness boxes are padded to prevent
+// traversal misses, and the conversion to float rounds outward so the padding
+// survives: at coordinates in the hundreds a 0.0001 slab would otherwise round
+// to zero width and rays would slip past flat quads.
+inline void set_node_bounds(LinearBVHNode& node, aabb box) {
+  double delta = 0.0001;
+  for (interval* axis : {&box.x, &box.y, &box.z}) {
+    if (axis->max - axis->min < delta) {
+      axis->min -= delta / 2.0;
+      axis->max += delta / 2.0;
+    }
+  }
+  auto round_down = [](double x) {
+    float f = float(x);
+    return double(f) > x ? std::nextafter(f, -std::numeric_limits<float>::infinity()) : f;
+  };
+  auto round_up = [](double x) {
+    float f = float(x);
+    return double(f) < x ? std::nextafter(f, std::numeric_limits<float>::infinity()) : f;
+  };
+  node.aabb_min = Vec3f{round_down(box.x.min), round_down(box.y.min), round_down(box.z.min)};
+  node.aabb_max = Vec3f{round_up(box.x.max), round_up(box.y.max), round_up(box.z.max)};
+}
+
+// Half the surface area of 'box', the SAH's measure of how likely a ray is to
+// hit it
+inline float half_area(const aabb& box) {
+  float dx = box.x.size(), dy = box.y.size(), dz = box.z.size();
+  return dx * dy + dy * dz + dz * dx;
+}
+
+// The same for a node's float bounds
+inline float node_half_area(const LinearBVHNode& node) {
+  float dx = node.aabb_max.x - node.aabb_min.x, dy = node.aabb_max.y - node.aabb_min.y,
+        dz = node.aabb_max.z - node.aabb_min.z;
+  return dx * dy + dy * dz + dz * dx;
+}
+
+// Sets interior node 'index' to the union of its two children's bounds
+inline void merge_child_bounds(std::vector<LinearBVHNode>& nodes, int index) {
+  LinearBVHNode& node = nodes[index];
+  const LinearBVHNode& a = nodes[index + 1];
+  const LinearBVHNode& b = nodes[node.second_child_offset];
+  node.aabb_min = Vec3f{std::min(a.aabb_min.x, b.aabb_min.x), std::min(a.aabb_min.y, b.aabb_min.y),
+                        std::min(a.aabb_min.z, b.aabb_min.z)};
+  node.aabb_max = Vec3f{std::max(a.aabb_max.x, b.aabb_max.x), std::max(a.aabb_max.y, b.aabb_max.y),
+                        std::max(a.aabb_max.z, b.aabb_max.z)};
+}
+
+// Moves a subtree built into its own arrays onto the end of 'nodes' and
+// 'ordered', shifting its child and primitive offsets. Returns its root.
+inline int append_subtree(const std::vector<LinearBVHNode>& sub_nodes, const std::vector<PrimitiveGPU>& sub_ordered,
+                          std::vector<LinearBVHNode>& nodes, std::vector<PrimitiveGPU>& ordered) {
+  int node_base = int(nodes.size());
+  int primitive_base = int(ordered.size());
+  for (LinearBVHNode node : sub_nodes) {
+    if (node.n_primitives > 0) {
+      node.primitive_offset += primitive_base;
+    } else {
+      node.second_child_offset += node_base;
+    }
+    nodes.push_back(node);
+  }
+  ordered.insert(ordered.end(), sub_ordered.begin(), sub_ordered.end());
+  return node_base;
+}
+
+// World-space bounds of an INSTANCE primitive whose bottom-level tree spans
+// 'object_bounds' in object space: the box's corners taken through the
+// inverse of the instance's world-to-object transform
+inline aabb instance_bounds(const PrimitiveGPU& instance, const aabb& object_bounds) {
+  const Vec3f* r = instance.instance.rows;
+  double m[3][3] = {{r[0].x, r[0].y, r[0].z}, {r[1].x, r[1].y, r[1].z}, {r[2].x, r[2].y, r[2].z}};
+  double t[3] = {instance.instance.translation.x, instance.instance.translation.y, instance.instance.translation.z};
+  // Inverse by cofactors: inv[i][j] = cofactor(j, i) / det
+  double inv[3][3];
+  for (int i = 0; i < 3; i++) {
+    for (int j = 0; j < 3; j++) {
+      int r0 = (j + 1) % 3, r1 = (j + 2) % 3, c0 = (i + 1) % 3, c1 = (i + 2) % 3;
+      inv[i][j] = m[r0][c0] * m[r1][c1] - m[r0][c1] * m[r1][c0];
+    }
+  }
+  double det = m[0][0] * inv[0][0] + m[0][1] * inv[1][0] + m[0][2] * inv[2][0];
+
+  aabb box = aabb::empty;
+  for (int corner = 0; corner < 8; corner++) {
+    double local[3] = {(corner & 1) ? object_bounds.x.max : object_bounds.x.min,
+                       (corner & 2) ? object_bounds.y.max : object_bounds.y.min,
+                       (corner & 4) ? object_bounds.z.max : object_bounds.z.min};
+    double world[3];
+    for (int i = 0; i < 3; i++) {
+      world[i] = 0.0;
+      for (int j = 0; j < 3; j++) world[i] += inv[i][j] * (local[j] - t[j]) / det;
+    }
+    point3 p(world[0], world[1], world[2]);
+    box = aabb(box, aabb(p, p));
+  }
+  return box;
+}
+
+#endif // !BVH_BUILD_HPP
@@ -0,0 +1,198 @@
+#ifndef BVH_CACHE_HPP
+#define BVH_CACHE_HPP
+
+#include "cuda_structs.hpp"
+
+#include <algorithm>
+#include <cstddef>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <filesystem>
+#include <fstream>
+#include <string>
+#include <utility>
+#include <vector>
+
+// On-disk cache of flattened scenes: the six arrays flatten_hittable fills plus the primitive sources, one file
+// per scene in 'directory'. A scene is keyed by a hash of what flatten_hittable builds from, i.e. its collected
+// primitives, materials and textures (collect_flattened_primitives), and the build mode, so any change to the
+// generated geometry or the builder misses. Files also record a format version and the GPU struct sizes; a file
+// that does not match them, or is truncated, is treated as a miss and rebuilt over. Nothing else ever deletes a
+// stale file, so every store evicts the oldest files once the directory holds more than 'max_bytes' of them.
+class bvh_cache {
+public:
+  // Part of every key: bump it whenever a builder or flatten_hittable changes what it produces
+  static constexpr uint32_t format_version = 1;
+  static constexpr uintmax_t default_max_bytes = uintmax_t(1) << 30;
+
+  explicit bvh_cache(std::string directory, uintmax_t max_bytes = default_max_bytes)
+      : directory(std::move(directory)), max_bytes(max_bytes) {}
+
+  static uint64_t scene_key(const std::vector<PrimitiveGPU>& primitives, const std::vector<MaterialGPU>& materials,
+                            const std::vector<TextureGPU>& textures, const std::vector<PerlinDataGPU>& perlin,
+                            const std::vector<unsigned char>& images, BvhBuildMode mode) {
+    uint64_t hash = 14695981039346656037ull; // FNV-1a
+    auto mix = [&hash](const void* data, size_t bytes) {
+      const unsigned char* p = static_cast<const unsigned char*>(data);
+      for (size_t i = 0; i < bytes; i++) hash = (hash ^ p[i]) * 1099511628211ull;
+    };
+    auto mix_array = [&mix](const auto& array) {
+      uint64_t count = array.size();
+      mix(&count, sizeof(count));
+      mix(array.data(), array.size() * sizeof(array[0]));
+    };
+    // MaterialGPU and TextureGPU have padding after their one-byte type, which copies need not preserve, so their
+    // tag and body are hashed separately
+    auto mix_tagged = [&mix](const auto& array, size_t body_offset) {
+      uint64_t count = array.size();
+      mix(&count, sizeof(count));
+      for (const auto& element : array) {
+        mix(&element.type, sizeof(element.type));
+        mix(reinterpret_cast<const unsigned char*>(&element) + body_offset, sizeof(element) - body_offset);
+      }
+    };
+    mix(&format_version, sizeof(format_version));
+    mix(&mode, sizeof(mode));
+    mix_array(primitives); // zeroed whole when collected, so unused union bytes hash the same
+    mix_tagged(materials, offsetof(MaterialGPU, albedo_tex_id));
+    mix_tagged(textures, offsetof(TextureGPU, solid));
+    mix_array(perlin);
+    mix_array(images);
+    return hash;
+  }
+
+  std::string path(uint64_t key) const {
+    char name[32];
+    std::snprintf(name, sizeof(name), "%016llx.bvh", static_cast<unsigned long long>(key));
+    return (std::filesystem::path(directory) / name).string();
+  }
+
+  // Replaces the arrays with the cached ones; false, leaving them untouched, if there is no usable file
+  bool load(uint64_t key, std::vector<LinearBVHNode>& nodes, std::vector<PrimitiveGPU>& primitives,
+            std::vector<MaterialGPU>& materials, std::vector<TextureGPU>& textures,
+            std::vector<PerlinDataGPU>& perlin, std::vector<unsigned char>& images,
+            std::vector<int>& primitive_sources) const {
+    std::ifstream in(path(key), std::ios::binary);
+    if (!in) return false;
+    file_header header;
+    if (!in.read(reinterpret_cast<char*>(&header), sizeof(header))) return false;
+    file_header expected = expected_header(key);
+    if (std::memcmp(&header, &expected, sizeof(header)) != 0) return false;
+
+    std::vector<LinearBVHNode> new_nodes;
+    std::vector<PrimitiveGPU> new_primitives;
+    std::vector<MaterialGPU> new_materials;
+    std::vector<TextureGPU> new_textures;
+    std::vector<PerlinDataGPU> new_perlin;
+    std::vector<unsigned char> new_images;
+    std::vector<int> new_sources;
+    if (!read_array(in, new_nodes) || !read_array(in, new_primitives) || !read_array(in, new_materials) ||
+        !read_array(in, new_textures) || !read_array(in, new_perlin) || !read_array(in, new_images) ||
+        !read_array(in, new_sources)) {
+      return false;
+    }
+    nodes.swap(new_nodes);
+    primitives.swap(new_primitives);
+    materials.swap(new_materials);
+    textures.swap(new_textures);
+    perlin.swap(new_perlin);
+    images.swap(new_images);
+    primitive_sources.swap(new_sources);
+    return true;
+  }
+
+  // Writes to a temporary file renamed into place, so an interrupted store never leaves a partial cache file
+  bool store(uint64_t key, const std::vector<LinearBVHNode>& nodes, const std::vector<PrimitiveGPU>& primitives,
+             const std::vector<MaterialGPU>& materials, const std::vector<TextureGPU>& textures,
+             const std::vector<PerlinDataGPU>& perlin, const std::vector<unsigned char>& images,
+             const std::vector<int>& primitive_sources) const {
+    std::error_code error;
+    std::filesystem::create_directories(directory, error);
+    std::string final_path = path(key), temp_path = final_path + ".tmp";
+    {
+      std::ofstream out(temp_path, std::ios::binary | std::ios::trunc);
+      if (!out) return false;
+      file_header header = expected_header(key);
+      out.write(reinterpret_cast<const char*>(&header), sizeof(header));
+      write_array(out, nodes);
+      write_array(out, primitives);
+      write_array(out, materials);
+      write_array(out, textures);
+      write_array(out, perlin);
+      write_array(out, images);
+      write_array(out, primitive_sources);
+      if (!out.flush()) return false;
+    }
+    std::filesystem::rename(temp_path, final_path, error);
+    if (error) return false;
+    evict(final_path);
+    return true;
+  }
+
+private:
+  struct file_header {
+    char magic[8];
+    uint32_t version;
+    uint32_t struct_sizes[5]; // LinearBVHNode, PrimitiveGPU, MaterialGPU, TextureGPU, PerlinDataGPU
+    uint64_t key;
+  };
+
+  std::string directory;
+  uintmax_t max_bytes;
+
+  // Deletes cache files, oldest written first, until the rest fit in max_bytes; never 'keep', the file just stored
+  void evict(const std::string& keep) const {
+    std::error_code error;
+    std::vector<std::pair<std::filesystem::file_time_type, std::filesystem::path>> files;
+    uintmax_t total = 0;
+    for (const auto& entry : std::filesystem::directory_iterator(directory, error)) {
+      if (entry.path().extension() != ".bvh") continue;
+      uintmax_t size = entry.file_size(error);
+      if (error) continue;
+      total += size;
+      if (entry.path() != std::filesystem::path(keep)) files.emplace_back(entry.last_write_time(error), entry.path());
+    }
+    std::sort(files.begin(), files.end());
+    for (const auto& [time, file] : files) {
+      if (total <= max_bytes) break;
+      uintmax_t size = std::filesystem::file_size(file, error);
+      if (!error && std::filesystem::remove(file, error)) total -= size;
+    }
+  }
+
+  static file_header expected_header(uint64_t key) {
+    file_header header;
+    std::memset(&header, 0, sizeof(header));
+    std::memcpy(header.magic, "RTBVHC\0", 8);
+    header.version = format_version;
+    header.struct_sizes[0] = sizeof(LinearBVHNode);
+    header.struct_sizes[1] = sizeof(PrimitiveGPU);
+    header.struct_sizes[2] = sizeof(MaterialGPU);
+    header.struct_sizes[3] = sizeof(TextureGPU);
+    header.struct_sizes[4] = sizeof(PerlinDataGPU);
+    header.key = key;
+    return header;
+  }
+
+  template <class T> static void write_array(std::ofstream& out, const std::vector<T>& array) {
+    uint64_t count = array.size();
+    out.write(reinterpret_cast<const char*>(&count), sizeof(count));
+    out.write(reinterpret_cast<const char*>(array.data()), std::streamsize(array.size() * sizeof(T)));
+  }
+
+  template <class T> static bool read_array(std::ifstream& in, std::vector<T>& array) {
+    uint64_t count;
+    if (!in.read(reinterpret_cast<char*>(&count), sizeof(count))) return false;
+    // Guard the allocation against a corrupt count: the rest of the file must hold it
+    std::streampos here = in.tellg();
+    in.seekg(0, std::ios::end);
+    std::streamoff remaining = in.tellg() - here;
+    in.seekg(here);
+    if (count > uint64_t(remaining) / sizeof(T)) return false;
+    array.resize(count);
+    return bool(in.read(reinterpret_cast<char*>(array.data()), std::streamsize(count * sizeof(T))));
+  }
+};
+
+#endif // !BVH_CACHE_HPP
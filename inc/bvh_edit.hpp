@@ -0,0 +1,316 @@
+#ifndef BVH_EDIT_HPP
+#define BVH_EDIT_HPP
+
+#include "bvh_build.hpp"
+#include "bvh_metrics.hpp"
+#include "bvh_refit.hpp"
+#include "sah_builder.hpp"
+
+#include <algorithm>
+#include <limits>
+#include <utility>
+#include <vector>
+
+// Which scene object a top-level primitive was collected from, and which of that object's primitives it is
+struct primitive_tag {
+  int owner;
+  int local;
+};
+
+// Edits a flattened BVH in place when single objects are inserted, removed or moved, instead of rebuilding it.
+// Every edit rebuilds one small subtree with sah_builder and splices it over the old one. The splice shifts the
+// node and primitive offsets behind it, which is a linear pass but cheap next to collecting and building the
+// whole scene. The subtree's ancestors are then refit.
+//
+// - remove() rebuilds the smallest subtree holding all of the object's primitives, without them. If nothing is
+//   left, the parent is replaced by the sibling.
+// - insert() descends from the root towards the child whose box grows least, as in incremental BVH
+//   construction, until the subtree holds at most rebuild_span primitives. It then rebuilds that subtree with
+//   the new primitives added.
+// - update() reinserts an object that moved: a remove followed by an insert.
+//
+// Only the top-level tree is edited. Like bvh_refitter, this relies on the depth-first layout, where each
+// subtree's nodes and primitives occupy contiguous ranges, and the top-level primitives come first. Each edit
+// returns false when it cannot patch the tree: when removing the last object, or when a subtree it would
+// replace does not own one contiguous run of primitives. The caller should then rebuild.
+class bvh_editor {
+public:
+  int rebuild_span = 64; // insert() rebuilds a subtree of at most this many primitives, if the tree allows
+  sah_builder builder;   // builds the replacement subtrees
+
+  // Starts tracking a freshly built tree whose top-level primitives came from the objects in 'tags' (one per
+  // primitive, in array order). With no tags, stops tracking.
+  void reset(std::vector<primitive_tag> primitive_tags) { tags = std::move(primitive_tags); }
+  bool empty() const { return tags.empty(); }
+
+  // Adds 'object', the world-space primitives of a new object, under handle 'owner'
+  bool insert(int owner, const std::vector<PrimitiveGPU>& object, std::vector<LinearBVHNode>& nodes,
+              std::vector<PrimitiveGPU>& primitives) {
+    if (empty() || nodes.empty()) return false;
+    if (object.empty()) return true;
+    aabb box = aabb::empty;
+    for (const PrimitiveGPU& prim : object) box = aabb(box, primitive_bounds(prim, nodes));
+
+    int index = 0;
+    while (nodes[index].n_primitives == 0) {
+      size_t first, last;
+      if (!subtree_primitives(nodes, index, first, last)) return false;
+      if (last - first <= size_t(rebuild_span)) break;
+      int left = index + 1, right = nodes[index].second_child_offset;
+      index = growth(nodes[left], box) <= growth(nodes[right], box) ? left : right;
+    }
+
+    subtree_contents contents = gather(nodes, primitives, index, -1);
+    for (size_t k = 0; k < object.size(); k++) {
+      contents.primitives.push_back(object[k]);
+      contents.tags.push_back({owner, int(k)});
+      contents.bounds.push_back(primitive_bounds(object[k], nodes));
+    }
+    return rebuild(index, contents, nodes, primitives);
+  }
+
+  // Takes the primitives of handle 'owner' out of the tree
+  bool remove(int owner, std::vector<LinearBVHNode>& nodes, std::vector<PrimitiveGPU>& primitives) {
+    if (empty() || nodes.empty()) return false;
+    // The nodes of a subtree are contiguous, so the first and last leaf holding the object span all of them
+    int top_end = bvh_subtree_end(nodes, 0);
+    int lo = -1, hi = -1;
+    for (int i = 0; i < top_end; i++) {
+      const LinearBVHNode& node = nodes[i];
+      for (int p = 0; p < node.n_primitives; p++) {
+        if (tags[node.primitive_offset + p].owner != owner) continue;
+        if (lo < 0) lo = i;
+        hi = i;
+        break;
+      }
+    }
+    if (lo < 0) return true;
+
+    int index = 0;
+    while (nodes[index].n_primitives == 0) {
+      int right = nodes[index].second_child_offset;
+      if (hi < right) {
+        index++;
+      } else if (lo >= right) {
+        index = right;
+      } else {
+        break;
+      }
+    }
+
+    subtree_contents contents = gather(nodes, primitives, index, owner);
+    if (!contents.primitives.empty()) return rebuild(index, contents, nodes, primitives);
+
+    // The subtree held nothing else: its sibling takes the parent's place
+    if (index == 0) return false;
+    std::vector<int> path = path_to(nodes, index);
+    int parent = path.back();
+    int sibling = index == parent + 1 ? nodes[parent].second_child_offset : parent + 1;
+    int sibling_end = bvh_subtree_end(nodes, sibling);
+    size_t sibling_first, sibling_last;
+    if (!subtree_primitives(nodes, sibling, sibling_first, sibling_last)) return false;
+    std::vector<LinearBVHNode> sub_nodes(nodes.begin() + sibling, nodes.begin() + sibling_end);
+    for (LinearBVHNode& node : sub_nodes) {
+      if (node.n_primitives > 0) {
+        node.primitive_offset -= int(sibling_first);
+      } else {
+        node.second_child_offset -= sibling;
+      }
+    }
+    std::vector<PrimitiveGPU> sub_primitives(primitives.begin() + sibling_first, primitives.begin() + sibling_last);
+    std::vector<primitive_tag> sub_tags(tags.begin() + sibling_first, tags.begin() + sibling_last);
+    path.pop_back();
+    if (!splice(parent, sub_nodes, sub_primitives, sub_tags, nodes, primitives)) return false;
+    refit_path(path, nodes);
+    return true;
+  }
+
+  // Reinserts handle 'owner' as 'object', its primitives collected again after it changed. INSTANCE primitives
+  // keep the bottom-level tree their counterpart (by position in the object) already points to.
+  bool update(int owner, std::vector<PrimitiveGPU> object, std::vector<LinearBVHNode>& nodes,
+              std::vector<PrimitiveGPU>& primitives) {
+    if (empty()) return false;
+    std::vector<int> blas_roots(object.size(), -1);
+    for (size_t p = 0; p < tags.size(); p++) {
+      const primitive_tag& tag = tags[p];
+      if (tag.owner == owner && size_t(tag.local) < object.size() &&
+          primitives[p].type == PrimitiveType::INSTANCE) {
+        blas_roots[tag.local] = primitives[p].instance.blas_root;
+      }
+    }
+    for (size_t k = 0; k < object.size(); k++) {
+      if (object[k].type == PrimitiveType::INSTANCE && blas_roots[k] < 0) return false; // needs a new tree
+    }
+
+    // The bottom-level trees all sit behind the top-level one, so removing moves them by as much as its end
+    int top_end = bvh_subtree_end(nodes, 0);
+    if (!remove(owner, nodes, primitives)) return false;
+    int blas_shift = bvh_subtree_end(nodes, 0) - top_end;
+    for (size_t k = 0; k < object.size(); k++) {
+      if (object[k].type == PrimitiveType::INSTANCE) object[k].instance.blas_root = blas_roots[k] + blas_shift;
+    }
+    return insert(owner, object, nodes, primitives);
+  }
+
+private:
+  std::vector<primitive_tag> tags; // by position in the primitive array, for the top-level tree's primitives
+
+  // Primitives to rebuild a subtree over, with their tags and bounds
+  struct subtree_contents {
+    std::vector<PrimitiveGPU> primitives;
+    std::vector<primitive_tag> tags;
+    std::vector<aabb> bounds;
+  };
+
+  // The primitives under nodes[index], except those of handle 'skip'. Each is bounded by its own box clipped to
+  // its leaf's, which keeps the references an SBVH split as tight as the build made them.
+  subtree_contents gather(const std::vector<LinearBVHNode>& nodes, const std::vector<PrimitiveGPU>& primitives,
+                          int index, int skip) const {
+    subtree_contents contents;
+    for (int i = index, end = bvh_subtree_end(nodes, index); i < end; i++) {
+      const LinearBVHNode& leaf = nodes[i];
+      if (leaf.n_primitives == 0) continue;
+      aabb leaf_box(point3(leaf.aabb_min.x, leaf.aabb_min.y, leaf.aabb_min.z),
+                    point3(leaf.aabb_max.x, leaf.aabb_max.y, leaf.aabb_max.z));
+      for (int p = leaf.primitive_offset; p < leaf.primitive_offset + leaf.n_primitives; p++) {
+        if (tags[p].owner == skip) continue;
+        contents.primitives.push_back(primitives[p]);
+        contents.tags.push_back(tags[p]);
+        contents.bounds.push_back(intersect(primitive_bounds(primitives[p], nodes), leaf_box));
+      }
+    }
+    return contents;
+  }
+
+  static aabb intersect(const aabb& a, const aabb& b) {
+    return aabb(interval(std::max(a.x.min, b.x.min), std::min(a.x.max, b.x.max)),
+                interval(std::max(a.y.min, b.y.min), std::min(a.y.max, b.y.max)),
+                interval(std::max(a.z.min, b.z.min), std::min(a.z.max, b.z.max)));
+  }
+
+  // How much a node's box grows, by SAH area, to take in 'box'
+  static float growth(const LinearBVHNode& node, const aabb& box) {
+    aabb node_box(point3(node.aabb_min.x, node.aabb_min.y, node.aabb_min.z),
+                  point3(node.aabb_max.x, node.aabb_max.y, node.aabb_max.z));
+    return half_area(aabb(node_box, box)) - node_half_area(node);
+  }
+
+  // [first, last) of the primitives under nodes[index], spanning all of its leaves. False if that range also
+  // holds primitives from outside the subtree, which a builder that does not keep leaves and primitives in the
+  // same order would leave; such a subtree cannot be spliced.
+  static bool subtree_primitives(const std::vector<LinearBVHNode>& nodes, int index, size_t& first, size_t& last) {
+    first = std::numeric_limits<size_t>::max();
+    last = 0;
+    size_t count = 0;
+    for (int i = index, end = bvh_subtree_end(nodes, index); i < end; i++) {
+      const LinearBVHNode& leaf = nodes[i];
+      if (leaf.n_primitives == 0) continue;
+      first = std::min(first, size_t(leaf.primitive_offset));
+      last = std::max(last, size_t(leaf.primitive_offset) + leaf.n_primitives);
+      count += leaf.n_primitives;
+    }
+    return last - first == count;
+  }
+
+  // The ancestors of nodes[index], root first
+  static std::vector<int> path_to(const std::vector<LinearBVHNode>& nodes, int index) {
+    std::vector<int> path;
+    for (int i = 0; i != index; i = index < nodes[i].second_child_offset ? i + 1 : nodes[i].second_child_offset) {
+      path.push_back(i);
+    }
+    return path;
+  }
+
+  static void refit_path(const std::vector<int>& path, std::vector<LinearBVHNode>& nodes) {
+    for (auto it = path.rbegin(); it != path.rend(); ++it) merge_child_bounds(nodes, *it);
+  }
+
+  // Replaces the subtree at nodes[index] with a tree built over 'contents', then refits its ancestors. False,
+  // leaving the tree untouched, if splice() cannot.
+  bool rebuild(int index, subtree_contents& contents, std::vector<LinearBVHNode>& nodes,
+               std::vector<PrimitiveGPU>& primitives) {
+    // The builder reorders primitives without reporting where they came from, so tag each with its index while
+    // building, as flatten_hittable does
+    std::vector<PrimitiveGPU>& rebuilt = contents.primitives;
+    std::vector<primitive_ref> refs(rebuilt.size());
+    std::vector<int> material_ids(rebuilt.size());
+    for (size_t k = 0; k < rebuilt.size(); k++) {
+      const aabb& bounds = contents.bounds[k];
+      refs[k] = {bounds,
+                 0.5 * (point3(bounds.x.min, bounds.y.min, bounds.z.min) +
+                        point3(bounds.x.max, bounds.y.max, bounds.z.max)),
+                 int(k)};
+      material_ids[k] = rebuilt[k].material_id;
+      rebuilt[k].material_id = int(k);
+    }
+    std::vector<LinearBVHNode> sub_nodes;
+    std::vector<PrimitiveGPU> sub_primitives;
+    builder.build(refs, rebuilt, sub_nodes, sub_primitives);
+    std::vector<primitive_tag> sub_tags(sub_primitives.size());
+    for (size_t k = 0; k < sub_primitives.size(); k++) {
+      int source = sub_primitives[k].material_id;
+      sub_primitives[k].material_id = material_ids[source];
+      sub_tags[k] = contents.tags[source];
+    }
+
+    std::vector<int> path = path_to(nodes, index);
+    if (!splice(index, sub_nodes, sub_primitives, sub_tags, nodes, primitives)) return false;
+    refit_path(path, nodes);
+    return true;
+  }
+
+  // Swaps the subtree at nodes[index] and its primitives for 'sub_nodes', which are numbered from 0 with
+  // primitive offsets into 'sub_primitives', shifting every offset behind them
+  bool splice(int index, std::vector<LinearBVHNode>& sub_nodes, const std::vector<PrimitiveGPU>& sub_primitives,
+              const std::vector<primitive_tag>& sub_tags, std::vector<LinearBVHNode>& nodes,
+              std::vector<PrimitiveGPU>& primitives) {
+    int end = bvh_subtree_end(nodes, index);
+    size_t first, last;
+    if (!subtree_primitives(nodes, index, first, last)) return false;
+    int node_shift = int(sub_nodes.size()) - (end - index);
+    int primitive_shift = int(sub_primitives.size()) - int(last - first);
+
+    // Nodes behind the subtree include every bottom-level tree, whose primitives also sit behind it
+    auto shift = [&](LinearBVHNode& node) {
+      if (node.n_primitives > 0) {
+        if (node.primitive_offset >= int(last)) node.primitive_offset += primitive_shift;
+      } else if (node.second_child_offset >= end) {
+        node.second_child_offset += node_shift;
+      }
+    };
+    std::for_each(nodes.begin(), nodes.begin() + index, shift);
+    std::for_each(nodes.begin() + end, nodes.end(), shift);
+    for (LinearBVHNode& node : sub_nodes) {
+      if (node.n_primitives > 0) {
+        node.primitive_offset += int(first);
+      } else {
+        node.second_child_offset += index;
+      }
+    }
+    replace_range(nodes, index, end, sub_nodes);
+    replace_range(primitives, first, last, sub_primitives);
+    replace_range(tags, first, last, sub_tags);
+    if (node_shift != 0) {
+      for (size_t p = 0; p < tags.size(); p++) {
+        PrimitiveGPU& prim = primitives[p];
+        if (prim.type == PrimitiveType::INSTANCE && prim.instance.blas_root >= end) {
+          prim.instance.blas_root += node_shift;
+        }
+      }
+    }
+    return true;
+  }
+
+  template <class T>
+  static void replace_range(std::vector<T>& array, size_t first, size_t last, const std::vector<T>& with) {
+    size_t old_size = last - first;
+    if (with.size() > old_size) {
+      array.insert(array.begin() + last, with.begin() + old_size, with.end());
+    } else if (with.size() < old_size) {
+      array.erase(array.begin() + first + with.size(), array.begin() + last);
+    }
+    std::copy(with.begin(), with.begin() + std::min(old_size, with.size()), array.begin() + first);
+  }
+};
+
+#endif // !BVH_EDIT_HPP
@@ -0,0 +1,168 @@
+#ifndef BVH_METRICS_HPP
+#define BVH_METRICS_HPP
+
+#include "bvh_build.hpp"
+
+#include <algorithm>
+#include <array>
+#include <ostream>
+#include <string>
+#include <vector>
+
+// One past the last node of the subtree rooted at 'index': every builder writes a subtree as a contiguous,
+// depth-first range, so it ends after the leaf reached by always taking the right child
+inline int bvh_subtree_end(const std::vector<LinearBVHNode>& nodes, int index) {
+  while (nodes[index].n_primitives == 0) index = nodes[index].second_child_offset;
+  return index + 1;
+}
+
+// Cost of tracing into the tree rooted at nodes[root], given its nodes' summed SAH-weighted areas
+inline float bvh_tree_cost(const std::vector<LinearBVHNode>& nodes, int root, double weighted_area) {
+  return float(weighted_area / std::max(double(node_half_area(nodes[root])), 1e-30));
+}
+
+// Cost of testing a leaf's primitives; an instance costs a trace of its bottom-level tree, from 'tree_costs'
+inline double bvh_leaf_cost(const LinearBVHNode& leaf, const std::vector<PrimitiveGPU>& primitives,
+                            const std::vector<float>& tree_costs, float intersection_cost) {
+  double cost = 0.0;
+  for (int p = 0; p < leaf.n_primitives; p++) {
+    const PrimitiveGPU& prim = primitives[leaf.primitive_offset + p];
+    cost += prim.type == PrimitiveType::INSTANCE ? tree_costs[prim.instance.blas_root] : intersection_cost;
+  }
+  return cost;
+}
+
+// Surface area heuristic cost of a flattened BVH: every node's area weighted by the cost of visiting it (or of
+// testing its primitives, for a leaf), relative to the root's area. The expected cost of tracing one ray, up to
+// the SAH's assumptions; lower is better. An instance's cost is that of its bottom-level tree.
+inline float bvh_sah_cost(const std::vector<LinearBVHNode>& nodes, const std::vector<PrimitiveGPU>& primitives,
+                          float traversal_cost = 2.0f, float intersection_cost = 1.0f) {
+  if (nodes.empty()) return 0.0f;
+  // Bottom-level trees follow the top-level one; cost them first, in their own space
+  std::vector<float> tree_costs(nodes.size(), 0.0f);
+  auto cost_range = [&](int begin, int end) {
+    double total = 0.0;
+    for (int i = begin; i < end; i++) {
+      const LinearBVHNode& n = nodes[i];
+      double weight = n.n_primitives > 0 ? bvh_leaf_cost(n, primitives, tree_costs, intersection_cost)
+                                         : traversal_cost;
+      total += node_half_area(n) * weight;
+    }
+    return bvh_tree_cost(nodes, begin, total);
+  };
+  int top_end = bvh_subtree_end(nodes, 0);
+  for (int root = top_end; root < int(nodes.size());) {
+    int end = bvh_subtree_end(nodes, root);
+    tree_costs[root] = cost_range(root, end);
+    root = end;
+  }
+  return cost_range(0, top_end);
+}
+
+// Shape and quality of a flattened BVH, for comparing builders and spotting degenerate trees. Counts cover the
+// top-level tree and every instanced bottom-level tree; each bottom-level tree is measured in its own space.
+struct bvh_metrics {
+  // Leaves by primitive count: bucket b holds (2^(b-1), 2^b] primitives, so 1, 2, 3-4, 5-8, ..., and the last
+  // bucket everything larger
+  static constexpr int leaf_histogram_buckets = 8;
+
+  int node_count = 0;
+  int leaf_count = 0;
+  int primitive_refs = 0;     // primitives referenced by leaves, counting SBVH duplicates
+  int instance_count = 0;     // INSTANCE references in the top-level tree, counting SBVH duplicates
+  int bottom_level_trees = 0;
+  float sah_cost = 0.0f;      // bvh_sah_cost
+  int max_depth = 0;          // of a leaf below its tree's root
+  float average_depth = 0.0f; // over all leaves
+  std::array<int, leaf_histogram_buckets> leaf_histogram{};
+  double sibling_overlap = 0.0; // summed volume where the boxes of two children of a node intersect
+  double root_volume = 0.0;
+  // Largest top-level leaf's surface area over the root's. Near 1 means a single leaf spans the whole scene (a
+  // huge boundary or ground primitive) and every ray that enters the scene also enters that leaf.
+  float largest_leaf_area = 0.0f;
+};
+
+// One pass over a flattened BVH; 'primitives' are needed to find instances
+inline bvh_metrics measure_bvh(const std::vector<LinearBVHNode>& nodes, const std::vector<PrimitiveGPU>& primitives,
+                               float traversal_cost = 2.0f, float intersection_cost = 1.0f) {
+  bvh_metrics m;
+  if (nodes.empty()) return m;
+  m.node_count = int(nodes.size());
+  m.sah_cost = bvh_sah_cost(nodes, primitives, traversal_cost, intersection_cost);
+
+  auto volume = [](const Vec3f& lo, const Vec3f& hi) {
+    return std::max(0.0, double(hi.x) - lo.x) * std::max(0.0, double(hi.y) - lo.y) *
+           std::max(0.0, double(hi.z) - lo.z);
+  };
+  m.root_volume = volume(nodes[0].aabb_min, nodes[0].aabb_max);
+  float root_area = std::max(node_half_area(nodes[0]), 1e-30f);
+  int top_end = bvh_subtree_end(nodes, 0);
+
+  // Children follow their parents, so one forward sweep per tree hands every node its depth
+  std::vector<int> depth(nodes.size(), 0);
+  long long depth_sum = 0;
+  for (int root = 0; root < int(nodes.size());) {
+    int end = bvh_subtree_end(nodes, root);
+    if (root > 0) m.bottom_level_trees++;
+    for (int i = root; i < end; i++) {
+      const LinearBVHNode& n = nodes[i];
+      if (n.n_primitives > 0) {
+        m.leaf_count++;
+        m.primitive_refs += n.n_primitives;
+        m.max_depth = std::max(m.max_depth, depth[i]);
+        depth_sum += depth[i];
+        int bucket = 0;
+        while (bucket < bvh_metrics::leaf_histogram_buckets - 1 && (1 << bucket) < n.n_primitives) bucket++;
+        m.leaf_histogram[bucket]++;
+        if (i < top_end) {
+          m.largest_leaf_area = std::max(m.largest_leaf_area, node_half_area(n) / root_area);
+          for (int p = 0; p < n.n_primitives; p++) {
+            m.instance_count += primitives[n.primitive_offset + p].type == PrimitiveType::INSTANCE;
+          }
+        }
+        continue;
+      }
+      const LinearBVHNode& a = nodes[i + 1];
+      const LinearBVHNode& b = nodes[n.second_child_offset];
+      depth[i + 1] = depth[n.second_child_offset] = depth[i] + 1;
+      Vec3f lo{std::max(a.aabb_min.x, b.aabb_min.x), std::max(a.aabb_min.y, b.aabb_min.y),
+               std::max(a.aabb_min.z, b.aabb_min.z)};
+      Vec3f hi{std::min(a.aabb_max.x, b.aabb_max.x), std::min(a.aabb_max.y, b.aabb_max.y),
+               std::min(a.aabb_max.z, b.aabb_max.z)};
+      m.sibling_overlap += volume(lo, hi);
+    }
+    root = end;
+  }
+  m.average_depth = m.leaf_count > 0 ? float(double(depth_sum) / m.leaf_count) : 0.0f;
+  return m;
+}
+
+// Label of leaf histogram bucket 'b': "1", "2", "3-4", ..., "65+"
+inline std::string leaf_histogram_label(int b) {
+  if (b == 0) return "1";
+  if (b == bvh_metrics::leaf_histogram_buckets - 1) return std::to_string((1 << (b - 1)) + 1) + "+";
+  if (b == 1) return "2";
+  return std::to_string((1 << (b - 1)) + 1) + "-" + std::to_string(1 << b);
+}
+
+// Multi-line report, each line starting with 'indent'
+inline void print_bvh_metrics(std::ostream& out, const bvh_metrics& m, const char* indent = "  ") {
+  out << indent << m.node_count << " nodes, " << m.leaf_count << " leaves, " << m.primitive_refs
+      << " primitive refs";
+  if (m.instance_count > 0) {
+    out << ", " << m.instance_count << " instance refs to " << m.bottom_level_trees << " bottom-level trees";
+  }
+  out << "\n" << indent << "SAH cost " << m.sah_cost << ", depth max " << m.max_depth << " / avg "
+      << m.average_depth << "\n" << indent << "leaf sizes:";
+  for (int b = 0; b < bvh_metrics::leaf_histogram_buckets; b++) {
+    if (m.leaf_histogram[b] > 0) out << " " << leaf_histogram_label(b) << ": " << m.leaf_histogram[b];
+  }
+  out << "\n" << indent << "sibling overlap " << m.sibling_overlap << " ("
+      << (m.root_volume > 0.0 ? 100.0 * m.sibling_overlap / m.root_volume : 0.0) << "% of root volume)\n";
+  if (m.leaf_count > 1 && m.largest_leaf_area > 0.5f) {
+    out << indent << "warning: a leaf spans " << 100.0f * m.largest_leaf_area
+        << "% of the root's surface area; every ray entering the scene enters it\n";
+  }
+}
+
+#endif // !BVH_METRICS_HPP
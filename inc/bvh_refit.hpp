@@ -0,0 +1,145 @@
+#ifndef BVH_REFIT_HPP
+#define BVH_REFIT_HPP
+
+#include "bvh_build.hpp"
+#include "bvh_metrics.hpp"
+#include "thread_pool.hpp"
+
+#include <algorithm>
+#include <cmath>
+#include <vector>
+
+// World-space bounds of a flattened primitive, read back from its GPU form. Moving primitives cover their whole
+// motion over shutter time [0, 1]. An INSTANCE needs its bottom-level tree's root, 'nodes[blas_root]'.
+inline aabb primitive_bounds(const PrimitiveGPU& prim, const std::vector<LinearBVHNode>& nodes) {
+  auto point = [](const Vec3f& v) { return point3(v.x, v.y, v.z); };
+  auto sphere_box = [&](const Vec3f& c, float r) { return aabb(point(c) - vec3(r, r, r), point(c) + vec3(r, r, r)); };
+  auto quad_box = [&](const Vec3f& q, const Vec3f& u, const Vec3f& v) {
+    point3 o = point(q);
+    return aabb(aabb(o, o + point(u) + point(v)), aabb(o + point(u), o + point(v)));
+  };
+
+  switch (prim.type) {
+  case PrimitiveType::SPHERE:
+    return sphere_box(prim.sphere.center, prim.sphere.radius);
+  case PrimitiveType::MOVING_SPHERE: {
+    const Vec3f& c = prim.moving_sphere.center_start;
+    const Vec3f& d = prim.moving_sphere.center_vec;
+    return aabb(sphere_box(c, prim.moving_sphere.radius),
+                sphere_box(Vec3f{c.x + d.x, c.y + d.y, c.z + d.z}, prim.moving_sphere.radius));
+  }
+  case PrimitiveType::QUAD:
+    return quad_box(prim.quad.Q, prim.quad.u, prim.quad.v);
+  case PrimitiveType::MOVING_QUAD: {
+    const Vec3f& q = prim.moving_quad.Q_start;
+    const Vec3f& d = prim.moving_quad.Q_vec;
+    return aabb(quad_box(q, prim.moving_quad.u, prim.moving_quad.v),
+                quad_box(Vec3f{q.x + d.x, q.y + d.y, q.z + d.z}, prim.moving_quad.u, prim.moving_quad.v));
+  }
+  case PrimitiveType::VOLUME_SPHERE:
+    return sphere_box(prim.volume_sphere.center, prim.volume_sphere.radius);
+  case PrimitiveType::VOLUME_BOX: {
+    // hit_primitive rotates rays into the box's frame; rotate the corners back out
+    const auto& b = prim.volume_box;
+    aabb box = aabb::empty;
+    for (int i = 0; i < 8; i++) {
+      float x = (i & 1) ? b.local_max.x : b.local_min.x;
+      float y = (i & 2) ? b.local_max.y : b.local_min.y;
+      float z = (i & 4) ? b.local_max.z : b.local_min.z;
+      point3 p(b.cos_theta * x + b.sin_theta * z + b.offset.x, y + b.offset.y,
+               -b.sin_theta * x + b.cos_theta * z + b.offset.z);
+      box = aabb(box, aabb(p, p));
+    }
+    return box;
+  }
+  case PrimitiveType::INSTANCE: {
+    const LinearBVHNode& root = nodes[prim.instance.blas_root];
+    return instance_bounds(prim, aabb(point(root.aabb_min), point(root.aabb_max)));
+  }
+  }
+  return aabb::empty;
+}
+
+// Updates a flattened BVH in place after its primitives moved, instead of rebuilding it. Leaf bounds are recomputed
+// from the primitives and merged bottom-up; the topology stays as built. That is O(n) and keeps the tree valid,
+// but as objects drift apart their nodes' boxes grow and overlap, so refit() also measures the SAH cost and
+// reports when it has degraded past rebuild_threshold times the cost right after the last build.
+//
+// Relies on the layout every builder writes: each subtree occupies a contiguous, depth-first range of the array,
+// left child right after its parent. Instanced bottom-level trees are refit first, then the top-level tree over
+// them. With 'parallel' set, large subtrees refit as tasks on thread_pool::global(). Leaves of an SBVH get their
+// primitives' full bounds back, not the clipped ones.
+class bvh_refitter {
+public:
+  float rebuild_threshold = 1.5f; // refit() fails once the SAH cost exceeds this multiple of the built tree's
+  float traversal_cost = 2.0f;    // SAH weights, as in the builders
+  float intersection_cost = 1.0f;
+  bool parallel = true;           // use thread_pool::global() for large subtrees
+
+  // Takes the quality of a freshly built tree as the reference for later refits
+  void reset(const std::vector<LinearBVHNode>& nodes, const std::vector<PrimitiveGPU>& primitives) {
+    built_cost = bvh_sah_cost(nodes, primitives, traversal_cost, intersection_cost);
+    last_cost = built_cost;
+  }
+
+  // Refits 'nodes' to 'primitives'. Returns false when the refitted tree has degraded enough that it should be
+  // rebuilt; it is still valid to trace either way.
+  bool refit(std::vector<LinearBVHNode>& nodes, const std::vector<PrimitiveGPU>& primitives) {
+    if (nodes.empty()) return true;
+    tree_costs.assign(nodes.size(), 0.0f);
+    int top_end = bvh_subtree_end(nodes, 0);
+    for (int root = top_end; root < int(nodes.size());) {
+      int end = bvh_subtree_end(nodes, root);
+      tree_costs[root] = bvh_tree_cost(nodes, root, refit_range(nodes, primitives, root, end));
+      root = end;
+    }
+    last_cost = bvh_tree_cost(nodes, 0, refit_range(nodes, primitives, 0, top_end));
+    return last_cost <= rebuild_threshold * built_cost;
+  }
+
+  float cost() const { return last_cost; }            // SAH cost after the last build or refit
+  float reference_cost() const { return built_cost; } // SAH cost right after the last build
+
+private:
+  // Subtrees at least this many nodes refit as separate tasks
+  static constexpr int parallel_refit_span = 8192;
+
+  float built_cost = 0.0f;
+  float last_cost = 0.0f;
+  std::vector<float> tree_costs; // per bottom-level root, during refit()
+
+  // Refits the subtree rooted at 'index', which spans [index, end); returns its SAH-weighted area
+  double refit_range(std::vector<LinearBVHNode>& nodes, const std::vector<PrimitiveGPU>& primitives, int index,
+                     int end) const {
+    LinearBVHNode& node = nodes[index];
+    if (!parallel || end - index < parallel_refit_span || node.n_primitives > 0) {
+      // Children sit after their parents, so a reverse sweep sees both children before each parent
+      double weighted_area = 0.0;
+      for (int i = end - 1; i >= index; i--) {
+        LinearBVHNode& n = nodes[i];
+        if (n.n_primitives > 0) {
+          aabb box = aabb::empty;
+          for (int p = 0; p < n.n_primitives; p++) {
+            box = aabb(box, primitive_bounds(primitives[n.primitive_offset + p], nodes));
+          }
+          set_node_bounds(n, box);
+          weighted_area += node_half_area(n) * bvh_leaf_cost(n, primitives, tree_costs, intersection_cost);
+        } else {
+          merge_child_bounds(nodes, i);
+          weighted_area += node_half_area(n) * traversal_cost;
+        }
+      }
+      return weighted_area;
+    }
+
+    int right = node.second_child_offset;
+    thread_pool& pool = thread_pool::global();
+    auto right_task = pool.submit([&, right, end] { return refit_range(nodes, primitives, right, end); });
+    double left_area = refit_range(nodes, primitives, index + 1, right);
+    double right_area = pool.wait(right_task);
+    merge_child_bounds(nodes, index);
+    return left_area + right_area + node_half_area(node) * traversal_cost;
+  }
+};
+
+#endif // !BVH_REFIT_HPP
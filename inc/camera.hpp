@@ -1,13 +1,17 @@
 #ifndef CAMERA_HPP
 #define CAMERA_HPP
 #include "color.hpp"
+#include "flat_bvh.hpp"
 #include "hittable.hpp"
 #include "material.hpp"
+#include "thread_pool.hpp"
+#include "tile_framebuffer.hpp"
+#include "tile_scheduler.hpp"
+#include "wavefront.hpp"
 #include <algorithm>
 #include <atomic>
 #include <chrono>
-#include <mutex>
-#include <thread>
+#include <future>
 #include <vector>
 
 class camera {
@@ -16,6 +20,13 @@ public:
   int image_width = 100;
   int samples_per_pixel = 10;
   int max_depth = 10;
+  // Bounce budgets per kind of scatter; 0 leaves that kind limited only by
+  // max_depth.
+  int max_diffuse_depth = 0;
+  int max_specular_depth = 0;
+  int max_volume_depth = 0;
+  // Bounces before Russian roulette may terminate a path
+  int russian_roulette_depth = 3;
   color background;
   double vfov = 90;
   point3 lookfrom = point3(0, 0, 0);
@@ -30,139 +41,180 @@ public:
   bool enable_reflections = true;
   bool enable_refractions = true;
 
-  // Render to buffer with progress tracking and real-time updates
+  // Work distribution: the image is split into square tiles that are dealt to
+  // per-thread deques in 'tile_order' and rebalanced by work stealing.
+  int tile_size = 16;
+  TileOrder tile_order = TileOrder::HILBERT;
+
+  // MEGAKERNEL traces each sample start to finish. WAVEFRONT traces all of a
+  // tile's samples together, bounce by bounce, with shading batched by
+  // material type, like the CUDA renderer.
+  CpuPipeline pipeline = CpuPipeline::MEGAKERNEL;
+
+  // Progressive rendering: samples are accumulated in linear HDR across
+  // calls, 'samples_per_pass' spp at a time over the whole image, until every
+  // pixel holds 'samples_per_pixel' samples. Calling again with a higher
+  // sample count tops up the existing accumulation instead of starting over.
+  int samples_per_pass = 1;
+
+  // Every camera sample draws from its own generator keyed by (pixel, sample
+  // index, seed), so a given seed reproduces the same image regardless of
+  // thread count or tile order.
+  uint64_t seed = 0;
+
+  // Adaptive sampling: a pixel stops taking samples once it holds at least
+  // 'adaptive_min_samples' and the standard error of its mean luminance is
+  // below 'adaptive_threshold' times that mean. The samples it saves go to
+  // the pixels that are still noisy, up to 'adaptive_max_samples' each, while
+  // the image as a whole stays within samples_per_pixel on average.
+  bool adaptive_sampling = false;
+  double adaptive_threshold = 0.02;
+  int adaptive_min_samples = 16;
+  int adaptive_max_samples = 1024;
+
+  // Render to a framebuffer with progress tracking and real-time updates.
+  // Finished tiles are published into 'framebuffer' as they complete, so
+  // another thread may snapshot it at any time during the render.
   void render_to_buffer_with_progress(const hittable& world,
-                                      std::vector<unsigned char>& buffer,
-                                      std::mutex& buffer_mutex,
+                                      tile_framebuffer& framebuffer,
                                       std::atomic<float>& progress,
                                       const std::atomic<bool>& should_stop,
                                       std::atomic<bool>& texture_needs_update) {
     initialize();
-
-    // Ensure buffer is properly sized
-    {
-      std::lock_guard<std::mutex> lock(buffer_mutex);
-      buffer.resize(image_width * image_height * 3);
-      std::fill(buffer.begin(), buffer.end(), 0); // Clear to black
-    }
+    prepare_accumulation();
+    rays_traced.store(0);
 
     int total_pixels = image_width * image_height;
-    std::atomic<int> completed_pixels{0};
-    std::atomic<int> pixels_since_update{0};
-    const int update_frequency = std::max(1, total_pixels / 100); // 1%
-
-    std::cout << "Rendering " << image_width << "x" << image_height << " with "
-              << samples_per_pixel << " samples per pixel..." << std::endl;
-
-    std::atomic<int> current_line{0};
-    int num_threads = std::thread::hardware_concurrency();
-    if (num_threads == 0) num_threads = 4;
-    std::vector<std::thread> threads;
-
-    auto worker = [&]() {
-      std::vector<unsigned char> scanline_buffer(image_width * 3);
-      while (!should_stop.load()) {
-        int j = current_line.fetch_add(1);
-        if (j >= image_height) break;
-
-        int row_completed_pixels = 0;
-
-        for (int i = 0; i < image_width && !should_stop.load(); i++) {
-          color pixel_color(0, 0, 0);
-          int sample_count = enable_antialiasing ? samples_per_pixel : 1;
-
-          for (int sample = 0; sample < sample_count && !should_stop.load();
-               sample++) {
-            ray r = get_ray(i, j);
-            pixel_color += ray_color(r, max_depth, world);
-          }
-
-          if (should_stop.load()) break;
-
-          double scale = 1.0 / sample_count;
-          pixel_color *= scale;
-
-          auto r_val = linear_to_gamma(pixel_color.x());
-          auto g_val = linear_to_gamma(pixel_color.y());
-          auto b_val = linear_to_gamma(pixel_color.z());
-
-          static const interval intensity(0.000, 0.999);
-          scanline_buffer[i * 3] =
-              static_cast<unsigned char>(256 * intensity.clamp(r_val));
-          scanline_buffer[i * 3 + 1] =
-              static_cast<unsigned char>(256 * intensity.clamp(g_val));
-          scanline_buffer[i * 3 + 2] =
-              static_cast<unsigned char>(256 * intensity.clamp(b_val));
-          row_completed_pixels++;
-        }
 
-        if (row_completed_pixels > 0) {
-          {
-            std::lock_guard<std::mutex> lock(buffer_mutex);
-            int idx = j * image_width * 3;
-            std::copy(scanline_buffer.begin(),
-                      scanline_buffer.begin() + row_completed_pixels * 3,
-                      buffer.begin() + idx);
-          }
-
-          int completed = completed_pixels.fetch_add(row_completed_pixels) +
-                          row_completed_pixels;
-          progress.store(static_cast<float>(completed) / total_pixels);
-
-          int since_update =
-              pixels_since_update.fetch_add(row_completed_pixels) +
-              row_completed_pixels;
-
-          if (since_update >= update_frequency || completed == total_pixels) {
-            texture_needs_update.store(true);
-            pixels_since_update.store(0);
-
-            static std::atomic<int> last_reported_percent{-1};
-            int current_percent = static_cast<int>(
-                static_cast<float>(completed) / total_pixels * 100);
-            if (current_percent >= last_reported_percent.load() + 10) {
-              std::cout << "Progress: " << current_percent << "%" << std::endl;
-              last_reported_percent.store(current_percent);
-            }
+    // Lay the framebuffer out on the tile grid and show whatever has already
+    // been accumulated
+    framebuffer.resize(image_width, image_height, tile_size);
+    {
+      std::vector<unsigned char> tile_buffer;
+      for (int t = 0; t < framebuffer.tile_count(); t++) {
+        image_tile tile = framebuffer.tile_rect(t);
+        int tile_w = tile.x1 - tile.x0;
+        tile_buffer.resize(size_t(tile_w) * (tile.y1 - tile.y0) * 3);
+        for (int j = tile.y0; j < tile.y1; j++) {
+          for (int i = tile.x0; i < tile.x1; i++) {
+            int t_idx = ((j - tile.y0) * tile_w + (i - tile.x0)) * 3;
+            write_display_pixel(j * image_width + i, &tile_buffer[t_idx]);
           }
         }
-
-        if (j % std::max(1, image_height / 20) == 0) {
-          texture_needs_update.store(true);
-        }
+        framebuffer.publish(tile, tile_buffer.data(), tile.y1 - tile.y0);
       }
-    };
-
-    for (int i = 0; i < num_threads; ++i) {
-      threads.emplace_back(worker);
+    }
+    texture_needs_update.store(true);
+
+    // Passes raise every unconverged pixel to the pass target. Without
+    // adaptive sampling all pixels stay unconverged, so the sample budget is
+    // exactly target_samples per pixel; with it, passes continue up to the
+    // per-pixel maximum until the budget is spent or every pixel converged.
+    bool adaptive = is_adaptive();
+    int target_samples = !enable_antialiasing ? 1
+                         : adaptive ? std::max(adaptive_min_samples,
+                                               adaptive_max_samples)
+                                    : samples_per_pixel;
+    update_convergence();
+    const long long budget =
+        static_cast<long long>(adaptive ? samples_per_pixel : target_samples) *
+        total_pixels;
+
+    if (accumulated_samples >= target_samples || total_samples() >= budget ||
+        active_pixels() == 0) {
+      progress.store(1.0f);
+      std::cout << "Accumulation already holds " << average_samples()
+                << " samples per pixel" << std::endl;
+      return;
     }
 
-    for (auto& t : threads) {
-      if (t.joinable()) {
-        t.join();
-      }
+    std::cout << "Rendering " << image_width << "x" << image_height
+              << ": accumulating " << average_samples() << " -> "
+              << samples_per_pixel << " samples per pixel in passes of "
+              << std::max(1, samples_per_pass)
+              << (adaptive ? " (adaptive)" : "") << "..." << std::endl;
+
+    const long long total_work = budget - total_samples();
+    std::atomic<long long> completed_work{0};
+    std::atomic<int> last_reported_percent{-1};
+
+    while (accumulated_samples < target_samples && !should_stop.load()) {
+      int pass_target = std::min(
+          target_samples, accumulated_samples + std::max(1, samples_per_pass));
+      render_pass(world, pass_target, framebuffer, progress,
+                  should_stop, texture_needs_update, total_work,
+                  completed_work, last_reported_percent);
+      if (should_stop.load()) break;
+      accumulated_samples = pass_target;
+      update_convergence();
+      if (total_samples() >= budget || active_pixels() == 0) break;
     }
+    texture_needs_update.store(true);
 
     if (!should_stop.load()) {
-      std::cout << "Render completed: " << completed_pixels.load() << " pixels"
-                << std::endl;
+      std::cout << "Render completed: " << average_samples()
+                << " samples per pixel accumulated";
+      if (adaptive) {
+        std::cout << " (" << (total_pixels - active_pixels()) << "/"
+                  << total_pixels << " pixels converged)";
+      }
+      std::cout << std::endl;
     } else {
-      std::cout << "Render stopped at " << completed_pixels.load() << "/"
-                << total_pixels << " pixels" << std::endl;
+      std::cout << "Render stopped with " << average_samples()
+                << " samples per pixel" << std::endl;
     }
   }
 
   // Original render method for compatibility
   void render_to_buffer(const hittable& world,
                         std::vector<unsigned char>& buffer) {
-    std::mutex dummy_mutex;
+    tile_framebuffer framebuffer;
     std::atomic<float> dummy_progress{0.0f};
     std::atomic<bool> dummy_stop{false};
     std::atomic<bool> dummy_texture_update{false};
-    render_to_buffer_with_progress(world, buffer, dummy_mutex, dummy_progress,
+    render_to_buffer_with_progress(world, framebuffer, dummy_progress,
                                    dummy_stop, dummy_texture_update);
+    framebuffer.snapshot(buffer);
   }
 
+  // Discard the accumulation on the next render (e.g. after the scene
+  // changed). Camera and image settings are compared automatically.
+  void reset_accumulation() { reset_requested.store(true); }
+
+  int get_accumulated_samples() const { return accumulated_samples; }
+
+  // Scene intersections performed by the last render call: every camera ray
+  // and every bounce, whichever pipeline traced them.
+  long long get_rays_traced() const { return rays_traced.load(); }
+
+  // Mean samples per pixel over the image; differs from the pass count above
+  // once adaptive sampling lets pixels stop at different counts.
+  double average_samples() const {
+    return pixel_samples.empty()
+               ? 0.0
+               : double(total_samples()) / double(pixel_samples.size());
+  }
+
+  // Per-pixel sample counts as an ASCII PGM, brighter meaning more samples.
+  void write_sample_map(std::ostream& out) const {
+    int max_count = 1;
+    for (int n : pixel_samples) max_count = std::max(max_count, n);
+    max_count = std::min(max_count, 65535);
+    out << "P2\n" << image_width << " " << image_height << "\n"
+        << max_count << "\n";
+    for (int j = 0; j < image_height; j++) {
+      for (int i = 0; i < image_width; i++) {
+        size_t p = size_t(j) * image_width + i;
+        int n = p < pixel_samples.size() ? pixel_samples[p] : 0;
+        out << std::min(n, max_count) << (i + 1 < image_width ? " " : "\n");
+      }
+    }
+  }
+
+  // Linear HDR sums, 3 floats per pixel; divide by the pixel's sample count.
+  const std::vector<float>& accumulation_buffer() const { return accum; }
+  const std::vector<int>& pixel_sample_counts() const { return pixel_samples; }
+
 private:
   int image_height;
   point3 center;
@@ -173,6 +225,24 @@ private:
   vec3 defocus_disk_u;
   vec3 defocus_disk_v;
 
+  // Linear HDR running sums (3 floats per pixel) and per-pixel sample counts.
+  // Counts are tracked per pixel so a pass interrupted by a stop request can
+  // be resumed without double-counting the pixels it already finished.
+  std::vector<float> accum;
+  std::vector<int> pixel_samples;
+  // Welford running mean and M2 of sample luminance (2 doubles per pixel),
+  // used for the adaptive convergence test.
+  std::vector<double> lum_stats;
+  std::vector<unsigned char> converged; // adaptive mask, rebuilt every pass
+  int accumulated_samples = 0;
+  std::atomic<bool> reset_requested{false};
+  std::vector<double> accum_view; // settings the accumulation was made with
+
+  // Rays this thread has cast into the scene; render_pass folds each tile's
+  // share into rays_traced.
+  std::atomic<long long> rays_traced{0};
+  inline static thread_local long long thread_rays = 0;
+
   void initialize() {
     image_height = int(image_width / aspect_ratio);
     image_height = (image_height < 1) ? 1 : image_height;
@@ -211,66 +281,544 @@ private:
     defocus_disk_v = v * defocus_radius;
   }
 
-  ray get_ray(int i, int j) const {
+  std::vector<double> view_signature() const {
+    // Every setting that changes what a sample converges to
+    return {double(image_width),
+            double(image_height),
+            lookfrom.x(),
+            lookfrom.y(),
+            lookfrom.z(),
+            lookat.x(),
+            lookat.y(),
+            lookat.z(),
+            vup.x(),
+            vup.y(),
+            vup.z(),
+            vfov,
+            defocus_angle,
+            focus_dist,
+            background.x(),
+            background.y(),
+            background.z(),
+            double(max_depth),
+            double(max_diffuse_depth),
+            double(max_specular_depth),
+            double(max_volume_depth),
+            double(enable_antialiasing),
+            double(enable_shadows),
+            double(enable_reflections),
+            double(enable_refractions),
+            double(adaptive_sampling),
+            double(seed)};
+  }
+
+  void prepare_accumulation() {
+    auto view = view_signature();
+    size_t total_pixels = size_t(image_width) * image_height;
+    if (reset_requested.exchange(false) || view != accum_view ||
+        pixel_samples.size() != total_pixels) {
+      accum.assign(total_pixels * 3, 0.0f);
+      pixel_samples.assign(total_pixels, 0);
+      lum_stats.assign(total_pixels * 2, 0.0);
+      accumulated_samples = 0;
+      accum_view = view;
+    }
+  }
+
+  bool is_adaptive() const { return adaptive_sampling && enable_antialiasing; }
+
+  bool pixel_error_ok(int p) const {
+    int n = pixel_samples[p];
+    if (n >= std::max(adaptive_min_samples, adaptive_max_samples)) return true;
+    if (n < std::max(2, adaptive_min_samples)) return false;
+    double mean = lum_stats[p * 2];
+    double variance = lum_stats[p * 2 + 1] / (n - 1);
+    double std_error = std::sqrt(variance / n);
+    // The floor keeps near-black pixels from demanding endless samples
+    return std_error <= adaptive_threshold * std::max(mean, 1e-3);
+  }
+
+  // Rebuild the convergence mask between passes. A pixel only counts as
+  // converged when its whole 3x3 neighbourhood passes the error test; a few
+  // samples that happen to agree (e.g. all bouncing into the sky) are not
+  // enough to stop a pixel whose neighbours are still noisy.
+  void update_convergence() {
+    size_t total_pixels = pixel_samples.size();
+    converged.assign(total_pixels, 0);
+    if (!is_adaptive()) return;
+
+    std::vector<unsigned char> error_ok(total_pixels);
+    for (size_t p = 0; p < total_pixels; p++) {
+      error_ok[p] = pixel_error_ok(int(p));
+    }
+    int max_samples = std::max(adaptive_min_samples, adaptive_max_samples);
+    for (int j = 0; j < image_height; j++) {
+      for (int i = 0; i < image_width; i++) {
+        int p = j * image_width + i;
+        bool ok = true;
+        for (int y = std::max(0, j - 1); ok && y <= j + 1 && y < image_height;
+             y++) {
+          for (int x = std::max(0, i - 1); x <= i + 1 && x < image_width; x++) {
+            if (!error_ok[y * image_width + x]) {
+              ok = false;
+              break;
+            }
+          }
+        }
+        converged[p] = ok || pixel_samples[p] >= max_samples;
+      }
+    }
+  }
+
+  long long total_samples() const {
+    long long total = 0;
+    for (int n : pixel_samples) total += n;
+    return total;
+  }
+
+  int active_pixels() const {
+    return int(std::count(converged.begin(), converged.end(), 0));
+  }
+
+  int pixel_pass_samples(int p, int pass_target) const {
+    return converged[p] ? 0 : std::max(0, pass_target - pixel_samples[p]);
+  }
+
+  void record_luminance(int p, int index, const color& sample_color) {
+    // Welford update with the pixel's 'index'-th sample
+    double& mean = lum_stats[p * 2];
+    double& m2 = lum_stats[p * 2 + 1];
+    double lum = luminance(sample_color);
+    double delta = lum - mean;
+    mean += delta / (index + 1);
+    m2 += delta * (lum - mean);
+  }
+
+  void commit_pixel(int p, const color& pixel_color, int samples) {
+    if (samples <= 0) return;
+    accum[p * 3] += float(pixel_color.x());
+    accum[p * 3 + 1] += float(pixel_color.y());
+    accum[p * 3 + 2] += float(pixel_color.z());
+    pixel_samples[p] += samples;
+  }
+
+  void write_display_pixel(int p, unsigned char* out) const {
+    // Resolve the running sum to a gamma-encoded byte triple
+    int n = pixel_samples[p];
+    double scale = n > 0 ? 1.0 / n : 0.0;
+    static const interval intensity(0.000, 0.999);
+    for (int c = 0; c < 3; c++) {
+      auto value = linear_to_gamma(accum[p * 3 + c] * scale);
+      out[c] = static_cast<unsigned char>(256 * intensity.clamp(value));
+    }
+  }
+
+  // Bring every unconverged pixel up to 'pass_target' samples, tile by tile.
+  void render_pass(const hittable& world, int pass_target,
+                   tile_framebuffer& framebuffer, std::atomic<float>& progress,
+                   const std::atomic<bool>& should_stop,
+                   std::atomic<bool>& texture_needs_update,
+                   long long total_work, std::atomic<long long>& completed_work,
+                   std::atomic<int>& last_reported_percent) {
+    thread_pool& pool = thread_pool::global();
+    int num_workers = pool.size();
+    tile_scheduler scheduler(image_width, image_height, tile_size, tile_order,
+                             num_workers);
+    const int tiles_per_update = std::max(1, scheduler.tile_count() / 20);
+    std::atomic<int> completed_tiles{0};
+
+    auto worker = [&](int worker_index) {
+      int max_tile = std::max(1, tile_size);
+      std::vector<unsigned char> tile_buffer(max_tile * max_tile * 3);
+      wavefront_batch batch;
+      image_tile tile;
+      while (!should_stop.load() && scheduler.next_tile(worker_index, tile)) {
+        int tile_w = tile.x1 - tile.x0;
+        int completed_rows = 0;
+        long long tile_work = 0;
+        long long rays_before = thread_rays;
+
+        if (pipeline == CpuPipeline::WAVEFRONT) {
+          // The whole tile is committed before trace_tile_wavefront returns
+          tile_work = trace_tile_wavefront(world, tile, pass_target, batch);
+          completed_rows = tile.y1 - tile.y0;
+          for (int j = tile.y0; j < tile.y1; j++) {
+            for (int i = tile.x0; i < tile.x1; i++) {
+              int t_idx = ((j - tile.y0) * tile_w + (i - tile.x0)) * 3;
+              write_display_pixel(j * image_width + i, &tile_buffer[t_idx]);
+            }
+          }
+        }
+
+        for (int j = tile.y0 + completed_rows;
+             j < tile.y1 && !should_stop.load(); j++) {
+          for (int i = tile.x0; i < tile.x1; i++) {
+            int p = j * image_width + i;
+            color pixel_color(0, 0, 0);
+            int samples = pixel_pass_samples(p, pass_target);
+
+            for (int sample = 0; sample < samples; sample++) {
+              int index = pixel_samples[p] + sample;
+              sampler smp = sampler::for_pixel_sample(p, index, seed);
+              ray r = get_ray(i, j, smp);
+              color sample_color = ray_color(r, max_depth, world, smp);
+              pixel_color += sample_color;
+              record_luminance(p, index, sample_color);
+            }
+
+            commit_pixel(p, pixel_color, samples);
+            tile_work += samples;
+
+            int t_idx = ((j - tile.y0) * tile_w + (i - tile.x0)) * 3;
+            write_display_pixel(p, &tile_buffer[t_idx]);
+          }
+          completed_rows++;
+        }
+
+        rays_traced.fetch_add(thread_rays - rays_before);
+        if (completed_rows == 0) continue;
+
+        framebuffer.publish(tile, tile_buffer.data(), completed_rows);
+
+        long long completed = completed_work.fetch_add(tile_work) + tile_work;
+        float fraction = total_work > 0
+                             ? std::min(1.0f, float(completed) / total_work)
+                             : 1.0f;
+        progress.store(fraction);
+
+        int done_tiles = completed_tiles.fetch_add(1) + 1;
+        if (done_tiles % tiles_per_update == 0 ||
+            done_tiles == scheduler.tile_count()) {
+          texture_needs_update.store(true);
+
+          int current_percent = static_cast<int>(fraction * 100);
+          int last_percent = last_reported_percent.load();
+          if (current_percent >= last_percent + 10 &&
+              last_reported_percent.compare_exchange_strong(last_percent,
+                                                            current_percent)) {
+            std::cout << "Progress: " << current_percent << "%" << std::endl;
+          }
+        }
+      }
+    };
+
+    std::vector<std::future<void>> workers;
+    for (int i = 0; i < num_workers; ++i) {
+      workers.push_back(pool.submit([&worker, i] { worker(i); }));
+    }
+    pool.wait(workers);
+  }
+
+  ray get_ray(int i, int j, sampler& smp) const {
     // Get a randomly sampled camera ray for pixel (i,j)
-    vec3 offset = enable_antialiasing ? sample_square() : vec3(0, 0, 0);
+    vec3 offset = enable_antialiasing ? sample_square(smp) : vec3(0, 0, 0);
     auto pixel_sample = pixel00_loc + ((i + offset.x()) * pixel_delta_u) +
                         ((j + offset.y()) * pixel_delta_v);
 
-    auto ray_origin = (defocus_angle <= 0) ? center : defocus_disk_sample();
+    auto ray_origin =
+        (defocus_angle <= 0) ? center : defocus_disk_sample(smp);
     auto ray_direction = pixel_sample - ray_origin;
-    auto ray_time = random_double();
+    auto ray_time = smp.next_double();
 
     return ray(ray_origin, ray_direction, ray_time);
   }
 
-  vec3 sample_square() const {
+  vec3 sample_square(sampler& smp) const {
     // Returns a random point in the square surrounding a pixel at the origin
-    return vec3(random_double() - 0.5, random_double() - 0.5, 0);
+    return vec3(smp.next_double() - 0.5, smp.next_double() - 0.5, 0);
   }
 
-  point3 defocus_disk_sample() const {
+  point3 defocus_disk_sample(sampler& smp) const {
     // Returns a random point in the camera defocus disk
-    auto p = random_in_unit_disk();
+    auto p = random_in_unit_disk(smp);
     return center + (p[0] * defocus_disk_u) + (p[1] * defocus_disk_v);
   }
 
-  color ray_color(const ray& r, int depth, const hittable& world) const {
-    if (depth <= 0) {
-      return color(0, 0, 0);
+  int lobe_depth_limit(ScatterLobe lobe) const {
+    switch (lobe) {
+    case ScatterLobe::DIFFUSE:
+      return max_diffuse_depth;
+    case ScatterLobe::SPECULAR:
+      return max_specular_depth;
+    case ScatterLobe::VOLUME:
+      return max_volume_depth;
     }
+    return 0;
+  }
 
-    hit_record rec;
+  // Shared by both pipelines once a material has scattered: charges the
+  // bounce to its lobe's budget, folds in the attenuation and plays Russian
+  // roulette. Returns false when the path ends here.
+  bool extend_path(ScatterLobe lobe, const color& attenuation, int bounce,
+                   int* lobe_bounces, color& throughput, sampler& smp) const {
+    int limit = lobe_depth_limit(lobe);
+    if (limit > 0 && ++lobe_bounces[int(lobe)] > limit) {
+      return false;
+    }
 
-    if (!world.hit(r, interval(0.001, infinity), rec)) {
-      return background;
+    throughput = throughput * attenuation;
+
+    // Russian roulette: past the minimum depth, continue with probability
+    // q and divide the survivors by q, which keeps the estimate unbiased
+    // while dim paths end early.
+    if (bounce + 1 >= russian_roulette_depth) {
+      real q = std::min(real(0.95), std::max({throughput.x(), throughput.y(),
+                                               throughput.z()}));
+      if (smp.next_double() >= q) {
+        return false;
+      }
+      throughput /= q;
+    }
+    return true;
+  }
+
+  // Wavefront pipeline: every sample the tile needs this pass becomes a path,
+  // and the paths advance one bounce at a time through separate generate,
+  // intersect and shade stages. The tile's pixels are taken in row order, in
+  // batches of up to wavefront_batch::max_paths paths, so a large tile at a
+  // high sample count does not hold all of its paths at once. Each path keeps
+  // its own sampler and consumes it in the same order as ray_color, so both
+  // pipelines produce the same image, up to the order ray packets sample
+  // volumes in (flat_bvh::hit_batch). Returns the number of samples traced.
+  long long trace_tile_wavefront(const hittable& world, const image_tile& tile,
+                                 int pass_target, wavefront_batch& batch) {
+    int tile_w = tile.x1 - tile.x0;
+    int pixels = tile_w * (tile.y1 - tile.y0);
+    long long traced = 0;
+    for (int first = 0; first < pixels;) {
+      // Whole pixels, and at least one, so each is resolved in one batch
+      int last = first;
+      size_t n = 0;
+      while (last < pixels) {
+        int p = (tile.y0 + last / tile_w) * image_width + tile.x0 +
+                last % tile_w;
+        size_t samples = pixel_pass_samples(p, pass_target);
+        if (n > 0 && n + samples > wavefront_batch::max_paths) break;
+        n += samples;
+        last++;
+      }
+      traced += trace_pixels_wavefront(world, tile, first, last, n,
+                                       pass_target, batch);
+      first = last;
     }
-    ray scattered;
-    color attenuation;
-
-    // Unconditionally grab any light being emitted by the material we hit.
-    // If it's not a light, this safely returns color(0,0,0).
-    color color_from_emission = rec.mat->emitted(rec.u, rec.v, rec.p);
-    if (enable_shadows && rec.mat->scatter(r, rec, attenuation, scattered)) {
-      color color_from_scatter;
-      if (enable_reflections || enable_refractions) {
-        color_from_scatter =
-            attenuation * ray_color(scattered, depth - 1, world);
-      } else {
+    return traced;
+  }
+
+  // Traces the 'n' samples of the tile's pixels [first, last), counted in
+  // row order, as one batch
+  long long trace_pixels_wavefront(const hittable& world,
+                                   const image_tile& tile, int first,
+                                   int last, size_t n, int pass_target,
+                                   wavefront_batch& batch) {
+    if (n == 0) return 0;
+    path_state_soa& paths = batch.paths;
+    int tile_w = tile.x1 - tile.x0;
+
+    // Generate
+    paths.resize(n);
+    batch.hits.resize(n);
+    batch.active.resize(n);
+    size_t k = 0;
+    for (int q = first; q < last; q++) {
+      int i = tile.x0 + q % tile_w, j = tile.y0 + q / tile_w;
+      int p = j * image_width + i;
+      int samples = pixel_pass_samples(p, pass_target);
+      for (int sample = 0; sample < samples; sample++, k++) {
+        paths.rng[k] =
+            sampler::for_pixel_sample(p, pixel_samples[p] + sample, seed);
+        ray r = get_ray(i, j, paths.rng[k]);
+        paths.ray_origin[k] = r.origin();
+        paths.ray_dir[k] = r.direction();
+        paths.ray_time[k] = r.time();
+        paths.throughput[k] = color(1, 1, 1);
+        paths.radiance[k] = color(0, 0, 0);
+        paths.pixel_index[k] = p;
+        batch.active[k] = int(k);
+      }
+    }
+    std::fill(paths.lobe_bounces.begin(), paths.lobe_bounces.end(), 0);
+
+    for (int bounce = 0; bounce < max_depth && !batch.active.empty();
+         bounce++) {
+      intersect_stage(world, batch);
+      shade_stage(batch, bounce);
+      std::swap(batch.active, batch.next_active);
+    }
+
+    // Resolve: a pixel's paths are contiguous and in sample order
+    k = 0;
+    for (int q = first; q < last; q++) {
+      int p = (tile.y0 + q / tile_w) * image_width + tile.x0 + q % tile_w;
+      int samples = pixel_pass_samples(p, pass_target);
+      color pixel_color(0, 0, 0);
+      for (int sample = 0; sample < samples; sample++, k++) {
+        pixel_color += paths.radiance[k];
+        record_luminance(p, pixel_samples[p] + sample, paths.radiance[k]);
+      }
+      commit_pixel(p, pixel_color, samples);
+    }
+    return static_cast<long long>(n);
+  }
+
+  // Finds every active path's next hit and queues the path by the type of
+  // material it hit. A flat_bvh traces the whole batch as ray packets
+  // (flat_bvh::hit_batch); any other scene is traced one ray at a time.
+  void intersect_stage(const hittable& world, wavefront_batch& batch) const {
+    path_state_soa& paths = batch.paths;
+    hit_result_soa& hits = batch.hits;
+    batch.queues.clear();
+
+    if (const auto* flat = dynamic_cast<const flat_bvh*>(&world)) {
+      thread_rays += static_cast<long long>(batch.active.size());
+      flat->hit_batch(paths, batch.active, interval(0.001, infinity), hits);
+      for (int k : batch.active) {
+        if (!hits.hit_material[k]) {
+          batch.queues.misses.push_back(k);
+        } else {
+          batch.queues.queues[int(hits.hit_material[k]->type())].push_back(k);
+        }
+      }
+      return;
+    }
+
+    thread_rays += static_cast<long long>(batch.active.size());
+    for (int k : batch.active) {
+      ray r(paths.ray_origin[k], paths.ray_dir[k], paths.ray_time[k]);
+      hit_record rec;
+      if (!world.hit(r, interval(0.001, infinity), rec, paths.rng[k])) {
+        batch.queues.misses.push_back(k);
+        continue;
+      }
+      hits.hit_p[k] = rec.p;
+      hits.hit_normal[k] = rec.normal;
+      hits.hit_t[k] = rec.t;
+      hits.hit_u[k] = rec.u;
+      hits.hit_v[k] = rec.v;
+      hits.hit_front_face[k] = rec.front_face;
+      hits.hit_material[k] = rec.mat;
+      batch.queues.queues[int(rec.mat->type())].push_back(k);
+    }
+  }
+
+  void shade_stage(wavefront_batch& batch, int bounce) const {
+    path_state_soa& paths = batch.paths;
+    batch.next_active.clear();
+
+    for (int k : batch.queues.misses) {
+      paths.radiance[k] += paths.throughput[k] * background;
+    }
+
+    using MT = MaterialType;
+    shade_queue<lambertian>(batch, batch.queues.queues[int(MT::LAMBERTIAN)],
+                            bounce);
+    shade_queue<metal>(batch, batch.queues.queues[int(MT::METAL)], bounce);
+    shade_queue<dielectric>(batch, batch.queues.queues[int(MT::DIELECTRIC)],
+                            bounce);
+    shade_queue<diffuse_light>(
+        batch, batch.queues.queues[int(MT::DIFFUSE_LIGHT)], bounce);
+    shade_queue<isotropic>(batch, batch.queues.queues[int(MT::ISOTROPIC)],
+                           bounce);
+  }
+
+  // Every path in 'queue' hit a 'Mat', so its methods are called directly
+  // instead of through the vtable.
+  template <class Mat>
+  void shade_queue(wavefront_batch& batch, const std::vector<int>& queue,
+                   int bounce) const {
+    path_state_soa& paths = batch.paths;
+    const hit_result_soa& hits = batch.hits;
+
+    for (int k : queue) {
+      const Mat* mat = static_cast<const Mat*>(hits.hit_material[k]);
+      hit_record rec;
+      rec.p = hits.hit_p[k];
+      rec.normal = hits.hit_normal[k];
+      rec.t = hits.hit_t[k];
+      rec.u = hits.hit_u[k];
+      rec.v = hits.hit_v[k];
+      rec.front_face = hits.hit_front_face[k];
+
+      paths.radiance[k] +=
+          paths.throughput[k] * mat->Mat::emitted(rec.u, rec.v, rec.p);
+
+      ray r_in(paths.ray_origin[k], paths.ray_dir[k], paths.ray_time[k]);
+      ray scattered;
+      color attenuation;
+      if (!enable_shadows ||
+          !mat->Mat::scatter(r_in, rec, attenuation, scattered,
+                             paths.rng[k])) {
+        continue;
+      }
+
+      if (!enable_reflections && !enable_refractions) {
+        vec3 light_dir = unit_vector(vec3(1, 1, 1));
+        real light_intensity = std::max(real(0), dot(rec.normal, light_dir));
+        paths.radiance[k] += paths.throughput[k] * attenuation *
+                             (0.3 + 0.7 * light_intensity); // Ambient + diffuse
+        continue;
+      }
+
+      if (!extend_path(mat->Mat::lobe(), attenuation, bounce,
+                       &paths.lobe_bounces[k * 3], paths.throughput[k],
+                       paths.rng[k])) {
+        continue;
+      }
+
+      paths.ray_origin[k] = scattered.origin();
+      paths.ray_dir[k] = scattered.direction();
+      paths.ray_time[k] = scattered.time();
+      batch.next_active.push_back(k);
+    }
+  }
+
+  color ray_color(const ray& r, int depth, const hittable& world,
+                  sampler& smp) const {
+    // Follows the path in a loop, carrying the product of the attenuations so
+    // far ('throughput') instead of multiplying it in on the way back out of
+    // a recursion.
+    color radiance(0, 0, 0);
+    color throughput(1, 1, 1);
+    ray current = r;
+    int lobe_bounces[3] = {0, 0, 0};
+
+    for (int bounce = 0; bounce < depth; bounce++) {
+      hit_record rec;
+      thread_rays++;
+      if (!world.hit(current, interval(0.001, infinity), rec, smp)) {
+        radiance += throughput * background;
+        break;
+      }
+
+      // Unconditionally grab any light being emitted by the material we hit.
+      // If it's not a light, this safely returns color(0,0,0).
+      radiance += throughput * rec.mat->emitted(rec.u, rec.v, rec.p);
+
+      // If it fails to scatter (e.g., it is a pure Light element, or shadows
+      // are off), the emitted light is all this path carries
+      ray scattered;
+      color attenuation;
+      if (!enable_shadows ||
+          !rec.mat->scatter(current, rec, attenuation, scattered, smp)) {
+        break;
+      }
+
+      if (!enable_reflections && !enable_refractions) {
         vec3 light_dir = unit_vector(vec3(1, 1, 1));
-        double light_intensity = std::max(0.0, dot(rec.normal, light_dir));
-        color_from_scatter =
-            attenuation * (0.3 + 0.7 * light_intensity); // Ambient + diffuse
+        real light_intensity = std::max(real(0), dot(rec.normal, light_dir));
+        radiance += throughput * attenuation *
+                    (0.3 + 0.7 * light_intensity); // Ambient + diffuse
+        break;
+      }
+
+      if (!extend_path(rec.mat->lobe(), attenuation, bounce, lobe_bounces,
+                       throughput, smp)) {
+        break;
       }
-      // Return BOTH the emitted light + the scattered light
-      // Usually one of these is 0, but both are included for mathematical
-      // completeness
-      return color_from_emission + color_from_scatter;
+
+      current = scattered;
     }
 
-    // If it failed to scatter (e.g., it is a pure Light element, or shadows
-    // are off), it MUST return the emitted light
-    return color_from_emission;
+    return radiance;
   }
 };
 
@@ -14,6 +14,11 @@ inline double linear_to_gamma(double linear_component) {
   return 0;
 }
 
+inline double luminance(const color& c) {
+  // Rec. 709 weights on linear RGB
+  return 0.2126 * c.x() + 0.7152 * c.y() + 0.0722 * c.z();
+}
+
 inline void write_color(std::ostream& out, const color& pixel_color) {
   auto r = pixel_color.x();
   auto g = pixel_color.y();
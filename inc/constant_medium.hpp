@@ -17,13 +17,14 @@ public:
       : boundary(boundary), neg_inv_density(-1 / density),
         phase_function(std::make_shared<isotropic>(albedo)) {}
 
-  bool hit(const ray &r, interval ray_t, hit_record &rec) const override {
+  bool hit(const ray &r, interval ray_t, hit_record &rec,
+           sampler &smp) const override {
     hit_record rec1, rec2;
 
-    if (!boundary->hit(r, interval::universe, rec1))
+    if (!boundary->hit(r, interval::universe, rec1, smp))
       return false;
 
-    if (!boundary->hit(r, interval(rec1.t + 0.0001, infinity), rec2))
+    if (!boundary->hit(r, interval(rec1.t + 0.0001, infinity), rec2, smp))
       return false;
 
     if (rec1.t < ray_t.min)
@@ -39,7 +40,7 @@ public:
 
     auto ray_length = r.direction().length();
     auto distance_inside_boundary = (rec2.t - rec1.t) * ray_length;
-    auto hit_distance = neg_inv_density * std::log(random_double());
+    auto hit_distance = neg_inv_density * std::log(smp.next_double());
 
     if (hit_distance > distance_inside_boundary)
       return false;
@@ -49,7 +50,7 @@ public:
 
     rec.normal = vec3(1, 0, 0); // arbitrary
     rec.front_face = true;      // also arbitrary
-    rec.mat = phase_function;
+    rec.mat = phase_function.get();
 
     return true;
   }
@@ -58,7 +59,7 @@ public:
 
 public:
   std::shared_ptr<hittable> boundary;
-  double neg_inv_density;
+  real neg_inv_density;
   std::shared_ptr<material> phase_function;
 };
 
@@ -1,12 +1,22 @@
 #pragma once
 #include "cuda_structs.hpp"
 #include "ray.cuh"
+#include "sampler.hpp"
 #include "vec.cuh"
 
-__device__ inline vec3_gpu make_vec3_gpu(const Vec3f& v) { return vec3_gpu{v.x, v.y, v.z}; }
+// The traversal below is compiled for both the CUDA kernels and the CPU
+// renderer (flat_bvh.hpp), so the two backends intersect the same flattened
+// scene with the same code. Only the random source for volume hits differs;
+// each backend supplies a rand_uniform overload for its generator.
 
-__device__ inline bool aabb_hit(const Vec3f& aabb_min, const Vec3f& aabb_max, const ray_gpu& r, float t_min,
-                                float t_max) {
+// Uniform float in (0, 1]
+__device__ inline float rand_uniform(curandState* state) { return curand_uniform(state); }
+inline float rand_uniform(sampler* smp) { return float(1.0 - smp->next_double()); }
+
+__host__ __device__ inline vec3_gpu make_vec3_gpu(const Vec3f& v) { return vec3_gpu{v.x, v.y, v.z}; }
+
+__host__ __device__ inline bool aabb_hit(const Vec3f& aabb_min, const Vec3f& aabb_max, const ray_gpu& r,
+                                         float t_min, float t_max) {
   for (int a = 0; a < 3; a++) {
     // Evaluate slab intersections per axis
     float invD = 1.0f / r.direction()[a];
@@ -18,6 +28,11 @@ __device__ inline bool aabb_hit(const Vec3f& aabb_min, const Vec3f& aabb_max, co
       t0 = t1;
       t1 = temp;
     }
+    // Widen the far distance by 1 + 2 * gamma(3) (PBRT's conservative slab
+    // test). Rounding in the subtraction above can otherwise collapse a slab
+    // thinner than the float spacing at the ray origin's distance (a padded
+    // wall seen from across the room) and the box is missed.
+    t1 *= 1.0000004f;
     t_min = t0 > t_min ? t0 : t_min;
     t_max = t1 < t_max ? t1 : t_max;
 
@@ -26,8 +41,9 @@ __device__ inline bool aabb_hit(const Vec3f& aabb_min, const Vec3f& aabb_max, co
   return true;
 }
 // 2. The Union Unpacker & Intersection Logic
-__device__ inline bool hit_primitive(const PrimitiveGPU& prim, const ray_gpu& r, float t_min, float t_max,
-                                     HitRecordGPU& rec, curandState* local_rand_state) {
+template <class Rng>
+__host__ __device__ inline bool hit_primitive(const PrimitiveGPU& prim, const ray_gpu& r, float t_min, float t_max,
+                                              HitRecordGPU& rec, Rng* local_rand_state) {
 
   if (prim.type == PrimitiveType::SPHERE) {
     // --- Unpack & Math Sphere ---
@@ -154,7 +170,7 @@ __device__ inline bool hit_primitive(const PrimitiveGPU& prim, const ray_gpu& r,
 
     float ray_length = r.direction().length();
     float distance_inside_boundary = (t2 - t1) * ray_length;
-    float hit_distance = prim.volume_sphere.neg_inv_density * logf(curand_uniform(local_rand_state));
+    float hit_distance = prim.volume_sphere.neg_inv_density * logf(rand_uniform(local_rand_state));
 
     if (hit_distance > distance_inside_boundary) return false;
 
@@ -238,7 +254,7 @@ __device__ inline bool hit_primitive(const PrimitiveGPU& prim, const ray_gpu& r,
 
     float ray_length = r.direction().length();
     float distance_inside_boundary = (t2 - t1) * ray_length;
-    float hit_distance = prim.volume_box.neg_inv_density * logf(curand_uniform(local_rand_state));
+    float hit_distance = prim.volume_box.neg_inv_density * logf(rand_uniform(local_rand_state));
 
     if (hit_distance > distance_inside_boundary) return false;
 
@@ -255,39 +271,201 @@ __device__ inline bool hit_primitive(const PrimitiveGPU& prim, const ray_gpu& r,
   return false;
 }
 
-__device__ inline bool hit_linear_bvh(const cuda::span<LinearBVHNode> bvh_nodes,
-                                      const cuda::span<PrimitiveGPU> primitives, const ray_gpu& ray, float t_min,
-                                      float t_max, HitRecordGPU& rec, curandState* local_rand_state) {
+// Every builder stores the split axis in interior nodes and puts the lower
+// side of the split in the left (first) child
+__host__ __device__ inline bool ray_dir_negative(const ray_gpu& r, int axis) { return r.direction()[axis] < 0.0f; }
+
+// Moves a world-space ray into an instance's object space. The direction is
+// transformed but not renormalized, so hit distances need no conversion.
+__host__ __device__ inline ray_gpu instance_ray(const PrimitiveGPU& instance, const ray_gpu& ray) {
+  vec3_gpu rows[3] = {make_vec3_gpu(instance.instance.rows[0]), make_vec3_gpu(instance.instance.rows[1]),
+                      make_vec3_gpu(instance.instance.rows[2])};
+  const Vec3f& translation = instance.instance.translation;
+  const vec3_gpu& o = ray.origin();
+  const vec3_gpu& d = ray.direction();
+  return ray_gpu(point3_gpu(dot(rows[0], o) + translation.x, dot(rows[1], o) + translation.y,
+                            dot(rows[2], o) + translation.z),
+                 vec3_gpu(dot(rows[0], d), dot(rows[1], d), dot(rows[2], d)), ray.time());
+}
+
+// Maps a hit found with instance_ray back to world space
+__host__ __device__ inline void instance_hit_to_world(const PrimitiveGPU& instance, const ray_gpu& ray,
+                                                      HitRecordGPU& rec) {
+  vec3_gpu p = ray.at(rec.t);
+  rec.p = {p.x(), p.y(), p.z()};
+  // Normals transform by the inverse transpose of object-to-world, which is
+  // the transpose of world-to-object. That keeps a normal facing the
+  // transformed ray facing the world ray, so front_face carries over.
+  vec3_gpu normal = unit_vector(make_vec3_gpu(instance.instance.rows[0]) * rec.normal.x +
+                                make_vec3_gpu(instance.instance.rows[1]) * rec.normal.y +
+                                make_vec3_gpu(instance.instance.rows[2]) * rec.normal.z);
+  rec.normal = {normal.x(), normal.y(), normal.z()};
+}
+
+template <class Rng>
+__host__ __device__ inline bool hit_instance(const PrimitiveGPU& instance, const cuda::span<LinearBVHNode> bvh_nodes,
+                                             const cuda::span<PrimitiveGPU> primitives, const ray_gpu& ray,
+                                             float t_min, float t_max, HitRecordGPU& rec, Rng* local_rand_state,
+                                             int& visited);
+
+// Closest hit in the tree rooted at 'root'. The top level also enters
+// instances; bottom-level trees only hold plain primitives.
+template <bool TopLevel, class Rng>
+__host__ __device__ inline bool traverse_bvh(const cuda::span<LinearBVHNode> bvh_nodes,
+                                             const cuda::span<PrimitiveGPU> primitives, int root, const ray_gpu& ray,
+                                             float t_min, float t_max, HitRecordGPU& rec, Rng* local_rand_state,
+                                             int& visited) {
   int stack[64];
   int stack_ptr = 0;
 
-  stack[stack_ptr++] = 0;
+  stack[stack_ptr++] = root;
   bool hit_anything = false;
   float closest_so_far = t_max;
 
   while (stack_ptr > 0) {
     int node_idx = stack[--stack_ptr];
     const LinearBVHNode& node = bvh_nodes[node_idx];
+    visited++;
 
     if (!aabb_hit(node.aabb_min, node.aabb_max, ray, t_min, closest_so_far)) {
       continue;
     }
 
-    if (node.n_primitives > 0) { // Leaf
-      HitRecordGPU temp_rec;
-      const PrimitiveGPU& prim = primitives[node.primitive_offset];
+    if (node.n_primitives > 0) { // Leaf: a contiguous run of primitives
+      for (int i = 0; i < node.n_primitives; i++) {
+        HitRecordGPU temp_rec;
+        const PrimitiveGPU& prim = primitives[node.primitive_offset + i];
+
+        bool hit;
+        if constexpr (TopLevel) {
+          hit = prim.type == PrimitiveType::INSTANCE
+                    ? hit_instance(prim, bvh_nodes, primitives, ray, t_min, closest_so_far, temp_rec,
+                                   local_rand_state, visited)
+                    : hit_primitive(prim, ray, t_min, closest_so_far, temp_rec, local_rand_state);
+        } else {
+          hit = hit_primitive(prim, ray, t_min, closest_so_far, temp_rec, local_rand_state);
+        }
+        if (hit) {
+          hit_anything = true;
+          closest_so_far = temp_rec.t;
+          rec = temp_rec;
+        }
+      }
+    } else { // Interior
+      // Visit the child on the near side of the split first (pushed last, as
+      // the stack is LIFO): a hit there shrinks closest_so_far before the far
+      // child's box is tested, so it is more often pruned
+      if (ray_dir_negative(ray, node.axis)) {
+        stack[stack_ptr++] = node_idx + 1;
+        stack[stack_ptr++] = node.second_child_offset;
+      } else {
+        stack[stack_ptr++] = node.second_child_offset;
+        stack[stack_ptr++] = node_idx + 1;
+      }
+    }
+  }
+
+  return hit_anything;
+}
 
-      if (hit_primitive(prim, ray, t_min, closest_so_far, temp_rec, local_rand_state)) {
+// Traces the instanced bottom-level BVH with the ray moved into its object
+// space (instance_ray), then maps the hit back to world space
+// (instance_hit_to_world).
+template <class Rng>
+__host__ __device__ inline bool hit_instance(const PrimitiveGPU& instance, const cuda::span<LinearBVHNode> bvh_nodes,
+                                             const cuda::span<PrimitiveGPU> primitives, const ray_gpu& ray,
+                                             float t_min, float t_max, HitRecordGPU& rec, Rng* local_rand_state,
+                                             int& visited) {
+  if (!traverse_bvh<false>(bvh_nodes, primitives, instance.instance.blas_root, instance_ray(instance, ray), t_min,
+                           t_max, rec, local_rand_state, visited)) {
+    return false;
+  }
+  instance_hit_to_world(instance, ray, rec);
+  return true;
+}
+
+template <class Rng>
+__host__ __device__ inline bool hit_linear_bvh(const cuda::span<LinearBVHNode> bvh_nodes,
+                                               const cuda::span<PrimitiveGPU> primitives, const ray_gpu& ray,
+                                               float t_min, float t_max, HitRecordGPU& rec, Rng* local_rand_state,
+                                               int* nodes_visited = nullptr) {
+  int visited = 0;
+  bool hit_anything =
+      traverse_bvh<true>(bvh_nodes, primitives, 0, ray, t_min, t_max, rec, local_rand_state, visited);
+  if (nodes_visited) *nodes_visited = visited;
+  return hit_anything;
+}
+
+// Stackless variant of traverse_bvh over the same depth-first layout. Each
+// node's escape link (build_escape_links) is where a traversal continues once
+// the node's subtree is done with: after a leaf or a missed box it jumps
+// there, and into an interior node it steps to the left child at index + 1.
+// The per-ray state is one node index instead of a 64-entry stack, and trees
+// of any depth are safe, but children are always visited left first rather
+// than nearest first. The tree rooted at 'root' ends at root's own escape link.
+template <bool TopLevel, class Rng>
+__host__ __device__ inline bool traverse_bvh_stackless(const cuda::span<LinearBVHNode> bvh_nodes,
+                                                       const cuda::span<const int> escape_links,
+                                                       const cuda::span<PrimitiveGPU> primitives, int root,
+                                                       const ray_gpu& ray, float t_min, float t_max,
+                                                       HitRecordGPU& rec, Rng* local_rand_state, int& visited) {
+  int end = escape_links[root];
+  int node_idx = root;
+  bool hit_anything = false;
+  float closest_so_far = t_max;
+
+  while (node_idx != end) {
+    const LinearBVHNode& node = bvh_nodes[node_idx];
+    visited++;
+
+    if (!aabb_hit(node.aabb_min, node.aabb_max, ray, t_min, closest_so_far)) {
+      node_idx = escape_links[node_idx];
+      continue;
+    }
+    if (node.n_primitives == 0) { // Interior: descend to the left child
+      node_idx++;
+      continue;
+    }
+
+    for (int i = 0; i < node.n_primitives; i++) {
+      HitRecordGPU temp_rec;
+      const PrimitiveGPU& prim = primitives[node.primitive_offset + i];
+
+      bool hit;
+      if constexpr (TopLevel) {
+        if (prim.type == PrimitiveType::INSTANCE) {
+          hit = traverse_bvh_stackless<false>(bvh_nodes, escape_links, primitives, prim.instance.blas_root,
+                                              instance_ray(prim, ray), t_min, closest_so_far, temp_rec,
+                                              local_rand_state, visited);
+          if (hit) instance_hit_to_world(prim, ray, temp_rec);
+        } else {
+          hit = hit_primitive(prim, ray, t_min, closest_so_far, temp_rec, local_rand_state);
+        }
+      } else {
+        hit = hit_primitive(prim, ray, t_min, closest_so_far, temp_rec, local_rand_state);
+      }
+      if (hit) {
         hit_anything = true;
         closest_so_far = temp_rec.t;
         rec = temp_rec;
       }
-    } else { // Interior
-      // Push right first so left will be processed first becuase of LIFO
-      stack[stack_ptr++] = node.second_child_offset;
-      stack[stack_ptr++] = node_idx + 1;
     }
+    node_idx = escape_links[node_idx];
   }
 
   return hit_anything;
 }
+
+template <class Rng>
+__host__ __device__ inline bool hit_linear_bvh_stackless(const cuda::span<LinearBVHNode> bvh_nodes,
+                                                         const cuda::span<const int> escape_links,
+                                                         const cuda::span<PrimitiveGPU> primitives,
+                                                         const ray_gpu& ray, float t_min, float t_max,
+                                                         HitRecordGPU& rec, Rng* local_rand_state,
+                                                         int* nodes_visited = nullptr) {
+  int visited = 0;
+  bool hit_anything = traverse_bvh_stackless<true>(bvh_nodes, escape_links, primitives, 0, ray, t_min, t_max, rec,
+                                                   local_rand_state, visited);
+  if (nodes_visited) *nodes_visited = visited;
+  return hit_anything;
+}
@@ -0,0 +1,172 @@
+#pragma once
+#include "bvh_kernel.cuh"
+#include "cuda_structs.hpp"
+
+#include <cstdint>
+#include <cstring>
+
+#if !defined(__CUDA_ARCH__) && (defined(__SSE2__) || defined(_M_X64))
+#include <immintrin.h>
+#define QUANTIZED_BVH_SSE 1
+#endif
+
+// Compressed 4-wide BVH node, one 64-byte cache line (half a WideBVHNode<4>, two binary LinearBVHNodes). Child
+// boxes are stored as 8-bit grid coordinates inside the node's own box: on each axis a corner decodes to
+// origin + q * 2^exponent, and the encoder rounds lower corners down and upper corners up, so a decoded box
+// always contains the child it stands for. The power-of-two step keeps q * step exact, so host and device decode
+// to the same floats. Leaves and instances are the binary tree's, as in wide_bvh.hpp; quantized_bvh.hpp builds
+// these nodes on the CPU.
+struct alignas(64) QuantizedBVHNode {
+  Vec3f origin;             // lower corner of the box around all children
+  int8_t exponent[3];       // per-axis grid step, 2^exponent
+  uint8_t count;            // children in use, the first 'count' lanes
+  uint8_t lower[3][4];      // child lower corners, [axis][lane]
+  uint8_t upper[3][4];      // child upper corners, [axis][lane]
+  int child[4];             // interior child: node index; leaf child: first primitive
+  uint16_t n_primitives[4]; // 0 for an interior child
+};
+static_assert(sizeof(QuantizedBVHNode) == 64, "a quantized node fills exactly one cache line");
+
+// 2^exponent built from its bit pattern; exponents stay within the normal float range
+__host__ __device__ inline float quantized_step(int exponent) {
+  uint32_t bits = uint32_t(exponent + 127) << 23;
+  float step;
+  memcpy(&step, &bits, sizeof(step));
+  return step;
+}
+
+// Decodes one child box. The CPU encoder checks its rounding against this exact expression.
+__host__ __device__ inline float quantized_plane(float origin, float step, uint8_t q) {
+  return origin + float(q) * step;
+}
+
+// Decodes every child box of 'node' and runs aabb_hit's conservative slab test on it. Returns a bit per child
+// the ray crosses within (t_min, t_max) and stores the entry distances in 't_near'. Host builds with SSE decode and
+// test all four children at once, with the same float operations as the scalar loop the device runs.
+__host__ __device__ inline unsigned intersect_quantized_children(const QuantizedBVHNode& node, const float* origin,
+                                                                 const float* inv_dir, const bool* negative,
+                                                                 float t_min, float t_max, float* t_near) {
+  const float node_origin[3] = {node.origin.x, node.origin.y, node.origin.z};
+#if defined(QUANTIZED_BVH_SSE)
+  __m128 lo = _mm_set1_ps(t_min), hi = _mm_set1_ps(t_max);
+  for (int a = 0; a < 3; a++) {
+    __m128 base = _mm_set1_ps(node_origin[a]), step = _mm_set1_ps(quantized_step(node.exponent[a]));
+    __m128 o = _mm_set1_ps(origin[a]), inv = _mm_set1_ps(inv_dir[a]);
+    const uint8_t* q_near = negative[a] ? node.upper[a] : node.lower[a];
+    const uint8_t* q_far = negative[a] ? node.lower[a] : node.upper[a];
+    // Widen four bytes to four floats
+    int32_t near_bytes, far_bytes;
+    memcpy(&near_bytes, q_near, 4);
+    memcpy(&far_bytes, q_far, 4);
+    __m128i zero = _mm_setzero_si128();
+    __m128i near_q = _mm_unpacklo_epi16(_mm_unpacklo_epi8(_mm_cvtsi32_si128(near_bytes), zero), zero);
+    __m128i far_q = _mm_unpacklo_epi16(_mm_unpacklo_epi8(_mm_cvtsi32_si128(far_bytes), zero), zero);
+    __m128 near_plane = _mm_add_ps(base, _mm_mul_ps(_mm_cvtepi32_ps(near_q), step));
+    __m128 far_plane = _mm_add_ps(base, _mm_mul_ps(_mm_cvtepi32_ps(far_q), step));
+    __m128 t0 = _mm_mul_ps(_mm_sub_ps(near_plane, o), inv);
+    __m128 t1 = _mm_mul_ps(_mm_mul_ps(_mm_sub_ps(far_plane, o), inv), _mm_set1_ps(1.0000004f));
+    // Second operand on NaN, like the scalar comparisons below
+    lo = _mm_max_ps(t0, lo);
+    hi = _mm_min_ps(t1, hi);
+  }
+  _mm_storeu_ps(t_near, lo);
+  return unsigned(_mm_movemask_ps(_mm_cmplt_ps(lo, hi))) & ((1u << node.count) - 1);
+#else
+  float step[3];
+  for (int a = 0; a < 3; a++) step[a] = quantized_step(node.exponent[a]);
+  unsigned mask = 0;
+  for (int lane = 0; lane < node.count; lane++) {
+    float lo = t_min, hi = t_max;
+    for (int a = 0; a < 3; a++) {
+      uint8_t q_near = negative[a] ? node.upper[a][lane] : node.lower[a][lane];
+      uint8_t q_far = negative[a] ? node.lower[a][lane] : node.upper[a][lane];
+      float t0 = (quantized_plane(node_origin[a], step[a], q_near) - origin[a]) * inv_dir[a];
+      float t1 = (quantized_plane(node_origin[a], step[a], q_far) - origin[a]) * inv_dir[a] * 1.0000004f;
+      lo = t0 > lo ? t0 : lo;
+      hi = t1 < hi ? t1 : hi;
+    }
+    t_near[lane] = lo;
+    if (lo < hi) mask |= 1u << lane;
+  }
+  return mask;
+#endif
+}
+
+// Closest hit in (t_min, t_max) through a quantized tree; same contract as hit_linear_bvh. Instances are traced
+// through their bottom-level trees in 'binary', the tree the quantized one was built from.
+template <class Rng>
+__host__ __device__ inline bool hit_quantized_bvh(const cuda::span<const QuantizedBVHNode> nodes,
+                                                  const cuda::span<LinearBVHNode> binary,
+                                                  const cuda::span<PrimitiveGPU> primitives, const ray_gpu& ray,
+                                                  float t_min, float t_max, HitRecordGPU& rec, Rng* local_rand_state,
+                                                  int* nodes_visited = nullptr) {
+  if (nodes.empty()) return false;
+
+  float origin[3], inv_dir[3];
+  bool negative[3];
+  for (int a = 0; a < 3; a++) {
+    origin[a] = ray.origin()[a];
+    inv_dir[a] = 1.0f / ray.direction()[a];
+    negative[a] = inv_dir[a] < 0.0f;
+  }
+
+  struct stack_entry {
+    int index;
+    int n_primitives; // 0 for an interior node
+    float t_near;
+  };
+  // Every visit pops one entry and pushes at most four, over fewer than 64 binary levels
+  stack_entry stack[64 * 3 + 1];
+  int stack_ptr = 0;
+  stack[stack_ptr++] = {0, 0, t_min};
+
+  bool hit_anything = false;
+  float closest_so_far = t_max;
+  int visited = 0;
+
+  while (stack_ptr > 0) {
+    stack_entry entry = stack[--stack_ptr];
+    // Pushed while a farther hit was still the closest
+    if (entry.t_near >= closest_so_far) continue;
+
+    if (entry.n_primitives > 0) {
+      for (int i = 0; i < entry.n_primitives; i++) {
+        HitRecordGPU temp_rec;
+        const PrimitiveGPU& prim = primitives[entry.index + i];
+        bool hit = prim.type == PrimitiveType::INSTANCE
+                       ? hit_instance(prim, binary, primitives, ray, t_min, closest_so_far, temp_rec,
+                                      local_rand_state, visited)
+                       : hit_primitive(prim, ray, t_min, closest_so_far, temp_rec, local_rand_state);
+        if (hit) {
+          hit_anything = true;
+          closest_so_far = temp_rec.t;
+          rec = temp_rec;
+        }
+      }
+      continue;
+    }
+
+    const QuantizedBVHNode& node = nodes[entry.index];
+    visited++;
+    float t_near[4];
+    unsigned mask = intersect_quantized_children(node, origin, inv_dir, negative, t_min, closest_so_far, t_near);
+
+    // Insertion-sort the hit children nearest first
+    int order[4];
+    int hits = 0;
+    for (int lane = 0; lane < 4; lane++) {
+      if (!(mask & (1u << lane))) continue;
+      int j = hits++;
+      for (; j > 0 && t_near[order[j - 1]] > t_near[lane]; j--) order[j] = order[j - 1];
+      order[j] = lane;
+    }
+    // Farthest first, so the nearest pops next
+    for (int j = hits - 1; j >= 0; j--) {
+      int lane = order[j];
+      stack[stack_ptr++] = {node.child[lane], node.n_primitives[lane], t_near[lane]};
+    }
+  }
+
+  if (nodes_visited) *nodes_visited = visited;
+  return hit_anything;
+}
@@ -10,6 +10,7 @@
 
 #include "bvh.hpp"
 #include "hittable.hpp"
+#include "material.hpp"
 #include "quad.hpp"
 #include "sphere.hpp"
 
@@ -46,14 +47,6 @@ struct SphereGPU {
   int material_id; // index into material array
 };
 
-enum class MaterialType : uint8_t {
-  LAMBERTIAN = 0,
-  METAL = 1,
-  DIELECTRIC = 2,
-  DIFFUSE_LIGHT = 3,
-  ISOTROPIC = 4,
-};
-
 enum class TextureType : uint8_t {
   SOLID = 0,
   CHECKER = 1,
@@ -106,6 +99,7 @@ enum class PrimitiveType : int {
   VOLUME_SPHERE = 3,
   VOLUME_BOX = 4,
   MOVING_QUAD = 5,
+  INSTANCE = 6,
 };
 
 struct PrimitiveGPU {
@@ -148,6 +142,13 @@ struct PrimitiveGPU {
       Vec3f normal;
       float D_start, D_vec;
     } moving_quad;
+    // A bottom-level BVH placed in the scene. Only the top-level tree (the one
+    // rooted at node 0) holds instances; see flatten_hittable.
+    struct {
+      Vec3f rows[3];     // object = rows * world + translation, rows of the
+      Vec3f translation; // world-to-object matrix
+      int blas_root;     // node index of the instanced BVH's root
+    } instance;
   };
 
   // AABB for BHV intersection fast-path
@@ -220,8 +221,6 @@ struct HitResultSOA {
   bool* hit_anything;
 };
 
-#define NUM_MATERIAL_TYPES 5
-
 // Per-material queues for warp-aggregated atomic dispatch.
 // Replaces thrust::sort_by_key + thrust::partition with O(1) per-thread
 // queue pushes using __ballot_sync and __shfl_sync.
@@ -242,8 +241,95 @@ int get_or_add_material(std::shared_ptr<material> mat_ptr, std::vector<MaterialG
                         std::vector<unsigned char>& image_buffer, std::unordered_map<material*, int>& mat_map,
                         std::unordered_map<texture*, int>& tex_map);
 
+class sah_builder;
+class lbvh_builder;
+class sbvh_builder;
+
+// Which builder lays out the flattened scene: binned SAH, a Morton-order LBVH
+// (fastest builds), optionally with treelet optimization, or a spatial-split
+// SBVH (best trees for large overlapping primitives, slowest builds)
+enum class BvhBuildMode { SAH, LBVH, LBVH_TREELET, SBVH };
+
+// Flattens the scene under 'node' into world-space primitives and builds one
+// BVH over them with 'builder' (sah_builder.hpp, lbvh_builder.hpp,
+// sbvh_builder.hpp). Returns the root node's index, or -1 for an empty scene.
+// A hittable_list or bvh_node under translate / rotate_y wrappers becomes an
+// INSTANCE primitive instead: its subtree is built once, in object space, into
+// a bottom-level BVH after the top-level one in the same arrays, and every
+// transformed reference to it shares that tree.
+// If 'primitive_sources' is given, it receives, for each primitive appended to
+// 'linear_primitives', which one it is in the scene graph's traversal order;
+// update_flattened_primitives needs it to move them later.
+int flatten_hittable(std::shared_ptr<hittable> node, std::vector<LinearBVHNode>& linear_nodes,
+                     std::vector<PrimitiveGPU>& linear_primitives, std::vector<MaterialGPU>& linear_materials,
+                     std::vector<TextureGPU>& linear_textures, std::vector<PerlinDataGPU>& linear_perlin,
+                     std::vector<unsigned char>& image_buffer, std::unordered_map<material*, int>& mat_map,
+                     std::unordered_map<texture*, int>& tex_map, const sah_builder& builder,
+                     std::vector<int>* primitive_sources = nullptr);
+int flatten_hittable(std::shared_ptr<hittable> node, std::vector<LinearBVHNode>& linear_nodes,
+                     std::vector<PrimitiveGPU>& linear_primitives, std::vector<MaterialGPU>& linear_materials,
+                     std::vector<TextureGPU>& linear_textures, std::vector<PerlinDataGPU>& linear_perlin,
+                     std::vector<unsigned char>& image_buffer, std::unordered_map<material*, int>& mat_map,
+                     std::unordered_map<texture*, int>& tex_map, const lbvh_builder& builder,
+                     std::vector<int>* primitive_sources = nullptr);
+int flatten_hittable(std::shared_ptr<hittable> node, std::vector<LinearBVHNode>& linear_nodes,
+                     std::vector<PrimitiveGPU>& linear_primitives, std::vector<MaterialGPU>& linear_materials,
+                     std::vector<TextureGPU>& linear_textures, std::vector<PerlinDataGPU>& linear_perlin,
+                     std::vector<unsigned char>& image_buffer, std::unordered_map<material*, int>& mat_map,
+                     std::unordered_map<texture*, int>& tex_map, const sbvh_builder& builder,
+                     std::vector<int>* primitive_sources = nullptr);
+
+// As above, with the default settings of the builder 'mode' selects
+int flatten_hittable(std::shared_ptr<hittable> node, std::vector<LinearBVHNode>& linear_nodes,
+                     std::vector<PrimitiveGPU>& linear_primitives, std::vector<MaterialGPU>& linear_materials,
+                     std::vector<TextureGPU>& linear_textures, std::vector<PerlinDataGPU>& linear_perlin,
+                     std::vector<unsigned char>& image_buffer, std::unordered_map<material*, int>& mat_map,
+                     std::unordered_map<texture*, int>& tex_map, BvhBuildMode mode,
+                     std::vector<int>* primitive_sources = nullptr);
+
+// As above, with a default sah_builder
 int flatten_hittable(std::shared_ptr<hittable> node, std::vector<LinearBVHNode>& linear_nodes,
                      std::vector<PrimitiveGPU>& linear_primitives, std::vector<MaterialGPU>& linear_materials,
                      std::vector<TextureGPU>& linear_textures, std::vector<PerlinDataGPU>& linear_perlin,
                      std::vector<unsigned char>& image_buffer, std::unordered_map<material*, int>& mat_map,
                      std::unordered_map<texture*, int>& tex_map);
+
+// Collects the scene under 'node' the way flatten_hittable does, without
+// building a BVH: 'primitives' receives its top-level primitives followed by
+// each bottom-level tree's, the order 'primitive_sources' numbers them in, and
+// its materials and textures are added as flatten_hittable would add them.
+void collect_flattened_primitives(std::shared_ptr<hittable> node, std::vector<PrimitiveGPU>& primitives,
+                                  std::vector<MaterialGPU>& linear_materials, std::vector<TextureGPU>& linear_textures,
+                                  std::vector<PerlinDataGPU>& linear_perlin, std::vector<unsigned char>& image_buffer,
+                                  std::unordered_map<material*, int>& mat_map,
+                                  std::unordered_map<texture*, int>& tex_map);
+
+// Collects one top-level object of a scene, appending its primitives in the
+// order flatten_hittable would collect them. With 'instanced' set, transformed
+// subtrees become INSTANCE primitives as in a build, with blas_root left at -1
+// for the caller to point at an existing bottom-level tree; otherwise their
+// transforms are baked into world-space primitives.
+void collect_object_primitives(std::shared_ptr<hittable> object, bool instanced,
+                               std::vector<PrimitiveGPU>& primitives, std::vector<MaterialGPU>& linear_materials,
+                               std::vector<TextureGPU>& linear_textures, std::vector<PerlinDataGPU>& linear_perlin,
+                               std::vector<unsigned char>& image_buffer, std::unordered_map<material*, int>& mat_map,
+                               std::unordered_map<texture*, int>& tex_map);
+
+// Re-reads the primitives of a scene that flatten_hittable already flattened
+// into 'linear_primitives', after objects in it moved (e.g. a translate's
+// offset changed), without building a new BVH; refit it with bvh_refitter
+// (bvh_refit.hpp). The scene graph must still have the same objects,
+// materials and textures as when 'primitive_sources' was recorded.
+void update_flattened_primitives(std::shared_ptr<hittable> node, const std::vector<int>& primitive_sources,
+                                 std::vector<PrimitiveGPU>& linear_primitives,
+                                 std::vector<MaterialGPU>& linear_materials, std::vector<TextureGPU>& linear_textures,
+                                 std::vector<PerlinDataGPU>& linear_perlin, std::vector<unsigned char>& image_buffer,
+                                 std::unordered_map<material*, int>& mat_map,
+                                 std::unordered_map<texture*, int>& tex_map);
+
+// Escape links for the stackless traversal (traverse_bvh_stackless in
+// bvh_kernel.cuh), one per node of a flattened BVH: the node a depth-first walk
+// reaches once it is done with that node's subtree. For a left child that is
+// its sibling; for the root of the top-level or a bottom-level tree, the end of
+// that tree's range. They depend only on the topology, so a refit keeps them.
+std::vector<int> build_escape_links(cuda::span<const LinearBVHNode> nodes);
@@ -0,0 +1,367 @@
+#ifndef FLAT_BVH_HPP
+#define FLAT_BVH_HPP
+
+#include "cuda/bvh_kernel.cuh"
+#include "cuda_structs.hpp"
+#include "hittable.hpp"
+#include "material.hpp"
+#include "quantized_bvh.hpp"
+#include "wavefront.hpp"
+#include "wide_bvh.hpp"
+
+#include <algorithm>
+#include <atomic>
+#include <bit>
+#include <cstdint>
+#include <unordered_map>
+#include <vector>
+
+// Node layout the CPU traversal walks: the binary LinearBVHNode tree shared
+// with CUDA, that tree collapsed into 4- or 8-wide nodes (wide_bvh.hpp), the
+// 4-wide tree with 8-bit quantized child boxes (quantized_bvh.hpp), or the
+// binary tree walked without a stack along escape links (bvh_kernel.cuh)
+enum class BvhLayout { BINARY, WIDE4, WIDE8, QUANTIZED4, STACKLESS };
+
+// Lets the CPU renderer trace the flattened scene that flatten_hittable builds
+// for CUDA: traversal runs over the LinearBVHNode / PrimitiveGPU arrays with
+// the shared bvh_kernel.cuh code instead of through shared_ptr virtual calls.
+// The arrays are borrowed, not copied, and must outlive this object. Hits are
+// resolved in float, like on the GPU, then handed back as an ordinary
+// hit_record that points at the CPU-side material.
+class flat_bvh : public hittable {
+public:
+  flat_bvh(std::vector<LinearBVHNode>& nodes, std::vector<PrimitiveGPU>& primitives,
+           const std::unordered_map<material*, int>& mat_map)
+      : nodes{nodes.data(), nodes.size()}, primitives{primitives.data(), primitives.size()} {
+    // Invert flatten_hittable's material -> id map
+    materials.resize(mat_map.size(), nullptr);
+    for (const auto& [mat, id] : mat_map) {
+      if (id >= 0 && id < int(materials.size())) materials[id] = mat;
+    }
+    if (!this->nodes.empty()) {
+      const LinearBVHNode& root = this->nodes[0];
+      bbox = aabb(point3(root.aabb_min.x, root.aabb_min.y, root.aabb_min.z),
+                  point3(root.aabb_max.x, root.aabb_max.y, root.aabb_max.z));
+    }
+  }
+
+  BvhLayout layout() const { return bvh_layout; }
+
+  // Counts traversals and the nodes they visit (popped off the traversal
+  // stack), for comparing layouts and traversal orders. Every counted ray
+  // updates two shared atomics, so keep it off for timed renders.
+  void count_traversals(bool enable) {
+    counting = enable;
+    traversals.store(0);
+    nodes_visited.store(0);
+  }
+
+  double nodes_per_traversal() const {
+    long long n = traversals.load();
+    return n > 0 ? double(nodes_visited.load()) / n : 0.0;
+  }
+
+  // Collapses the wide tree the layout needs, the first time it is chosen.
+  // Must not be called while a render is tracing this scene.
+  void set_layout(BvhLayout layout) {
+    bvh_layout = layout;
+    if (layout == BvhLayout::WIDE4 && wide4.empty()) collapse_wide4();
+    if (layout == BvhLayout::WIDE8 && wide8.empty()) collapse_wide8();
+    if (layout == BvhLayout::QUANTIZED4 && quantized4.empty()) collapse_quantized4();
+    if (layout == BvhLayout::STACKLESS && escape_links.empty()) escape_links = build_escape_links(nodes);
+  }
+
+  bool treelet_order() const { return treelets; }
+
+  // Stores the wide and quantized trees as page-sized treelets of the nodes
+  // rays most likely visit together instead of depth first, each within one
+  // page of a page-aligned array (wide_bvh::cluster_treelets). The binary tree keeps its depth-first order,
+  // which the shared traversal relies on. Same restriction as set_layout.
+  void set_treelet_order(bool enable) {
+    if (treelets == enable) return;
+    treelets = enable;
+    recollapse();
+  }
+
+  // Memory the current layout's top-level nodes take, and how many there are,
+  // treelet padding included. Bottom-level trees stay binary in every layout
+  // and are not counted.
+  size_t node_count() const {
+    switch (bvh_layout) {
+    case BvhLayout::WIDE4: return wide4.size();
+    case BvhLayout::WIDE8: return wide8.size();
+    case BvhLayout::QUANTIZED4: return quantized4.size();
+    default: {
+      if (nodes.empty()) return 0;
+      // The top-level tree ends at its rightmost leaf; bottom-level trees follow
+      size_t last = 0;
+      while (nodes[last].n_primitives == 0) last = nodes[last].second_child_offset;
+      return last + 1;
+    }
+    }
+  }
+  size_t node_bytes() const {
+    switch (bvh_layout) {
+    case BvhLayout::WIDE4: return node_count() * sizeof(WideBVHNode<4>);
+    case BvhLayout::WIDE8: return node_count() * sizeof(WideBVHNode<8>);
+    case BvhLayout::QUANTIZED4: return node_count() * sizeof(QuantizedBVHNode);
+    case BvhLayout::STACKLESS: return node_count() * (sizeof(LinearBVHNode) + sizeof(int));
+    default: return node_count() * sizeof(LinearBVHNode);
+    }
+  }
+
+  // Picks up new node bounds after the binary tree was refitted in place
+  // (bvh_refit.hpp), re-collapsing any wide tree already built from it. Same
+  // restriction as set_layout.
+  void refitted() {
+    if (nodes.empty()) return;
+    const LinearBVHNode& root = nodes[0];
+    bbox = aabb(point3(root.aabb_min.x, root.aabb_min.y, root.aabb_min.z),
+                point3(root.aabb_max.x, root.aabb_max.y, root.aabb_max.z));
+    recollapse();
+  }
+
+  bool hit(const ray& r, interval ray_t, hit_record& rec, sampler& smp) const override {
+    if (nodes.empty()) return false;
+
+    const point3& o = r.origin();
+    const vec3& d = r.direction();
+    ray_gpu r_gpu(point3_gpu(float(o.x()), float(o.y()), float(o.z())),
+                  vec3_gpu(float(d.x()), float(d.y()), float(d.z())), float(r.time()));
+
+    HitRecordGPU h{};
+    float t_max = std::min(float(ray_t.max), 1e20f);
+    bool hit_anything;
+    int visited = 0;
+    int* visited_out = counting ? &visited : nullptr;
+    switch (bvh_layout) {
+    case BvhLayout::WIDE4:
+      hit_anything = wide4.hit(nodes, primitives, r_gpu, float(ray_t.min), t_max, h, &smp, visited_out);
+      break;
+    case BvhLayout::WIDE8:
+      hit_anything = wide8.hit(nodes, primitives, r_gpu, float(ray_t.min), t_max, h, &smp, visited_out);
+      break;
+    case BvhLayout::QUANTIZED4:
+      hit_anything = quantized4.hit(nodes, primitives, r_gpu, float(ray_t.min), t_max, h, &smp, visited_out);
+      break;
+    case BvhLayout::STACKLESS:
+      hit_anything = hit_linear_bvh_stackless(nodes, cuda::span<const int>{escape_links.data(), escape_links.size()},
+                                              primitives, r_gpu, float(ray_t.min), t_max, h, &smp, visited_out);
+      break;
+    default:
+      hit_anything = hit_linear_bvh(nodes, primitives, r_gpu, float(ray_t.min), t_max, h, &smp, visited_out);
+      break;
+    }
+    if (counting) {
+      traversals.fetch_add(1, std::memory_order_relaxed);
+      nodes_visited.fetch_add(visited, std::memory_order_relaxed);
+    }
+    if (!hit_anything) return false;
+
+    rec.t = h.t;
+    rec.p = r.at(rec.t);
+    rec.normal = vec3(h.normal.x, h.normal.y, h.normal.z);
+    rec.u = h.u;
+    rec.v = h.v;
+    rec.front_face = h.front_face;
+    rec.mat = materials[h.material_id];
+    return true;
+  }
+
+  // Closest hits of the wavefront rays paths.ray_*[k] for every k in 'active', written to hits[k]; a miss leaves
+  // hits.hit_material[k] null. The rays are traced in packets of up to packet_size, taken in the order of 'active',
+  // that walk the binary tree together: each node is fetched once per packet and its box tested against all of the
+  // packet's rays in one loop over their SoA components, and only the rays that hit it descend. Consecutive paths
+  // come from neighbouring pixels, so their rays mostly visit the same nodes. The binary tree is walked whatever
+  // the layout. Hits are the ones hit() would find, but a volume may be sampled in another order than one ray's
+  // traversal would sample it.
+  void hit_batch(path_state_soa& paths, const std::vector<int>& active, interval ray_t, hit_result_soa& hits) const {
+    float t_min = float(ray_t.min);
+    float t_max = std::min(float(ray_t.max), 1e20f);
+    ray_packet packet;
+    for (size_t first = 0; first < active.size(); first += packet_size) {
+      int count = int(std::min(active.size() - first, size_t(packet_size)));
+      for (int i = 0; i < packet_size; i++) {
+        // Lanes past 'count' repeat the last ray, which keeps the box test loop free of a bound check
+        int k = active[first + std::min(i, count - 1)];
+        const point3& o = paths.ray_origin[k];
+        const vec3& d = paths.ray_dir[k];
+        packet.rays[i] = ray_gpu(point3_gpu(float(o.x()), float(o.y()), float(o.z())),
+                                 vec3_gpu(float(d.x()), float(d.y()), float(d.z())), float(paths.ray_time[k]));
+        for (int a = 0; a < 3; a++) {
+          packet.origin[a][i] = packet.rays[i].origin()[a];
+          packet.inv_dir[a][i] = 1.0f / packet.rays[i].direction()[a];
+        }
+        packet.t_max[i] = t_max;
+        packet.path[i] = k;
+      }
+      uint64_t live = count == packet_size ? ~uint64_t(0) : (uint64_t(1) << count) - 1;
+      int visited = 0;
+      uint64_t found = trace_packet(packet, live, t_min, paths, visited);
+      if (counting) {
+        traversals.fetch_add(count, std::memory_order_relaxed);
+        nodes_visited.fetch_add(visited, std::memory_order_relaxed);
+      }
+
+      for (int i = 0; i < count; i++) {
+        int k = packet.path[i];
+        if (!(found >> i & 1)) {
+          hits.hit_material[k] = nullptr;
+          continue;
+        }
+        const HitRecordGPU& h = packet.recs[i];
+        hits.hit_t[k] = h.t;
+        hits.hit_p[k] = paths.ray_origin[k] + real(h.t) * paths.ray_dir[k];
+        hits.hit_normal[k] = vec3(h.normal.x, h.normal.y, h.normal.z);
+        hits.hit_u[k] = h.u;
+        hits.hit_v[k] = h.v;
+        hits.hit_front_face[k] = h.front_face;
+        hits.hit_material[k] = materials[h.material_id];
+      }
+    }
+  }
+
+  aabb bounding_box() const override { return bbox; }
+
+private:
+  static constexpr int packet_size = 64; // one bit per ray in a uint64_t mask
+  static constexpr int min_packet_rays = 4;
+
+  struct ray_packet {
+    float origin[3][packet_size];
+    float inv_dir[3][packet_size];
+    float t_max[packet_size]; // closest hit so far
+    ray_gpu rays[packet_size];
+    HitRecordGPU recs[packet_size];
+    int path[packet_size]; // index into the wavefront batch
+  };
+
+  // Walks the binary tree once for the rays in 'live', with a stack of (node, rays that reached it) entries in place
+  // of traverse_bvh's stack of nodes. Once fewer than min_packet_rays rays reach a node, each finishes its subtree
+  // alone with traverse_bvh, whose nearest-first order prunes better than a shared one. Returns the rays that hit
+  // something, their hits in packet.recs.
+  uint64_t trace_packet(ray_packet& packet, uint64_t live, float t_min, path_state_soa& paths, int& visited) const {
+    struct stack_entry {
+      int index;
+      uint64_t rays;
+    };
+    stack_entry stack[64];
+    int stack_ptr = 0;
+    stack[stack_ptr++] = {0, live};
+    uint64_t found = 0;
+
+    while (stack_ptr > 0) {
+      stack_entry entry = stack[--stack_ptr];
+      const LinearBVHNode& node = nodes[entry.index];
+      if (std::popcount(entry.rays) < min_packet_rays || node.n_primitives > 0) {
+        for (uint64_t m = entry.rays; m; m &= m - 1) {
+          int i = std::countr_zero(m);
+          HitRecordGPU rec;
+          if (traverse_bvh<true>(nodes, primitives, entry.index, packet.rays[i], t_min, packet.t_max[i], rec,
+                                 &paths.rng[packet.path[i]], visited)) {
+            found |= uint64_t(1) << i;
+            packet.t_max[i] = rec.t;
+            packet.recs[i] = rec;
+          }
+        }
+        continue;
+      }
+
+      visited += std::popcount(entry.rays);
+      uint64_t rays = box_mask(node, packet, entry.rays, t_min);
+      if (!rays) continue;
+      // Near child first, as seen by the packet's first ray that reached this node
+      if (packet.inv_dir[node.axis][std::countr_zero(rays)] < 0.0f) {
+        stack[stack_ptr++] = {entry.index + 1, rays};
+        stack[stack_ptr++] = {node.second_child_offset, rays};
+      } else {
+        stack[stack_ptr++] = {node.second_child_offset, rays};
+        stack[stack_ptr++] = {entry.index + 1, rays};
+      }
+    }
+    return found;
+  }
+
+  // aabb_hit for the packet's rays in 'rays', as a bit per ray that hits the box. With most of the packet live, one
+  // branch-free min/max slab test per axis over all of its lanes, which the compiler vectorizes, beats picking out
+  // the live ones.
+  static uint64_t box_mask(const LinearBVHNode& node, const ray_packet& packet, uint64_t rays, float t_min) {
+    if (std::popcount(rays) >= packet_size / 4) {
+      float lo[packet_size], hi[packet_size];
+      for (int i = 0; i < packet_size; i++) {
+        lo[i] = t_min;
+        hi[i] = packet.t_max[i];
+      }
+      for (int a = 0; a < 3; a++) {
+        float lo_bound = (&node.aabb_min.x)[a], hi_bound = (&node.aabb_max.x)[a];
+        for (int i = 0; i < packet_size; i++) {
+          float t0 = (lo_bound - packet.origin[a][i]) * packet.inv_dir[a][i];
+          float t1 = (hi_bound - packet.origin[a][i]) * packet.inv_dir[a][i];
+          lo[i] = std::max(lo[i], std::min(t0, t1));
+          hi[i] = std::min(hi[i], std::max(t0, t1) * 1.0000004f);
+        }
+      }
+      uint64_t mask = 0;
+      for (int i = 0; i < packet_size; i++) mask |= uint64_t(lo[i] < hi[i]) << i;
+      return mask & rays;
+    }
+    uint64_t mask = 0;
+    for (uint64_t m = rays; m; m &= m - 1) {
+      int i = std::countr_zero(m);
+      if (lane_hits_box(node, packet, i, t_min)) mask |= uint64_t(1) << i;
+    }
+    return mask;
+  }
+
+  static bool lane_hits_box(const LinearBVHNode& node, const ray_packet& packet, int i, float t_min) {
+    const float* lo_bounds = &node.aabb_min.x;
+    const float* hi_bounds = &node.aabb_max.x;
+    float lo = t_min, hi = packet.t_max[i];
+    for (int a = 0; a < 3; a++) {
+      float inv = packet.inv_dir[a][i];
+      float t0 = (lo_bounds[a] - packet.origin[a][i]) * inv;
+      float t1 = (hi_bounds[a] - packet.origin[a][i]) * inv;
+      float near_t = inv < 0.0f ? t1 : t0;
+      float far_t = (inv < 0.0f ? t0 : t1) * 1.0000004f;
+      lo = near_t > lo ? near_t : lo;
+      hi = far_t < hi ? far_t : hi;
+    }
+    return !(hi <= lo);
+  }
+
+  static constexpr size_t treelet_bytes = page_allocator<WideBVHNode<4>>::page_bytes; // one page of the node array
+
+  void collapse_wide4() {
+    wide4.collapse(nodes);
+    if (treelets) wide4.cluster_treelets(treelet_bytes / sizeof(WideBVHNode<4>));
+  }
+  void collapse_wide8() {
+    wide8.collapse(nodes);
+    if (treelets) wide8.cluster_treelets(treelet_bytes / sizeof(WideBVHNode<8>));
+  }
+  void collapse_quantized4() {
+    quantized4.collapse(nodes, treelets ? treelet_bytes / sizeof(QuantizedBVHNode) : 0);
+  }
+  // Rebuilds the wide trees that were already built
+  void recollapse() {
+    if (!wide4.empty()) collapse_wide4();
+    if (!wide8.empty()) collapse_wide8();
+    if (!quantized4.empty()) collapse_quantized4();
+  }
+
+  cuda::span<LinearBVHNode> nodes;
+  cuda::span<PrimitiveGPU> primitives;
+  std::vector<material*> materials; // indexed by PrimitiveGPU::material_id
+  aabb bbox;
+  BvhLayout bvh_layout = BvhLayout::BINARY;
+  bool treelets = false;
+  bool counting = false;
+  mutable std::atomic<long long> traversals{0};
+  mutable std::atomic<long long> nodes_visited{0};
+  wide_bvh<4> wide4;
+  wide_bvh<8> wide8;
+  quantized_bvh quantized4;
+  std::vector<int> escape_links; // for STACKLESS
+};
+
+#endif // !FLAT_BVH_HPP
@@ -14,10 +14,10 @@ class hit_record {
 public:
   point3 p;
   vec3 normal;
-  std::shared_ptr<material> mat;
-  double t;
-  double u;
-  double v;
+  material* mat; // owned by the primitive that was hit
+  real t;
+  real u;
+  real v;
   bool front_face;
 
   void set_face_normal(const ray& r, const vec3& outward_normal) {
@@ -33,7 +33,8 @@ class hittable {
 public:
   virtual ~hittable() = default;
 
-  virtual bool hit(const ray& r, interval ray_t, hit_record& rec) const = 0;
+  virtual bool hit(const ray& r, interval ray_t, hit_record& rec,
+                   sampler& smp) const = 0;
 
   virtual aabb bounding_box() const = 0;
 };
@@ -44,13 +45,14 @@ public:
       : object(object), offset(offset) {
     bbox = object->bounding_box() + offset;
   }
-  bool hit(const ray& r, interval ray_t, hit_record& rec) const override {
+  bool hit(const ray& r, interval ray_t, hit_record& rec,
+           sampler& smp) const override {
     // Move the ray backwards by the offset
     ray offset_r(r.origin() - offset, r.direction(), r.time());
 
     // Determine whether an intersection exists along the offset ray (and if so,
     // where)
-    if (!object->hit(offset_r, ray_t, rec)) return false;
+    if (!object->hit(offset_r, ray_t, rec, smp)) return false;
 
     // Move the intersection point forwards by the offset
     rec.p += offset;
@@ -60,6 +62,13 @@ public:
 
   aabb bounding_box() const override { return bbox; }
 
+  // Moves the object, keeping its bounding box in step. Any hittable_list or
+  // bvh_node above it keeps its old bounds until rebuilt.
+  void set_offset(const vec3& new_offset) {
+    offset = new_offset;
+    bbox = object->bounding_box() + offset;
+  }
+
 public:
   std::shared_ptr<hittable> object;
   vec3 offset;
@@ -99,7 +108,8 @@ public:
 
     bbox = aabb(min, max);
   }
-  bool hit(const ray& r, interval ray_t, hit_record& rec) const override {
+  bool hit(const ray& r, interval ray_t, hit_record& rec,
+           sampler& smp) const override {
 
     // Transform the ray from world space to object space.
     auto origin =
@@ -117,7 +127,7 @@ public:
     // Determine whether an intersection exists in object space (and if so,
     // where).
 
-    if (!object->hit(rotated_r, ray_t, rec)) return false;
+    if (!object->hit(rotated_r, ray_t, rec, smp)) return false;
 
     // Transform the intersection from object space back to world space.
 
@@ -136,8 +146,8 @@ public:
 
 public:
   std::shared_ptr<hittable> object;
-  double sin_theta;
-  double cos_theta;
+  real sin_theta;
+  real cos_theta;
   aabb bbox;
 };
 
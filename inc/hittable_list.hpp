@@ -23,13 +23,14 @@ public:
     bbox = aabb(bbox, object->bounding_box());
   }
 
-  bool hit(const ray& r, interval ray_t, hit_record& rec) const override {
+  bool hit(const ray& r, interval ray_t, hit_record& rec,
+           sampler& smp) const override {
     hit_record temp_rec;
     bool hit_anything = false;
     auto closest_so_far = ray_t.max;
 
     for (const auto& object : objects) {
-      if (object->hit(r, interval(ray_t.min, closest_so_far), temp_rec)) {
+      if (object->hit(r, interval(ray_t.min, closest_so_far), temp_rec, smp)) {
         hit_anything = true;
         closest_so_far = temp_rec.t;
         rec = temp_rec;
@@ -2,48 +2,60 @@
 #define INTERVAL_HPP
 
 #include <algorithm>
+#include <type_traits>
 
 #include "rt.hpp"
 
-class interval {
+template <class T> class basic_interval {
 public:
-  double min, max;
+  T min, max;
 
-  interval() : min{+infinity}, max{-infinity} {} // Default interval is empty
+  // Default interval is empty
+  basic_interval() : min{+T(infinity)}, max{-T(infinity)} {}
 
-  interval(double min, double max) : min{min}, max{max} {}
+  basic_interval(T min, T max) : min{min}, max{max} {}
 
-  interval(const interval& a, const interval& b) {
+  basic_interval(const basic_interval& a, const basic_interval& b) {
     // Create interval tightly enclosing two input intervals.
     min = a.min <= b.min ? a.min : b.min;
     max = a.max >= b.max ? a.max : b.max;
   }
 
-  double size() const { return max - min; }
+  T size() const { return max - min; }
 
-  bool contains(double x) const { return min <= x && x <= max; }
+  bool contains(T x) const { return min <= x && x <= max; }
 
-  bool surrounds(double x) const { return min < x && x < max; }
+  bool surrounds(T x) const { return min < x && x < max; }
 
-  double clamp(double x) const { return std::clamp(x, min, max); }
+  T clamp(T x) const { return std::clamp(x, min, max); }
 
-  interval expand(double delta) const {
+  basic_interval expand(T delta) const {
     auto padding = delta / 2;
-    return interval(min - padding, max + padding);
+    return basic_interval(min - padding, max + padding);
   }
 
-  static const interval empty, universe;
+  static const basic_interval empty, universe;
 };
 
-inline const interval interval::empty = interval(+infinity, -infinity);
-inline const interval interval::universe = interval(-infinity, +infinity);
-
-inline interval operator+(const interval& ival, double displacement) {
-  return interval(ival.min + displacement, ival.max + displacement);
+template <class T>
+inline const basic_interval<T> basic_interval<T>::empty =
+    basic_interval<T>(+T(infinity), -T(infinity));
+template <class T>
+inline const basic_interval<T> basic_interval<T>::universe =
+    basic_interval<T>(-T(infinity), +T(infinity));
+
+template <class T>
+inline basic_interval<T> operator+(const basic_interval<T>& ival,
+                                   std::type_identity_t<T> displacement) {
+  return basic_interval<T>(ival.min + displacement, ival.max + displacement);
 }
 
-inline interval operator+(double displacement, const interval& ival) {
+template <class T>
+inline basic_interval<T> operator+(std::type_identity_t<T> displacement,
+                                   const basic_interval<T>& ival) {
   return ival + displacement;
 }
 
+using interval = basic_interval<real>;
+
 #endif // !INTERVAL_HPP
@@ -0,0 +1,451 @@
+#ifndef LBVH_BUILDER_HPP
+#define LBVH_BUILDER_HPP
+
+#include "bvh_build.hpp"
+#include "thread_pool.hpp"
+
+#include <algorithm>
+#include <array>
+#include <bit>
+#include <cstdint>
+#include <limits>
+#include <vector>
+
+// Linear BVH builder (Lauterbach et al. 2009). Primitives are sorted along a
+// Morton curve through their centroids; every node then splits its range where
+// the highest bit that differs between its first and last code flips. Building
+// is a radix sort plus one linear pass with no cost evaluation, so it is far
+// quicker than sah_builder and suits scenes rebuilt often, at the price of a
+// worse tree. The optional treelet pass (Karras and Aila 2013) recovers most
+// of that: bottom-up, every node's treelet of up to treelet_size subtrees is
+// rearranged into the shape with the least total surface area.
+//
+// Nodes are written depth-first in the same LinearBVHNode layout sah_builder
+// produces, and with 'parallel' set the code computation, the sort, large
+// subtrees and the treelet pass run on thread_pool::global().
+class lbvh_builder {
+public:
+  int bits_per_axis = 21;        // 21: 63-bit codes; 10: 30-bit codes, half the sort passes but coarser splits
+  bool optimize_treelets = true; // run the treelet pass after emitting the tree
+  int treelet_size = 5;          // subtrees per treelet, clamped to [3, max_treelet_size]; cost grows ~3^n
+  int max_leaf_size = 4;         // largest leaf the collapse test may form
+  float traversal_cost = 2.0f;   // as in sah_builder, for the collapse test
+  float intersection_cost = 1.0f;
+  bool parallel = true;          // use thread_pool::global() for large ranges
+
+  // Same contract as sah_builder::build: 'refs' end up in Morton order, the
+  // nodes are appended to 'nodes' and their primitives, in leaf order, to
+  // 'ordered'. Returns the root's index, or -1 when there is nothing to build.
+  int build(std::vector<primitive_ref>& refs, const std::vector<PrimitiveGPU>& primitives,
+            std::vector<LinearBVHNode>& nodes, std::vector<PrimitiveGPU>& ordered) const {
+    if (refs.empty()) return -1;
+    std::vector<uint64_t> codes = sort_by_morton_code(refs);
+
+    int root = int(nodes.size());
+    nodes.reserve(nodes.size() + 2 * refs.size() - 1);
+    ordered.reserve(ordered.size() + refs.size());
+    int first_primitive = int(ordered.size());
+    emit(refs, codes, 0, int(refs.size()), 0, primitives, nodes, ordered);
+    if (optimize_treelets) optimize(nodes, ordered, root, first_primitive);
+    return root;
+  }
+
+private:
+  static constexpr int max_treelet_size = 8;
+  // Past this depth nodes split their range in half, as in sah_builder
+  static constexpr int lbvh_depth_limit = 32;
+  static constexpr int parallel_build_span = 4096;
+  static constexpr int parallel_chunk = 16384;
+
+  struct keyed_ref {
+    uint64_t code;
+    int ref;
+  };
+
+  int chunks(int count) const {
+    return parallel && count >= 2 * parallel_chunk ? (count + parallel_chunk - 1) / parallel_chunk : 1;
+  }
+
+  // Calls fn(chunk, chunk_begin, chunk_end) for every chunk of [0, count)
+  template <class F> void for_each_chunk(int count, F&& fn) const {
+    int n = chunks(count);
+    auto run = [&](int c) { fn(c, c * parallel_chunk, std::min(count, (c + 1) * parallel_chunk)); };
+    if (n == 1) {
+      fn(0, 0, count);
+    } else {
+      thread_pool::global().parallel_for(0, n, 1, run);
+    }
+  }
+
+  // Spreads the low 21 bits of 'v' out to every third bit
+  static uint64_t spread_bits(uint64_t v) {
+    v &= 0x1fffff;
+    v = (v | v << 32) & 0x1f00000000ffffull;
+    v = (v | v << 16) & 0x1f0000ff0000ffull;
+    v = (v | v << 8) & 0x100f00f00f00f00full;
+    v = (v | v << 4) & 0x10c30c30c30c30c3ull;
+    v = (v | v << 2) & 0x1249249249249249ull;
+    return v;
+  }
+
+  // Axis a Morton code bit belongs to: x is the top bit of every triple
+  static int axis_of_bit(int bit) { return 2 - bit % 3; }
+
+  // Sorts 'refs' by the Morton code of their centroids and returns the sorted
+  // codes. Ties keep their original order, so the result is deterministic.
+  std::vector<uint64_t> sort_by_morton_code(std::vector<primitive_ref>& refs) const {
+    int n = int(refs.size());
+    int bits = std::clamp(bits_per_axis, 1, 21);
+
+    std::vector<aabb> partial(chunks(n), aabb::empty);
+    for_each_chunk(n, [&](int c, int b, int e) {
+      for (int i = b; i < e; i++) partial[c] = aabb(partial[c], aabb(refs[i].centroid, refs[i].centroid));
+    });
+    aabb centroid_bounds = aabb::empty;
+    for (const aabb& box : partial) centroid_bounds = aabb(centroid_bounds, box);
+
+    // Cubic cells, so a flat scene is not split across its thin axis as often
+    // as along the others
+    float size = std::max({centroid_bounds.x.size(), centroid_bounds.y.size(), centroid_bounds.z.size()});
+    float scale = size > 0 ? 1.0f / size : 0.0f;
+    std::vector<keyed_ref> keys(n);
+    float cells = float(1u << bits);
+    for_each_chunk(n, [&](int, int b, int e) {
+      for (int i = b; i < e; i++) {
+        uint64_t code = 0;
+        for (int axis = 0; axis < 3; axis++) {
+          float t = (refs[i].centroid[axis] - centroid_bounds.axis_interval(axis).min) * scale;
+          uint64_t q = uint64_t(std::clamp(t * cells, 0.0f, cells - 1.0f));
+          code |= spread_bits(q) << (2 - axis);
+        }
+        keys[i] = {code, i};
+      }
+    });
+    radix_sort(keys, 3 * bits);
+
+    std::vector<primitive_ref> sorted(n);
+    std::vector<uint64_t> codes(n);
+    for_each_chunk(n, [&](int, int b, int e) {
+      for (int i = b; i < e; i++) {
+        sorted[i] = refs[keys[i].ref];
+        codes[i] = keys[i].code;
+      }
+    });
+    refs.swap(sorted);
+    return codes;
+  }
+
+  // Stable least-significant-digit radix sort on the low 'key_bits' bits of
+  // the codes, a byte per pass. Each chunk counts its digits, the counts turn
+  // into per-chunk output offsets, and the chunks scatter side by side.
+  // Passes whose digit is the same for every key are skipped.
+  void radix_sort(std::vector<keyed_ref>& keys, int key_bits) const {
+    int n = int(keys.size());
+    std::vector<keyed_ref> scattered(n);
+    std::vector<std::array<int, 256>> offsets(chunks(n));
+
+    for (int shift = 0; shift < key_bits; shift += 8) {
+      for_each_chunk(n, [&](int c, int b, int e) {
+        offsets[c].fill(0);
+        for (int i = b; i < e; i++) offsets[c][(keys[i].code >> shift) & 0xff]++;
+      });
+
+      bool one_digit = false;
+      for (int digit = 0, total = 0; digit < 256; digit++) {
+        int digit_count = 0;
+        for (auto& chunk : offsets) {
+          int count = chunk[digit];
+          chunk[digit] = total;
+          total += count;
+          digit_count += count;
+        }
+        one_digit = one_digit || digit_count == n;
+      }
+      if (one_digit) continue;
+
+      for_each_chunk(n, [&](int c, int b, int e) {
+        for (int i = b; i < e; i++) scattered[offsets[c][(keys[i].code >> shift) & 0xff]++] = keys[i];
+      });
+      keys.swap(scattered);
+    }
+  }
+
+  struct subtree {
+    aabb bounds;
+    float cost; // SAH cost, in units of surface area
+  };
+
+  // Writes the subtree over the sorted range [begin, end). Once both halves of
+  // a small range are written, they are collapsed back into one leaf if
+  // testing all of its primitives costs no more than the subtree would.
+  subtree emit(const std::vector<primitive_ref>& refs, const std::vector<uint64_t>& codes, int begin, int end,
+               int depth, const std::vector<PrimitiveGPU>& primitives, std::vector<LinearBVHNode>& nodes,
+               std::vector<PrimitiveGPU>& ordered) const {
+    int node_index = int(nodes.size());
+    nodes.emplace_back();
+
+    int count = end - begin;
+    if (count == 1) {
+      const primitive_ref& ref = refs[begin];
+      set_node_bounds(nodes[node_index], ref.bounds);
+      nodes[node_index].n_primitives = 1;
+      nodes[node_index].primitive_offset = int(ordered.size());
+      ordered.push_back(primitives[ref.index]);
+      return {ref.bounds, intersection_cost * half_area(ref.bounds)};
+    }
+
+    // Split where the highest differing bit flips; identical codes, or a
+    // range that is already too deep, just halve
+    int mid = begin + count / 2;
+    int axis = 0;
+    uint64_t differing = codes[begin] ^ codes[end - 1];
+    if (differing != 0) {
+      int bit = 63 - std::countl_zero(differing);
+      axis = axis_of_bit(bit);
+      if (depth < lbvh_depth_limit) {
+        uint64_t mask = uint64_t(1) << bit;
+        mid = int(std::partition_point(codes.begin() + begin, codes.begin() + end,
+                                       [mask](uint64_t code) { return !(code & mask); }) -
+                  codes.begin());
+      }
+    }
+
+    subtree left, right;
+    int right_index;
+    if (!parallel || count < parallel_build_span) {
+      left = emit(refs, codes, begin, mid, depth + 1, primitives, nodes, ordered);
+      right_index = int(nodes.size());
+      right = emit(refs, codes, mid, end, depth + 1, primitives, nodes, ordered);
+    } else {
+      std::vector<LinearBVHNode> right_nodes;
+      std::vector<PrimitiveGPU> right_ordered;
+      thread_pool& pool = thread_pool::global();
+      auto right_task = pool.submit([&, mid, end, depth] {
+        right_nodes.reserve(2 * (end - mid) - 1);
+        right_ordered.reserve(end - mid);
+        return emit(refs, codes, mid, end, depth + 1, primitives, right_nodes, right_ordered);
+      });
+      left = emit(refs, codes, begin, mid, depth + 1, primitives, nodes, ordered);
+      right = pool.wait(right_task);
+      right_index = append_subtree(right_nodes, right_ordered, nodes, ordered);
+    }
+
+    aabb bounds(left.bounds, right.bounds);
+    float area = half_area(bounds);
+    float split_cost = traversal_cost * area + left.cost + right.cost;
+    set_node_bounds(nodes[node_index], bounds);
+
+    if (count <= std::clamp(max_leaf_size, 1, max_leaf_primitives) && intersection_cost * count * area <= split_cost) {
+      // The subtree is the tail of both arrays, its primitives already in order
+      nodes.resize(node_index + 1);
+      nodes[node_index].n_primitives = uint16_t(count);
+      nodes[node_index].primitive_offset = int(ordered.size()) - count;
+      nodes[node_index].axis = 0;
+      return {bounds, intersection_cost * count * area};
+    }
+
+    nodes[node_index].n_primitives = 0;
+    nodes[node_index].second_child_offset = right_index;
+    nodes[node_index].axis = uint8_t(axis);
+    return {bounds, split_cost};
+  }
+
+  // Node bounds as stored in LinearBVHNode
+  struct node_box {
+    Vec3f min, max;
+
+    node_box merge(const node_box& b) const {
+      return {{std::min(min.x, b.min.x), std::min(min.y, b.min.y), std::min(min.z, b.min.z)},
+              {std::max(max.x, b.max.x), std::max(max.y, b.max.y), std::max(max.z, b.max.z)}};
+    }
+
+    float half_area() const {
+      float dx = max.x - min.x, dy = max.y - min.y, dz = max.z - min.z;
+      return dx * dy + dy * dz + dz * dx;
+    }
+  };
+
+  // The tree under 'root' as child links, so treelets can be rearranged
+  // before it is written back out depth-first
+  struct linked_tree {
+    std::vector<int> left, right; // -1 for leaves
+    std::vector<int> leaves;      // leaf count of each subtree
+    std::vector<node_box> boxes;
+  };
+
+  void optimize(std::vector<LinearBVHNode>& nodes, std::vector<PrimitiveGPU>& ordered, int root,
+                int first_primitive) const {
+    int n = int(nodes.size()) - root;
+    linked_tree tree{std::vector<int>(n, -1), std::vector<int>(n, -1), std::vector<int>(n, 1),
+                     std::vector<node_box>(n)};
+    // Children always come after their parent, so a reverse sweep sees them first
+    for (int i = n - 1; i >= 0; i--) {
+      const LinearBVHNode& node = nodes[root + i];
+      tree.boxes[i] = {node.aabb_min, node.aabb_max};
+      if (node.n_primitives == 0) {
+        tree.left[i] = i + 1;
+        tree.right[i] = node.second_child_offset - root;
+        tree.leaves[i] = tree.leaves[i + 1] + tree.leaves[tree.right[i]];
+      }
+    }
+
+    optimize_subtree(tree, 0);
+    write_back(tree, nodes, ordered, root, first_primitive);
+  }
+
+  // Post-order: a node's treelet is rearranged once both of its subtrees are
+  // done. A treelet only relinks nodes inside its own subtree, so sibling
+  // subtrees can go in parallel.
+  void optimize_subtree(linked_tree& tree, int node) const {
+    if (tree.left[node] < 0) return;
+    if (!parallel || tree.leaves[node] < parallel_build_span) {
+      optimize_subtree(tree, tree.left[node]);
+      optimize_subtree(tree, tree.right[node]);
+    } else {
+      thread_pool& pool = thread_pool::global();
+      auto right_task = pool.submit([this, &tree, node] { optimize_subtree(tree, tree.right[node]); });
+      optimize_subtree(tree, tree.left[node]);
+      pool.wait(right_task);
+    }
+    if (tree.leaves[node] >= 3) optimize_treelet(tree, node);
+  }
+
+  void optimize_treelet(linked_tree& tree, int root) const {
+    int size = std::clamp(treelet_size, 3, max_treelet_size);
+
+    // Grow the treelet by repeatedly opening up its largest interior leaf
+    std::array<int, max_treelet_size> leaf;
+    std::array<int, max_treelet_size - 1> interior;
+    int leaf_count = 2, interior_count = 1;
+    leaf[0] = tree.left[root];
+    leaf[1] = tree.right[root];
+    interior[0] = root;
+    while (leaf_count < size) {
+      int largest = -1;
+      float largest_area = -1.0f;
+      for (int i = 0; i < leaf_count; i++) {
+        float area = tree.boxes[leaf[i]].half_area();
+        if (tree.left[leaf[i]] >= 0 && area > largest_area) {
+          largest = i;
+          largest_area = area;
+        }
+      }
+      if (largest < 0) break;
+      int opened = leaf[largest];
+      interior[interior_count++] = opened;
+      leaf[largest] = tree.left[opened];
+      leaf[leaf_count++] = tree.right[opened];
+    }
+
+    // Cheapest arrangement of every subset of the treelet's leaves: the
+    // subtrees below the leaves cost the same however they are arranged, so
+    // only the areas of the interior nodes count
+    int full = (1 << leaf_count) - 1;
+    std::array<node_box, 1 << max_treelet_size> box;
+    std::array<float, 1 << max_treelet_size> cost;
+    std::array<int, 1 << max_treelet_size> best_split;
+    for (int mask = 1; mask <= full; mask++) {
+      int lowest = std::countr_zero(unsigned(mask));
+      int rest = mask & (mask - 1);
+      box[mask] = rest ? box[rest].merge(tree.boxes[leaf[lowest]]) : tree.boxes[leaf[lowest]];
+      if (!rest) {
+        cost[mask] = 0.0f;
+        continue;
+      }
+      // Each split once: the side holding the lowest leaf goes left, with
+      // any proper subset of the other leaves
+      float best = std::numeric_limits<float>::infinity();
+      for (int others = rest & (rest - 1);; others = (others - 1) & rest) {
+        int side = others | (1 << lowest);
+        float c = cost[side] + cost[mask ^ side];
+        if (c < best) {
+          best = c;
+          best_split[mask] = side;
+        }
+        if (others == 0) break;
+      }
+      cost[mask] = box[mask].half_area() + best;
+    }
+
+    float current = 0.0f;
+    for (int i = 0; i < interior_count; i++) current += tree.boxes[interior[i]].half_area();
+    if (!(cost[full] < current)) return;
+
+    int next_interior = 1;
+    relink(tree, full, root, leaf, interior, next_interior, best_split);
+  }
+
+  // Rebuilds the treelet below 'node' from the chosen splits, reusing its
+  // interior nodes
+  void relink(linked_tree& tree, int mask, int node, const std::array<int, max_treelet_size>& leaf,
+              const std::array<int, max_treelet_size - 1>& interior, int& next_interior,
+              const std::array<int, 1 << max_treelet_size>& best_split) const {
+    int child[2];
+    int sides[2] = {best_split[mask], mask ^ best_split[mask]};
+    for (int s = 0; s < 2; s++) {
+      if (std::has_single_bit(unsigned(sides[s]))) {
+        child[s] = leaf[std::countr_zero(unsigned(sides[s]))];
+      } else {
+        child[s] = interior[next_interior++];
+        relink(tree, sides[s], child[s], leaf, interior, next_interior, best_split);
+      }
+    }
+    tree.left[node] = child[0];
+    tree.right[node] = child[1];
+    tree.boxes[node] = tree.boxes[child[0]].merge(tree.boxes[child[1]]);
+    tree.leaves[node] = tree.leaves[child[0]] + tree.leaves[child[1]];
+  }
+
+  // Writes the relinked tree back over nodes[root..] in depth-first order, and
+  // its primitives over ordered[first_primitive..] in the new leaf order, so
+  // every subtree's primitives stay one contiguous run. Rearranged treelets
+  // can deepen the tree; if it would no longer fit the traversal stack the
+  // original tree is kept.
+  static void write_back(const linked_tree& tree, std::vector<LinearBVHNode>& nodes,
+                         std::vector<PrimitiveGPU>& ordered, int root, int first_primitive) {
+    struct pending {
+      int node;
+      int parent; // written node waiting for this one as its second child, or -1
+      int depth;
+    };
+    std::vector<LinearBVHNode> out;
+    out.reserve(tree.left.size());
+    std::vector<PrimitiveGPU> out_ordered;
+    out_ordered.reserve(ordered.size() - first_primitive);
+    std::vector<pending> stack = {{0, -1, 0}};
+    while (!stack.empty()) {
+      pending p = stack.back();
+      stack.pop_back();
+      if (p.depth > 62) return;
+      int index = int(out.size());
+      if (p.parent >= 0) out[p.parent].second_child_offset = root + index;
+
+      LinearBVHNode node = nodes[root + p.node];
+      node.aabb_min = tree.boxes[p.node].min;
+      node.aabb_max = tree.boxes[p.node].max;
+      if (tree.left[p.node] >= 0) {
+        // Children split along the axis their centres are furthest apart on,
+        // the lower one first, as traversal orders them by that axis
+        int lo = tree.left[p.node], hi = tree.right[p.node];
+        const node_box& a = tree.boxes[lo];
+        const node_box& b = tree.boxes[hi];
+        float d[3] = {a.min.x + a.max.x - b.min.x - b.max.x, a.min.y + a.max.y - b.min.y - b.max.y,
+                      a.min.z + a.max.z - b.min.z - b.max.z};
+        float ad[3] = {std::abs(d[0]), std::abs(d[1]), std::abs(d[2])};
+        node.axis = uint8_t(ad[0] >= ad[1] ? (ad[0] >= ad[2] ? 0 : 2) : (ad[1] >= ad[2] ? 1 : 2));
+        if (d[node.axis] > 0) std::swap(lo, hi);
+        stack.push_back({hi, index, p.depth + 1});
+        stack.push_back({lo, -1, p.depth + 1});
+      } else {
+        out_ordered.insert(out_ordered.end(), ordered.begin() + node.primitive_offset,
+                           ordered.begin() + node.primitive_offset + node.n_primitives);
+        node.primitive_offset = first_primitive + int(out_ordered.size()) - node.n_primitives;
+      }
+      out.push_back(node);
+    }
+    std::copy(out.begin(), out.end(), nodes.begin() + root);
+    std::copy(out_ordered.begin(), out_ordered.end(), ordered.begin() + first_primitive);
+  }
+};
+
+#endif // !LBVH_BUILDER_HPP
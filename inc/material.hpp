@@ -4,8 +4,25 @@
 #include "color.hpp"
 #include "hittable.hpp"
 #include "texture.hpp"
+#include <cstdint>
 #include <memory>
 
+// Shared by the CPU wavefront queues and MaterialGPU, so both sides sort
+// shading work by the same key.
+enum class MaterialType : uint8_t {
+  LAMBERTIAN = 0,
+  METAL = 1,
+  DIELECTRIC = 2,
+  DIFFUSE_LIGHT = 3,
+  ISOTROPIC = 4,
+};
+
+#define NUM_MATERIAL_TYPES 5
+
+// Kind of bounce a material's scatter() produces, so the integrator can give
+// each kind its own depth budget.
+enum class ScatterLobe { DIFFUSE, SPECULAR, VOLUME };
+
 class material {
 public:
   virtual ~material() = default;
@@ -14,9 +31,12 @@ public:
     return color(0, 0, 0);
   }
   virtual bool scatter(const ray& /*r_in*/, const hit_record& /*rec*/,
-                       color& /*attenuation*/, ray& /*scattered*/) const {
+                       color& /*attenuation*/, ray& /*scattered*/,
+                       sampler& /*smp*/) const {
     return false;
   }
+  virtual ScatterLobe lobe() const { return ScatterLobe::DIFFUSE; }
+  virtual MaterialType type() const = 0;
 };
 
 class lambertian : public material {
@@ -26,8 +46,8 @@ public:
   lambertian(std::shared_ptr<texture> tex) : tex{tex} {}
 
   bool scatter(const ray& r_in, const hit_record& rec, color& attenuation,
-               ray& scattered) const override {
-    auto scatter_direction = rec.normal + random_unit_vector();
+               ray& scattered, sampler& smp) const override {
+    auto scatter_direction = rec.normal + random_unit_vector(smp);
 
     if (scatter_direction.near_zero()) {
       scatter_direction = rec.normal;
@@ -38,6 +58,8 @@ public:
     return true;
   }
 
+  MaterialType type() const override { return MaterialType::LAMBERTIAN; }
+
   color get_albedo() const {
     // Book 2 delegates storage to the texture pointer.
     // We retrieve the flat albedo for GPU static mapping via value():
@@ -54,14 +76,17 @@ public:
       : albedo{albedo}, fuzz{fuzz < 1 ? fuzz : 1} {}
 
   bool scatter(const ray& r_in, const hit_record& rec, color& attenuation,
-               ray& scattered) const override {
+               ray& scattered, sampler& smp) const override {
     vec3 reflected = reflect(unit_vector(r_in.direction()), rec.normal);
-    reflected = unit_vector(reflected) + (fuzz * random_in_unit_sphere());
+    reflected = unit_vector(reflected) + (fuzz * random_in_unit_sphere(smp));
     scattered = ray(rec.p, reflected, r_in.time());
     attenuation = albedo;
     return (dot(scattered.direction(), rec.normal) > 0);
   }
 
+  ScatterLobe lobe() const override { return ScatterLobe::SPECULAR; }
+  MaterialType type() const override { return MaterialType::METAL; }
+
   color get_albedo() const { return albedo; }
   double get_fuzz() const { return fuzz; }
 
@@ -74,7 +99,7 @@ class dielectric : public material {
 public:
   dielectric(double refraction_index) : refraction_index{refraction_index} {}
   bool scatter(const ray& r_in, const hit_record& rec, color& attenuation,
-               ray& scattered) const override {
+               ray& scattered, sampler& smp) const override {
     attenuation = color(1.0, 1.0, 1.0);
     double ri = rec.front_face ? (1.0 / refraction_index) : refraction_index;
 
@@ -86,7 +111,7 @@ public:
     bool cannot_refract = ri * sin_theta > 1.0;
     vec3 direction;
 
-    if (cannot_refract || reflectance(cos_theta, ri) > random_double()) {
+    if (cannot_refract || reflectance(cos_theta, ri) > smp.next_double()) {
       direction = reflect(unit_direction, rec.normal);
     } else {
       direction = refract(unit_direction, rec.normal, ri);
@@ -97,6 +122,9 @@ public:
     return true;
   }
 
+  ScatterLobe lobe() const override { return ScatterLobe::SPECULAR; }
+  MaterialType type() const override { return MaterialType::DIELECTRIC; }
+
   double get_refraction_index() const { return refraction_index; }
 
 private:
@@ -121,6 +149,8 @@ public:
     return tex->value(u, v, p);
   }
 
+  MaterialType type() const override { return MaterialType::DIFFUSE_LIGHT; }
+
 public:
   std::shared_ptr<texture> tex;
 };
@@ -131,12 +161,15 @@ public:
   isotropic(std::shared_ptr<texture> tex) : tex(tex) {}
 
   bool scatter(const ray& r_in, const hit_record& rec, color& attenuation,
-               ray& scattered) const override {
-    scattered = ray(rec.p, random_unit_vector(), r_in.time());
+               ray& scattered, sampler& smp) const override {
+    scattered = ray(rec.p, random_unit_vector(smp), r_in.time());
     attenuation = tex->value(rec.u, rec.v, rec.p);
     return true;
   }
 
+  ScatterLobe lobe() const override { return ScatterLobe::VOLUME; }
+  MaterialType type() const override { return MaterialType::ISOTROPIC; }
+
 public:
   std::shared_ptr<texture> tex;
 };
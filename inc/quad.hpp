@@ -4,8 +4,17 @@
 #include "hittable_list.hpp"
 #include "material.hpp"
 #include "vec3.hpp"
+#include <limits>
 #include <memory>
 
+// Rounding error of a plane distance measured from a point on the
+// parallelogram (Q, u, v); it grows with the coordinates' magnitude, so in
+// float it can exceed the renderer's t_min on large scenes.
+inline real rounding_tolerance(const point3& Q, const vec3& u, const vec3& v) {
+  return 4 * std::numeric_limits<real>::epsilon() *
+         (Q.length() + u.length() + v.length());
+}
+
 class quad : public hittable {
 public:
   quad(const point3& Q, const vec3& u, const vec3& v,
@@ -15,6 +24,7 @@ public:
     normal = unit_vector(n);
     D = dot(normal, Q);
     w = n / dot(n, n);
+    plane_tolerance = rounding_tolerance(Q, u, v);
 
     set_bounding_box();
   }
@@ -27,7 +37,8 @@ public:
   }
 
   aabb bounding_box() const override { return bbox; }
-  bool hit(const ray& r, interval ray_t, hit_record& rec) const override {
+  bool hit(const ray& r, interval ray_t, hit_record& rec,
+           sampler& /*smp*/) const override {
     auto denom = dot(normal, r.direction());
 
     // No hit if the ray is parallel to the plane;
@@ -35,8 +46,15 @@ public:
       return false;
     }
 
+    // A ray starting on the plane (within rounding of the plane distance)
+    // meets it at t = 0, which keeps it from hitting its own origin again.
+    auto plane_dist = D - dot(normal, r.origin());
+    if (std::fabs(plane_dist) <= plane_tolerance) {
+      plane_dist = 0;
+    }
+
     // Return false if the hit point parameter t is outside the ray interval
-    auto t = (D - dot(normal, r.origin())) / denom;
+    auto t = plane_dist / denom;
     if (!ray_t.contains(t)) {
       return false;
     }
@@ -54,13 +72,13 @@ public:
 
     rec.t = t;
     rec.p = intersection;
-    rec.mat = mat;
+    rec.mat = mat.get();
     rec.set_face_normal(r, normal);
 
     return true;
   }
 
-  virtual bool is_interior(double a, double b, hit_record& rec) const {
+  virtual bool is_interior(real a, real b, hit_record& rec) const {
     interval unit_interval = interval(0, 1);
     // Given the hit point in plane coordinates, return false if it is outside
     // the primitive, otherwise set the hit record UV coordinates and return
@@ -79,7 +97,8 @@ public:
   std::shared_ptr<material> mat;
   aabb bbox;
   vec3 normal;
-  double D;
+  real D;
+  real plane_tolerance;
 };
 
 class moving_quad : public hittable {
@@ -92,6 +111,8 @@ public:
     D1 = dot(normal, Q1);
     D2 = dot(normal, Q2);
     w = n / dot(n, n);
+    plane_tolerance = std::max(rounding_tolerance(Q1, u, v),
+                               rounding_tolerance(Q2, u, v));
     set_bounding_box();
   }
 
@@ -103,13 +124,16 @@ public:
 
   aabb bounding_box() const override { return bbox; }
 
-  bool hit(const ray& r, interval ray_t, hit_record& rec) const override {
+  bool hit(const ray& r, interval ray_t, hit_record& rec,
+           sampler& /*smp*/) const override {
     point3 Q = Q1 + (Q2 - Q1) * r.time();
-    double D = D1 + (D2 - D1) * r.time();
+    real D = D1 + (D2 - D1) * r.time();
 
     auto denom = dot(normal, r.direction());
     if (std::fabs(denom) < 1e-8) return false;
-    auto t = (D - dot(normal, r.origin())) / denom;
+    auto plane_dist = D - dot(normal, r.origin());
+    if (std::fabs(plane_dist) <= plane_tolerance) plane_dist = 0;
+    auto t = plane_dist / denom;
     if (!ray_t.contains(t)) return false;
 
     auto intersection = r.at(t);
@@ -121,7 +145,7 @@ public:
 
     rec.t = t;
     rec.p = intersection;
-    rec.mat = mat;
+    rec.mat = mat.get();
     rec.set_face_normal(r, normal);
     rec.u = alpha;
     rec.v = beta;
@@ -135,7 +159,8 @@ public:
   std::shared_ptr<material> mat;
   aabb bbox;
   vec3 normal;
-  double D1, D2;
+  real D1, D2;
+  real plane_tolerance;
 };
 
 inline shared_ptr<hittable_list> moving_box(const point3& a1, const point3& a2,
@@ -0,0 +1,87 @@
+#ifndef QUANTIZED_BVH_HPP
+#define QUANTIZED_BVH_HPP
+
+#include "cuda/quantized_bvh.cuh"
+#include "cuda_structs.hpp"
+#include "wide_bvh.hpp"
+
+#include <algorithm>
+#include <cmath>
+#include <vector>
+
+// Builds the compressed QuantizedBVHNode tree (cuda/quantized_bvh.cuh) on the CPU and traces it with the shared
+// host/device traversal. The tree has the same shape as wide_bvh<4>: it is collapsed the same way, then every node
+// is re-encoded with its children's boxes quantized to 8 bits per plane.
+class quantized_bvh {
+public:
+  // Page aligned, like wide_bvh's nodes, so treelets each sit in one page
+  using node_array = std::vector<QuantizedBVHNode, page_allocator<QuantizedBVHNode>>;
+
+  bool empty() const { return nodes.empty(); }
+  size_t size() const { return nodes.size(); }
+  const node_array& data() const { return nodes; } // for upload to the GPU
+
+  // Same shape as wide_bvh<4>::collapse, optionally reordered into treelets (wide_bvh::cluster_treelets)
+  void collapse(cuda::span<LinearBVHNode> binary, int nodes_per_treelet = 0) {
+    wide_bvh<4> wide;
+    wide.collapse(binary);
+    wide.cluster_treelets(nodes_per_treelet);
+    nodes.resize(wide.size());
+    for (size_t i = 0; i < wide.size(); i++) nodes[i] = quantize(wide.node(i));
+  }
+
+  template <class Rng>
+  bool hit(cuda::span<LinearBVHNode> binary, cuda::span<PrimitiveGPU> primitives, const ray_gpu& ray, float t_min,
+           float t_max, HitRecordGPU& rec, Rng* local_rand_state, int* nodes_visited = nullptr) const {
+    return hit_quantized_bvh(cuda::span<const QuantizedBVHNode>{nodes.data(), nodes.size()}, binary, primitives,
+                             ray, t_min, t_max, rec, local_rand_state, nodes_visited);
+  }
+
+private:
+  node_array nodes;
+
+  static QuantizedBVHNode quantize(const WideBVHNode<4>& wide) {
+    QuantizedBVHNode node{};
+    // wide_bvh fills lanes in order and leaves the rest as inverted boxes
+    int count = 0;
+    while (count < 4 && wide.bounds[0][count] <= wide.bounds[3][count]) count++;
+    node.count = uint8_t(count);
+    for (int lane = 0; lane < count; lane++) {
+      node.child[lane] = wide.child[lane];
+      node.n_primitives[lane] = wide.n_primitives[lane];
+    }
+    if (count == 0) return node;
+
+    float* origin = &node.origin.x;
+    for (int a = 0; a < 3; a++) {
+      float lo = wide.bounds[a][0], hi = wide.bounds[a + 3][0];
+      for (int lane = 1; lane < count; lane++) {
+        lo = std::min(lo, wide.bounds[a][lane]);
+        hi = std::max(hi, wide.bounds[a + 3][lane]);
+      }
+      origin[a] = lo;
+
+      // The smallest power-of-two step whose 255th grid plane still reaches the upper bound
+      int exponent = hi > lo ? int(std::ceil(std::log2((hi - lo) / 255.0f))) : -126;
+      exponent = std::clamp(exponent, -126, 127);
+      while (exponent < 127 && quantized_plane(lo, quantized_step(exponent), 255) < hi) exponent++;
+      while (exponent > -126 && quantized_plane(lo, quantized_step(exponent - 1), 255) >= hi) exponent--;
+      node.exponent[a] = int8_t(exponent);
+      float step = quantized_step(exponent);
+
+      // Round outward, then correct for rounding in the decode so the decoded box never shrinks
+      for (int lane = 0; lane < count; lane++) {
+        float child_lo = wide.bounds[a][lane], child_hi = wide.bounds[a + 3][lane];
+        int q_lo = std::clamp(int(std::floor((child_lo - lo) / step)), 0, 255);
+        while (q_lo > 0 && quantized_plane(lo, step, uint8_t(q_lo)) > child_lo) q_lo--;
+        int q_hi = std::clamp(int(std::ceil((child_hi - lo) / step)), 0, 255);
+        while (q_hi < 255 && quantized_plane(lo, step, uint8_t(q_hi)) < child_hi) q_hi++;
+        node.lower[a][lane] = uint8_t(q_lo);
+        node.upper[a][lane] = uint8_t(q_hi);
+      }
+    }
+    return node;
+  }
+};
+
+#endif // !QUANTIZED_BVH_HPP
@@ -3,28 +3,30 @@
 
 #include "vec3.hpp"
 
-class ray {
+template <class T> class basic_ray {
 public:
-  ray() {}
+  basic_ray() {}
 
-  ray(const point3& origin, const vec3& direction, double time)
+  basic_ray(const basic_vec3<T>& origin, const basic_vec3<T>& direction, T time)
       : orig{origin}, dir{direction}, tm{time} {}
-  ray(const point3& origin, const vec3& direction)
-      : ray(origin, direction, 0) {}
+  basic_ray(const basic_vec3<T>& origin, const basic_vec3<T>& direction)
+      : basic_ray(origin, direction, 0) {}
 
-  const point3& origin() const { return orig; }
-  const vec3& direction() const { return dir; }
-  double time() const { return tm; }
+  const basic_vec3<T>& origin() const { return orig; }
+  const basic_vec3<T>& direction() const { return dir; }
+  T time() const { return tm; }
 
-  point3 at(double t) const {
+  basic_vec3<T> at(T t) const {
     // P(t) = A + t*b
     return orig + (t * dir);
   }
 
 private:
-  point3 orig;
-  vec3 dir;
-  double tm;
+  basic_vec3<T> orig;
+  basic_vec3<T> dir;
+  T tm;
 };
 
+using ray = basic_ray<real>;
+
 #endif // !RAY_HPP
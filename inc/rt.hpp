@@ -1,8 +1,20 @@
 #ifndef RT_HPP
 #define RT_HPP
 
+#include <atomic>
 #include <limits>
-#include <random>
+#include <numbers>
+
+#include "sampler.hpp"
+
+// Scalar type of the CPU geometry path (vec3, ray, interval, aabb). float by
+// default, the same precision the CUDA kernels trace in; build with
+// RT_DOUBLE_PRECISION for double-precision reference renders.
+#ifdef RT_DOUBLE_PRECISION
+using real = double;
+#else
+using real = float;
+#endif
 
 // Constants
 
@@ -12,11 +24,18 @@ const double infinity = std::numeric_limits<double>::infinity();
 
 inline double degrees_to_radians(double degrees) { return degrees * std::numbers::pi / 180.0; }
 
+inline sampler& thread_sampler() {
+  // Per-thread generator for code that has no sampler of its own (scene
+  // generation, Perlin tables). Each thread gets its own PCG stream, so
+  // threads never contend on shared generator state.
+  static std::atomic<uint64_t> next_stream{0};
+  thread_local sampler generator(0x853c49e6748fea9bULL, next_stream++);
+  return generator;
+}
+
 inline double random_double() {
-  // Returns a random real in [0,1]
-  static std::uniform_real_distribution<double> distribution(0.0, 1.0);
-  static std::mt19937 generator;
-  return distribution(generator);
+  // Returns a random real in [0,1)
+  return thread_sampler().next_double();
 }
 
 inline double random_double(double min, double max) {
@@ -0,0 +1,290 @@
+#ifndef SAH_BUILDER_HPP
+#define SAH_BUILDER_HPP
+
+#include "bvh_build.hpp"
+#include "thread_pool.hpp"
+
+#include <algorithm>
+#include <array>
+#include <limits>
+#include <vector>
+
+// Binned surface area heuristic builder. Each node drops its primitives'
+// centroids into bin_count equal slabs along every axis and picks the slab
+// boundary minimising
+//
+//   traversal_cost + intersection_cost * (N_l * A_l + N_r * A_r) / A
+//
+// where A is a box's surface area. That is an O(n) pass per level, against the
+// O(n log n) sort the median split in bvh_node does. Nodes are written
+// depth-first straight into the LinearBVHNode layout hit_linear_bvh walks (left
+// child right after its parent), and primitives are copied out in leaf order.
+//
+// With 'parallel' set, large ranges reduce their bounds and bins in chunks on
+// thread_pool::global(), and large subtrees build as tasks into their own
+// arrays that are then appended and relocated. Bounds and bins only take
+// minima, maxima and counts, partitioning is stable, and the chunks merge in
+// order, so the result is the same bit for bit as a serial build.
+class sah_builder {
+public:
+  int bin_count = 16;             // slabs per axis, clamped to [2, max_bins]
+  float traversal_cost = 2.0f;    // cost of visiting one node: pop, fetch, slab test
+  float intersection_cost = 1.0f; // cost of testing one primitive
+  int max_leaf_size = 4;          // leaves hold up to this many primitives
+  bool parallel = true;           // use thread_pool::global() for large ranges
+
+  // Builds over 'refs' (reordered in place) and appends the nodes to 'nodes'
+  // and the primitives they reference, in leaf order, to 'ordered'. Returns the
+  // root's index, or -1 when there is nothing to build.
+  int build(std::vector<primitive_ref>& refs, const std::vector<PrimitiveGPU>& primitives,
+            std::vector<LinearBVHNode>& nodes, std::vector<PrimitiveGPU>& ordered) const {
+    if (refs.empty()) return -1;
+    nodes.reserve(nodes.size() + 2 * refs.size() - 1);
+    ordered.reserve(ordered.size() + refs.size());
+    std::vector<primitive_ref> scratch(refs.size());
+    return build_node(refs, scratch, 0, int(refs.size()), 0, primitives, nodes, ordered);
+  }
+
+private:
+  static constexpr int max_bins = 64;
+  // Past this depth nodes split at the centroid median instead, which bounds
+  // the depth by 32 + log2(n) and keeps traversal inside its 64-entry stack.
+  static constexpr int sah_depth_limit = 32;
+  // Subtrees at least this large build as separate tasks
+  static constexpr int parallel_build_span = 4096;
+  // Ranges at least this large reduce, bin and partition in chunks this size
+  static constexpr int parallel_chunk = 16384;
+
+  struct split {
+    int axis = -1; // -1: no slab boundary separates the centroids
+    int bin = 0;   // bins [0, bin] go left
+    float cost = std::numeric_limits<float>::infinity();
+  };
+
+  struct bin {
+    aabb bounds = aabb::empty;
+    int count = 0;
+  };
+  using axis_bins = std::array<std::array<bin, max_bins>, 3>;
+
+  int bins() const { return std::clamp(bin_count, 2, max_bins); }
+
+  int bin_of(const primitive_ref& ref, const aabb& centroid_bounds, int axis) const {
+    const interval& extent = centroid_bounds.axis_interval(axis);
+    int b = int(bins() * ((ref.centroid[axis] - extent.min) / extent.size()));
+    return std::clamp(b, 0, bins() - 1);
+  }
+
+  // Number of chunks [begin, end) is cut into: 1 unless the range is large
+  // enough to spread over the pool
+  int chunks(int begin, int end) const {
+    int count = end - begin;
+    return parallel && count >= 2 * parallel_chunk ? (count + parallel_chunk - 1) / parallel_chunk : 1;
+  }
+
+  // Calls fn(chunk, chunk_begin, chunk_end) for every chunk of [begin, end)
+  template <class F> void for_each_chunk(int begin, int end, F&& fn) const {
+    int n = chunks(begin, end);
+    auto run = [&](int c) { fn(c, begin + c * parallel_chunk, std::min(end, begin + (c + 1) * parallel_chunk)); };
+    if (n == 1) {
+      fn(0, begin, end);
+    } else {
+      thread_pool::global().parallel_for(0, n, 1, run);
+    }
+  }
+
+  void reduce_bounds(const std::vector<primitive_ref>& refs, int begin, int end, aabb& bounds,
+                     aabb& centroid_bounds) const {
+    auto reduce = [&refs](int b, int e, aabb& box, aabb& centroids) {
+      for (int i = b; i < e; i++) {
+        box = aabb(box, refs[i].bounds);
+        centroids = aabb(centroids, aabb(refs[i].centroid, refs[i].centroid));
+      }
+    };
+    bounds = centroid_bounds = aabb::empty;
+    int n = chunks(begin, end);
+    if (n == 1) return reduce(begin, end, bounds, centroid_bounds);
+
+    std::vector<std::pair<aabb, aabb>> partial(n, {aabb::empty, aabb::empty});
+    for_each_chunk(begin, end, [&](int c, int b, int e) { reduce(b, e, partial[c].first, partial[c].second); });
+    for (const auto& [box, centroids] : partial) {
+      bounds = aabb(bounds, box);
+      centroid_bounds = aabb(centroid_bounds, centroids);
+    }
+  }
+
+  split find_split(const std::vector<primitive_ref>& refs, int begin, int end, const aabb& bounds,
+                   const aabb& centroid_bounds) const {
+    int n = bins();
+    bool binned[3];
+    for (int axis = 0; axis < 3; axis++) binned[axis] = centroid_bounds.axis_interval(axis).size() > 0;
+
+    auto bin_range = [&](int b, int e, axis_bins& slabs) {
+      for (int axis = 0; axis < 3; axis++) {
+        if (!binned[axis]) continue;
+        for (int i = b; i < e; i++) {
+          bin& s = slabs[axis][bin_of(refs[i], centroid_bounds, axis)];
+          s.bounds = aabb(s.bounds, refs[i].bounds);
+          s.count++;
+        }
+      }
+    };
+    axis_bins merged;
+    int chunk_count = chunks(begin, end);
+    if (chunk_count == 1) {
+      bin_range(begin, end, merged);
+    } else {
+      std::vector<axis_bins> partial(chunk_count);
+      for_each_chunk(begin, end, [&](int c, int b, int e) { bin_range(b, e, partial[c]); });
+      for (const axis_bins& slabs : partial) {
+        for (int axis = 0; axis < 3; axis++) {
+          for (int b = 0; b < n; b++) {
+            merged[axis][b].bounds = aabb(merged[axis][b].bounds, slabs[axis][b].bounds);
+            merged[axis][b].count += slabs[axis][b].count;
+          }
+        }
+      }
+    }
+
+    float inv_area = 1.0f / std::max(half_area(bounds), std::numeric_limits<float>::min());
+    split best;
+    for (int axis = 0; axis < 3; axis++) {
+      if (!binned[axis]) continue;
+      const std::array<bin, max_bins>& slabs = merged[axis];
+
+      // Sweep right to left for the area * count of every right-hand side
+      std::array<float, max_bins> right_cost;
+      aabb right = aabb::empty;
+      int right_count = 0;
+      for (int b = n - 1; b > 0; b--) {
+        right = aabb(right, slabs[b].bounds);
+        right_count += slabs[b].count;
+        right_cost[b - 1] = right_count ? right_count * half_area(right) : 0.0f;
+      }
+
+      aabb left = aabb::empty;
+      int left_count = 0;
+      for (int b = 0; b < n - 1; b++) {
+        left = aabb(left, slabs[b].bounds);
+        left_count += slabs[b].count;
+        if (left_count == 0 || left_count == end - begin) continue;
+        float cost =
+            traversal_cost + intersection_cost * (left_count * half_area(left) + right_cost[b]) * inv_area;
+        if (cost < best.cost) best = {axis, b, cost};
+      }
+    }
+    return best;
+  }
+
+  // Stable partition of [begin, end) by 'goes_left', with the right side
+  // staged in the same range of 'scratch'; returns the first ref of the right
+  // side. Large ranges count and scatter chunk by chunk.
+  template <class Pred>
+  int partition(std::vector<primitive_ref>& refs, std::vector<primitive_ref>& scratch, int begin, int end,
+                const Pred& goes_left) const {
+    int n = chunks(begin, end);
+    if (n == 1) {
+      int left = begin, right = begin;
+      for (int i = begin; i < end; i++) {
+        if (goes_left(refs[i])) {
+          refs[left++] = refs[i];
+        } else {
+          scratch[right++] = refs[i];
+        }
+      }
+      std::copy(scratch.begin() + begin, scratch.begin() + right, refs.begin() + left);
+      return left;
+    }
+
+    std::vector<int> left_counts(n);
+    for_each_chunk(begin, end, [&](int c, int b, int e) {
+      left_counts[c] = int(std::count_if(refs.begin() + b, refs.begin() + e, goes_left));
+    });
+    std::vector<int> left_at(n), right_at(n);
+    int total_left = 0;
+    for (int c = 0; c < n; c++) {
+      left_at[c] = begin + total_left;
+      total_left += left_counts[c];
+    }
+    for (int c = 0, right_total = total_left; c < n; c++) {
+      right_at[c] = begin + right_total;
+      right_total += std::min(parallel_chunk, end - begin - c * parallel_chunk) - left_counts[c];
+    }
+
+    for_each_chunk(begin, end, [&](int c, int b, int e) {
+      int l = left_at[c], r = right_at[c];
+      for (int i = b; i < e; i++) scratch[goes_left(refs[i]) ? l++ : r++] = refs[i];
+    });
+    for_each_chunk(begin, end, [&](int, int b, int e) {
+      std::copy(scratch.begin() + b, scratch.begin() + e, refs.begin() + b);
+    });
+    return begin + total_left;
+  }
+
+  // 'scratch' is as long as 'refs'; a node only touches its own range of it
+  int build_node(std::vector<primitive_ref>& refs, std::vector<primitive_ref>& scratch, int begin, int end, int depth,
+                 const std::vector<PrimitiveGPU>& primitives, std::vector<LinearBVHNode>& nodes,
+                 std::vector<PrimitiveGPU>& ordered) const {
+    int node_index = int(nodes.size());
+    nodes.emplace_back();
+
+    aabb bounds, centroid_bounds;
+    reduce_bounds(refs, begin, end, bounds, centroid_bounds);
+    set_node_bounds(nodes[node_index], bounds);
+
+    int count = end - begin;
+    split best;
+    if (count > 1 && depth < sah_depth_limit) best = find_split(refs, begin, end, bounds, centroid_bounds);
+
+    int leaf_limit = std::clamp(max_leaf_size, 1, max_leaf_primitives);
+    if (count == 1 || (count <= leaf_limit && intersection_cost * count <= best.cost)) {
+      nodes[node_index].n_primitives = uint16_t(count);
+      nodes[node_index].primitive_offset = int(ordered.size());
+      for (int i = begin; i < end; i++) ordered.push_back(primitives[refs[i].index]);
+      return node_index;
+    }
+
+    int mid;
+    int axis = best.axis;
+    if (axis >= 0) {
+      auto goes_left = [&](const primitive_ref& ref) { return bin_of(ref, centroid_bounds, axis) <= best.bin; };
+      mid = partition(refs, scratch, begin, end, goes_left);
+    } else {
+      // Too deep, or every centroid in one spot: halve the range by count.
+      // Ties fall back to the primitive index so the halves are well defined.
+      axis = centroid_bounds.longest_axis();
+      mid = begin + count / 2;
+      std::nth_element(refs.begin() + begin, refs.begin() + mid, refs.begin() + end,
+                       [axis](const primitive_ref& a, const primitive_ref& b) {
+                         if (a.centroid[axis] != b.centroid[axis]) return a.centroid[axis] < b.centroid[axis];
+                         return a.index < b.index;
+                       });
+    }
+
+    int right;
+    if (!parallel || count < parallel_build_span) {
+      build_node(refs, scratch, begin, mid, depth + 1, primitives, nodes, ordered);
+      right = build_node(refs, scratch, mid, end, depth + 1, primitives, nodes, ordered);
+    } else {
+      // The halves own disjoint ranges of 'refs'. The right one builds into
+      // arrays of its own, which land after the left subtree once both finish.
+      std::vector<LinearBVHNode> right_nodes;
+      std::vector<PrimitiveGPU> right_ordered;
+      thread_pool& pool = thread_pool::global();
+      auto right_task = pool.submit([&, mid, end, depth] {
+        right_nodes.reserve(2 * (end - mid) - 1);
+        right_ordered.reserve(end - mid);
+        build_node(refs, scratch, mid, end, depth + 1, primitives, right_nodes, right_ordered);
+      });
+      build_node(refs, scratch, begin, mid, depth + 1, primitives, nodes, ordered);
+      pool.wait(right_task);
+      right = append_subtree(right_nodes, right_ordered, nodes, ordered);
+    }
+    nodes[node_index].n_primitives = 0;
+    nodes[node_index].second_child_offset = right;
+    nodes[node_index].axis = uint8_t(axis);
+    return node_index;
+  }
+};
+
+#endif // !SAH_BUILDER_HPP
@@ -0,0 +1,58 @@
+#ifndef SAMPLER_HPP
+#define SAMPLER_HPP
+
+#include <cstdint>
+
+// PCG32 random number generator (O'Neill, pcg-random.org). Each instance is
+// small enough to live on the stack of a render thread, so threads never
+// share generator state.
+class sampler {
+public:
+  sampler() : sampler(0x853c49e6748fea9bULL, 0xda3e39cb94b95bdbULL) {}
+
+  sampler(uint64_t seed, uint64_t stream) {
+    state = 0;
+    inc = (stream << 1) | 1;
+    next_u32();
+    state += seed;
+    next_u32();
+  }
+
+  // Generator for one camera sample. Depends only on the pixel, the sample
+  // index and the render seed, so an image is reproducible no matter which
+  // thread renders which pixel, or in how many passes.
+  static sampler for_pixel_sample(uint64_t pixel_index, uint64_t sample_index,
+                                  uint64_t seed = 0) {
+    return sampler(mix(sample_index ^ mix(seed)), pixel_index);
+  }
+
+  uint32_t next_u32() {
+    uint64_t old = state;
+    state = old * 6364136223846793005ULL + inc;
+    uint32_t xorshifted = uint32_t(((old >> 18u) ^ old) >> 27u);
+    uint32_t rot = uint32_t(old >> 59u);
+    return (xorshifted >> rot) | (xorshifted << ((-rot) & 31));
+  }
+
+  // Returns a random real in [0,1)
+  double next_double() { return next_u32() * 0x1p-32; }
+
+  // Returns a random real in [min, max)
+  double next_double(double min, double max) {
+    return min + (max - min) * next_double();
+  }
+
+private:
+  uint64_t state;
+  uint64_t inc;
+
+  static uint64_t mix(uint64_t x) {
+    // SplitMix64 finalizer, decorrelates neighbouring seeds
+    x += 0x9e3779b97f4a7c15ULL;
+    x = (x ^ (x >> 30)) * 0xbf58476d1ce4e5b9ULL;
+    x = (x ^ (x >> 27)) * 0x94d049bb133111ebULL;
+    return x ^ (x >> 31);
+  }
+};
+
+#endif // !SAMPLER_HPP
@@ -0,0 +1,415 @@
+#ifndef SBVH_BUILDER_HPP
+#define SBVH_BUILDER_HPP
+
+#include "bvh_build.hpp"
+
+#include <algorithm>
+#include <array>
+#include <cmath>
+#include <limits>
+#include <utility>
+#include <vector>
+
+// Spatial-split BVH builder (Stich et al., "Spatial Splits in Bounding Volume Hierarchies"). Each node first finds
+// the best binned SAH object split, as sah_builder does. When the two halves of that split overlap by more than
+// overlap_threshold of the root's area, which is typical of large quads and long boxes, it also bins the node's
+// bounds into equal spatial slabs. Straddling references are clipped to each slab: quads exactly, as polygons,
+// and everything else by box. A spatial split that wins the SAH duplicates its straddling references into both
+// children, each clipped to its side, unless keeping a reference whole on one side is cheaper ("unsplitting").
+//
+// Duplicates are capped at duplication_budget times the primitive count over the whole tree. A duplicated
+// primitive is copied into every leaf that references it, so each leaf is still one contiguous run of the
+// PrimitiveGPU array. Volumes are never duplicated: a ray that tested one twice would draw two free-flight
+// distances and see a denser medium.
+//
+// The build is serial; the shared duplication budget makes the result depend on build order.
+class sbvh_builder {
+public:
+  int bin_count = 16;               // object and spatial slabs per axis, clamped to [2, max_bins]
+  float traversal_cost = 2.0f;      // cost of visiting one node: pop, fetch, slab test
+  float intersection_cost = 1.0f;   // cost of testing one primitive
+  int max_leaf_size = 4;            // leaves hold up to this many references
+  float overlap_threshold = 1e-5f;  // try spatial splits past this child overlap, as a fraction of the root area
+  float duplication_budget = 0.3f;  // extra references allowed, as a fraction of the primitive count
+
+  // As sah_builder::build, except that 'refs' is consumed, and 'ordered' may grow by up to the duplication budget
+  // more primitives than 'refs' holds
+  int build(std::vector<primitive_ref>& refs, const std::vector<PrimitiveGPU>& primitives,
+            std::vector<LinearBVHNode>& nodes, std::vector<PrimitiveGPU>& ordered) const {
+    if (refs.empty()) return -1;
+    aabb root_bounds = aabb::empty;
+    for (const primitive_ref& ref : refs) root_bounds = aabb(root_bounds, ref.bounds);
+
+    build_state state{primitives, nodes, ordered};
+    state.min_overlap = overlap_threshold * half_area(root_bounds);
+    state.references_left = int(duplication_budget * float(refs.size()));
+    nodes.reserve(nodes.size() + 2 * refs.size() - 1);
+    ordered.reserve(ordered.size() + refs.size() + state.references_left);
+    return build_node(state, std::move(refs), 0);
+  }
+
+private:
+  static constexpr int max_bins = 64;
+  // Past this depth nodes split at the centroid median without spatial splits, as in sah_builder
+  static constexpr int sah_depth_limit = 32;
+
+  struct build_state {
+    const std::vector<PrimitiveGPU>& primitives;
+    std::vector<LinearBVHNode>& nodes;
+    std::vector<PrimitiveGPU>& ordered;
+    float min_overlap = 0.0f;
+    int references_left = 0; // duplicates still allowed
+  };
+
+  struct object_split {
+    int axis = -1; // -1: no slab boundary separates the centroids
+    int bin = 0;   // bins [0, bin] go left
+    float cost = std::numeric_limits<float>::infinity();
+    aabb left = aabb::empty, right = aabb::empty;
+  };
+
+  struct spatial_split {
+    int axis = -1;
+    real plane = 0; // references below go left, above go right
+    float cost = std::numeric_limits<float>::infinity();
+    int duplicates = 0;
+  };
+
+  struct bin {
+    aabb bounds = aabb::empty;
+    int count = 0;   // object bins: centroids; spatial bins: references entering here
+    int exits = 0;   // spatial bins: references leaving here
+  };
+
+  int bins() const { return std::clamp(bin_count, 2, max_bins); }
+
+  static aabb intersect(const aabb& a, const aabb& b) {
+    return aabb(interval(std::max(a.x.min, b.x.min), std::min(a.x.max, b.x.max)),
+                interval(std::max(a.y.min, b.y.min), std::min(a.y.max, b.y.max)),
+                interval(std::max(a.z.min, b.z.min), std::min(a.z.max, b.z.max)));
+  }
+
+  static bool is_empty(const aabb& box) {
+    return box.x.min > box.x.max || box.y.min > box.y.max || box.z.min > box.z.max;
+  }
+
+  static point3 centre(const aabb& box) {
+    return 0.5 * (point3(box.x.min, box.y.min, box.z.min) + point3(box.x.max, box.y.max, box.z.max));
+  }
+
+  static bool splittable(const PrimitiveGPU& prim) {
+    return prim.type != PrimitiveType::VOLUME_SPHERE && prim.type != PrimitiveType::VOLUME_BOX;
+  }
+
+  // Bounds of the part of the reference inside [lo, hi] on 'axis'. Quads are clipped as polygons (in double, then
+  // rounded outward), anything else is just cut by the slab.
+  static aabb clip(const primitive_ref& ref, const PrimitiveGPU& prim, int axis, real lo, real hi) {
+    aabb slab = aabb::universe;
+    interval& range = axis == 0 ? slab.x : axis == 1 ? slab.y : slab.z;
+    range = interval(lo, hi);
+    if (prim.type != PrimitiveType::QUAD) return intersect(ref.bounds, slab);
+
+    const Vec3f& q = prim.quad.Q;
+    const Vec3f& u = prim.quad.u;
+    const Vec3f& v = prim.quad.v;
+    std::array<std::array<double, 3>, 8> polygon = {{{double(q.x), double(q.y), double(q.z)},
+                                                     {double(q.x) + u.x, double(q.y) + u.y, double(q.z) + u.z},
+                                                     {double(q.x) + u.x + v.x, double(q.y) + u.y + v.y,
+                                                      double(q.z) + u.z + v.z},
+                                                     {double(q.x) + v.x, double(q.y) + v.y, double(q.z) + v.z}}};
+    int count = 4;
+    // Sutherland-Hodgman against the two planes; a convex quad gains at most one vertex per plane
+    auto clip_plane = [&](double plane, bool keep_below) {
+      std::array<std::array<double, 3>, 8> out;
+      int n = 0;
+      for (int i = 0; i < count; i++) {
+        const auto& a = polygon[i];
+        const auto& b = polygon[(i + 1) % count];
+        bool a_in = keep_below ? a[axis] <= plane : a[axis] >= plane;
+        bool b_in = keep_below ? b[axis] <= plane : b[axis] >= plane;
+        if (a_in) out[n++] = a;
+        if (a_in != b_in) {
+          double t = (plane - a[axis]) / (b[axis] - a[axis]);
+          std::array<double, 3> p;
+          for (int k = 0; k < 3; k++) p[k] = a[k] + t * (b[k] - a[k]);
+          p[axis] = plane;
+          out[n++] = p;
+        }
+      }
+      polygon = out;
+      count = n;
+    };
+    clip_plane(double(lo), false);
+    clip_plane(double(hi), true);
+    if (count == 0) return aabb::empty;
+
+    double box_min[3], box_max[3];
+    for (int k = 0; k < 3; k++) {
+      box_min[k] = box_max[k] = polygon[0][k];
+      for (int i = 1; i < count; i++) {
+        box_min[k] = std::min(box_min[k], polygon[i][k]);
+        box_max[k] = std::max(box_max[k], polygon[i][k]);
+      }
+    }
+    auto down = [](double x) {
+      real r = real(x);
+      return double(r) > x ? std::nextafter(r, -std::numeric_limits<real>::infinity()) : r;
+    };
+    auto up = [](double x) {
+      real r = real(x);
+      return double(r) < x ? std::nextafter(r, std::numeric_limits<real>::infinity()) : r;
+    };
+    aabb clipped(interval(down(box_min[0]), up(box_max[0])), interval(down(box_min[1]), up(box_max[1])),
+                 interval(down(box_min[2]), up(box_max[2])));
+    // The reference may already have been clipped further up the tree
+    return intersect(intersect(clipped, slab), ref.bounds);
+  }
+
+  int centroid_bin(const primitive_ref& ref, const aabb& centroid_bounds, int axis) const {
+    const interval& extent = centroid_bounds.axis_interval(axis);
+    int b = int(bins() * ((ref.centroid[axis] - extent.min) / extent.size()));
+    return std::clamp(b, 0, bins() - 1);
+  }
+
+  object_split find_object_split(const std::vector<primitive_ref>& refs, const aabb& bounds,
+                                 const aabb& centroid_bounds) const {
+    int n = bins();
+    float inv_area = 1.0f / std::max(half_area(bounds), std::numeric_limits<float>::min());
+    int count = int(refs.size());
+    object_split best;
+    for (int axis = 0; axis < 3; axis++) {
+      if (centroid_bounds.axis_interval(axis).size() <= 0) continue;
+      std::array<bin, max_bins> slabs;
+      for (const primitive_ref& ref : refs) {
+        bin& s = slabs[centroid_bin(ref, centroid_bounds, axis)];
+        s.bounds = aabb(s.bounds, ref.bounds);
+        s.count++;
+      }
+
+      std::array<aabb, max_bins> right_bounds;
+      std::array<int, max_bins> right_counts;
+      aabb right = aabb::empty;
+      int right_count = 0;
+      for (int b = n - 1; b > 0; b--) {
+        right = aabb(right, slabs[b].bounds);
+        right_count += slabs[b].count;
+        right_bounds[b - 1] = right;
+        right_counts[b - 1] = right_count;
+      }
+
+      aabb left = aabb::empty;
+      int left_count = 0;
+      for (int b = 0; b < n - 1; b++) {
+        left = aabb(left, slabs[b].bounds);
+        left_count += slabs[b].count;
+        if (left_count == 0 || left_count == count) continue;
+        float area_cost = left_count * half_area(left) + right_counts[b] * half_area(right_bounds[b]);
+        float cost = traversal_cost + intersection_cost * area_cost * inv_area;
+        if (cost < best.cost) best = {axis, b, cost, left, right_bounds[b]};
+      }
+    }
+    return best;
+  }
+
+  real plane_of(const aabb& bounds, int axis, int b) const {
+    const interval& extent = bounds.axis_interval(axis);
+    return extent.min + extent.size() * real(b) / real(bins());
+  }
+
+  int spatial_bin(const aabb& bounds, int axis, real x) const {
+    const interval& extent = bounds.axis_interval(axis);
+    int b = int(bins() * ((x - extent.min) / extent.size()));
+    return std::clamp(b, 0, bins() - 1);
+  }
+
+  spatial_split find_spatial_split(const build_state& state, const std::vector<primitive_ref>& refs,
+                                   const aabb& bounds) const {
+    int n = bins();
+    float inv_area = 1.0f / std::max(half_area(bounds), std::numeric_limits<float>::min());
+    int count = int(refs.size());
+    spatial_split best;
+    for (int axis = 0; axis < 3; axis++) {
+      if (bounds.axis_interval(axis).size() <= 0) continue;
+      std::array<bin, max_bins> slabs;
+      for (const primitive_ref& ref : refs) {
+        const PrimitiveGPU& prim = state.primitives[ref.index];
+        int first = spatial_bin(bounds, axis, ref.bounds.axis_interval(axis).min);
+        int last = spatial_bin(bounds, axis, ref.bounds.axis_interval(axis).max);
+        if (first == last || !splittable(prim)) {
+          // Whole in one bin; an unsplittable straddler is binned by its centroid and grows that bin
+          int b = first == last ? first : spatial_bin(bounds, axis, ref.centroid[axis]);
+          slabs[b].bounds = aabb(slabs[b].bounds, ref.bounds);
+          slabs[b].count++;
+          slabs[b].exits++;
+          continue;
+        }
+        for (int b = first; b <= last; b++) {
+          real lo = b == first ? ref.bounds.axis_interval(axis).min : plane_of(bounds, axis, b);
+          real hi = b == last ? ref.bounds.axis_interval(axis).max : plane_of(bounds, axis, b + 1);
+          aabb part = clip(ref, prim, axis, lo, hi);
+          if (!is_empty(part)) slabs[b].bounds = aabb(slabs[b].bounds, part);
+        }
+        slabs[first].count++;
+        slabs[last].exits++;
+      }
+
+      std::array<aabb, max_bins> right_bounds;
+      std::array<int, max_bins> right_counts;
+      aabb right = aabb::empty;
+      int right_count = 0;
+      for (int b = n - 1; b > 0; b--) {
+        right = aabb(right, slabs[b].bounds);
+        right_count += slabs[b].exits;
+        right_bounds[b - 1] = right;
+        right_counts[b - 1] = right_count;
+      }
+
+      aabb left = aabb::empty;
+      int left_count = 0;
+      for (int b = 0; b < n - 1; b++) {
+        left = aabb(left, slabs[b].bounds);
+        left_count += slabs[b].count;
+        // Both sides must shrink, or the split would never terminate
+        if (left_count == 0 || right_counts[b] == 0 || left_count == count || right_counts[b] == count) continue;
+        int duplicates = left_count + right_counts[b] - count;
+        if (duplicates > state.references_left) continue;
+        float area_cost = left_count * half_area(left) + right_counts[b] * half_area(right_bounds[b]);
+        float cost = traversal_cost + intersection_cost * area_cost * inv_area;
+        if (cost < best.cost) best = {axis, plane_of(bounds, axis, b + 1), cost, duplicates};
+      }
+    }
+    return best;
+  }
+
+  // Splits 'refs' at 'split.plane', clipping straddlers into both sides or keeping them whole on the cheaper one
+  void partition_spatial(build_state& state, std::vector<primitive_ref>& refs, const spatial_split& split,
+                         std::vector<primitive_ref>& left, std::vector<primitive_ref>& right) const {
+    int axis = split.axis;
+    std::vector<primitive_ref> straddling;
+    aabb left_bounds = aabb::empty, right_bounds = aabb::empty;
+    for (const primitive_ref& ref : refs) {
+      const interval& extent = ref.bounds.axis_interval(axis);
+      if (extent.max <= split.plane) {
+        left.push_back(ref);
+        left_bounds = aabb(left_bounds, ref.bounds);
+      } else if (extent.min >= split.plane) {
+        right.push_back(ref);
+        right_bounds = aabb(right_bounds, ref.bounds);
+      } else {
+        straddling.push_back(ref);
+      }
+    }
+
+    for (const primitive_ref& ref : straddling) {
+      const PrimitiveGPU& prim = state.primitives[ref.index];
+      const interval& extent = ref.bounds.axis_interval(axis);
+      aabb left_part = clip(ref, prim, axis, extent.min, split.plane);
+      aabb right_part = clip(ref, prim, axis, split.plane, extent.max);
+      float nl = float(left.size()), nr = float(right.size());
+
+      // Whole on the left, whole on the right, or split into both
+      aabb grown_left(left_bounds, ref.bounds), grown_right(right_bounds, ref.bounds);
+      float cost_left = half_area(grown_left) * (nl + 1) + half_area(right_bounds) * nr;
+      float cost_right = half_area(left_bounds) * nl + half_area(grown_right) * (nr + 1);
+      float cost_split = std::numeric_limits<float>::infinity();
+      bool can_split = splittable(prim) && state.references_left > 0;
+      if (can_split && !is_empty(left_part) && !is_empty(right_part)) {
+        cost_split = half_area(aabb(left_bounds, left_part)) * (nl + 1) +
+                     half_area(aabb(right_bounds, right_part)) * (nr + 1);
+      } else if (can_split && is_empty(right_part)) {
+        cost_left = -1.0f; // nothing of it lies right of the plane after all
+      } else if (can_split && is_empty(left_part)) {
+        cost_right = -1.0f;
+      }
+
+      if (cost_split < cost_left && cost_split < cost_right) {
+        left.push_back({left_part, centre(left_part), ref.index});
+        right.push_back({right_part, centre(right_part), ref.index});
+        left_bounds = aabb(left_bounds, left_part);
+        right_bounds = aabb(right_bounds, right_part);
+        state.references_left--;
+      } else if (cost_left <= cost_right) {
+        left.push_back(ref);
+        left_bounds = grown_left;
+      } else {
+        right.push_back(ref);
+        right_bounds = grown_right;
+      }
+    }
+  }
+
+  int build_node(build_state& state, std::vector<primitive_ref> refs, int depth) const {
+    std::vector<LinearBVHNode>& nodes = state.nodes;
+    int node_index = int(nodes.size());
+    nodes.emplace_back();
+
+    aabb bounds = aabb::empty, centroid_bounds = aabb::empty;
+    for (const primitive_ref& ref : refs) {
+      bounds = aabb(bounds, ref.bounds);
+      centroid_bounds = aabb(centroid_bounds, aabb(ref.centroid, ref.centroid));
+    }
+    set_node_bounds(nodes[node_index], bounds);
+
+    int count = int(refs.size());
+    object_split object;
+    spatial_split spatial;
+    if (count > 1 && depth < sah_depth_limit) {
+      object = find_object_split(refs, bounds, centroid_bounds);
+      aabb overlap = intersect(object.left, object.right);
+      bool overlapping = object.axis < 0 || (!is_empty(overlap) && half_area(overlap) > state.min_overlap);
+      if (overlapping && state.references_left > 0) spatial = find_spatial_split(state, refs, bounds);
+    }
+    float best_cost = std::min(object.cost, spatial.cost);
+
+    int leaf_limit = std::clamp(max_leaf_size, 1, max_leaf_primitives);
+    if (count == 1 || (count <= leaf_limit && intersection_cost * count <= best_cost)) {
+      nodes[node_index].n_primitives = uint16_t(count);
+      nodes[node_index].primitive_offset = int(state.ordered.size());
+      for (const primitive_ref& ref : refs) state.ordered.push_back(state.primitives[ref.index]);
+      return node_index;
+    }
+
+    std::vector<primitive_ref> left, right;
+    int axis = spatial.axis;
+    bool spatial_used = false;
+    if (spatial.cost < object.cost) {
+      int budget = state.references_left;
+      partition_spatial(state, refs, spatial, left, right);
+      // Unsplitting can leave a side empty or as large as the node, which would never terminate
+      spatial_used = !left.empty() && !right.empty() && int(left.size()) < count && int(right.size()) < count;
+      if (!spatial_used) state.references_left = budget;
+    }
+    if (!spatial_used) {
+      left.clear();
+      right.clear();
+      axis = object.axis;
+      if (axis >= 0) {
+        for (const primitive_ref& ref : refs) {
+          (centroid_bin(ref, centroid_bounds, axis) <= object.bin ? left : right).push_back(ref);
+        }
+      } else {
+        // Too deep, or every centroid in one spot: halve by count, ties broken by primitive index
+        axis = centroid_bounds.longest_axis();
+        int mid = count / 2;
+        std::nth_element(refs.begin(), refs.begin() + mid, refs.end(),
+                         [axis](const primitive_ref& a, const primitive_ref& b) {
+                           if (a.centroid[axis] != b.centroid[axis]) return a.centroid[axis] < b.centroid[axis];
+                           return a.index < b.index;
+                         });
+        left.assign(refs.begin(), refs.begin() + mid);
+        right.assign(refs.begin() + mid, refs.end());
+      }
+    }
+    refs.clear();
+    refs.shrink_to_fit();
+
+    build_node(state, std::move(left), depth + 1);
+    int right_index = build_node(state, std::move(right), depth + 1);
+    nodes[node_index].n_primitives = 0;
+    nodes[node_index].second_child_offset = right_index;
+    nodes[node_index].axis = uint8_t(axis);
+    return node_index;
+  }
+};
+
+#endif // !SBVH_BUILDER_HPP
@@ -3,40 +3,57 @@
 
 #include "hittable.hpp"
 
+#include <limits>
+
 class sphere : public hittable {
 public:
   sphere(const point3& static_center, double radius, std::shared_ptr<material> mat)
-      : center{static_center, vec3{0, 0, 0}}, radius{std::fmax(0, radius)}, mat{mat} {
+      : center{static_center, vec3{0, 0, 0}}, radius{real(std::fmax(0, radius))}, mat{mat} {
     auto rvec = vec3(radius, radius, radius);
     bbox = aabb(static_center - rvec, static_center + rvec);
   }
 
   sphere(const point3& center1, const point3& center2, double radius, std::shared_ptr<material> mat)
-      : center{center1, center2 - center1}, radius{std::fmax(0, radius)}, mat{mat} {
+      : center{center1, center2 - center1}, radius{real(std::fmax(0, radius))}, mat{mat} {
     auto rvec = vec3(radius, radius, radius);
     aabb box1(center.at(0) - rvec, center.at(0) + rvec);
     aabb box2(center.at(1) - rvec, center.at(1) + rvec);
     bbox = aabb(box1, box2);
   }
 
-  bool hit(const ray& r, interval ray_t, hit_record& rec) const override {
+  bool hit(const ray& r, interval ray_t, hit_record& rec, sampler& /*smp*/) const override {
     point3 current_center = center.at(r.time());
     vec3 oc = current_center - r.origin();
     auto a = r.direction().length_squared();
     auto h = dot(r.direction(), oc);
-    auto c = oc.length_squared() - radius * radius;
 
-    auto discriminant = (h * h) - (a * c);
+    // h*h - a*c and |oc|^2 - r^2 cancel catastrophically in float for large
+    // spheres (the radius 1000 ground), so both are formed from distances
+    // instead of squared distances, and the root nearer the origin comes from
+    // c/q rather than a difference of nearly equal terms (Ray Tracing Gems,
+    // ch. 7).
+    auto l = (oc - (h / a) * r.direction()).length();
+    auto discriminant = a * (radius - l) * (radius + l);
     if (discriminant < 0) {
       return false;
     }
 
-    auto sqrtd = std::sqrt(discriminant);
+    // An origin within rounding distance of the surface is taken to lie on it,
+    // so one root is exactly t = 0 and a scattered ray cannot hit its own
+    // origin again; t_min alone stops guaranteeing that once the rounding
+    // error, which grows with the radius, exceeds it.
+    auto oc_len = oc.length();
+    auto c = (oc_len - radius) * (oc_len + radius);
+    if (std::fabs(oc_len - radius) <= surface_tolerance) c = 0;
+    auto q = h + std::copysign(std::sqrt(discriminant), h);
+    auto near_root = c / q;
+    auto far_root = q / a;
+    if (far_root < near_root) std::swap(near_root, far_root);
 
     // Find the nearest root that lies in the acceptable range
-    auto root = (h - sqrtd) / a;
+    auto root = near_root;
     if (!ray_t.surrounds(root)) {
-      root = (h + sqrtd) / a;
+      root = far_root;
       if (!ray_t.surrounds(root)) {
         return false;
       }
@@ -47,7 +64,7 @@ public:
     vec3 outward_normal = (rec.p - current_center) / radius;
     rec.set_face_normal(r, outward_normal);
     get_sphere_uv(outward_normal, rec.u, rec.v);
-    rec.mat = mat;
+    rec.mat = mat.get();
 
     return true;
   }
@@ -56,17 +73,18 @@ public:
 
   ray get_center() const { return center; }
 
-  double get_radius() const { return radius; }
+  real get_radius() const { return radius; }
 
   std::shared_ptr<material> get_material() const { return mat; }
 
 private:
   ray center;
-  double radius;
+  real radius;
+  real surface_tolerance = 4 * std::numeric_limits<real>::epsilon() * radius;
   std::shared_ptr<material> mat;
   aabb bbox;
 
-  static void get_sphere_uv(const point3& p, double& u, double& v) {
+  static void get_sphere_uv(const point3& p, real& u, real& v) {
     // p: a given point on the sphere of radius one, centered at the origin.
     // u: returned value [0,1] of angle around the Y axis from X=-1.
     // v: returned value [0,1] of angle from Y=-1 to Y=+1.
@@ -0,0 +1,154 @@
+#ifndef THREAD_POOL_HPP
+#define THREAD_POOL_HPP
+
+#include <algorithm>
+#include <chrono>
+#include <condition_variable>
+#include <deque>
+#include <exception>
+#include <functional>
+#include <future>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <type_traits>
+#include <vector>
+
+// Fixed set of worker threads that live for the whole process, so renders,
+// scene builds and exports queue tasks instead of creating and joining threads
+// every time. Tasks may submit and wait on further tasks: a waiting thread runs
+// queued work until its result is ready, so nesting never starves the pool,
+// even with a single worker.
+class thread_pool {
+public:
+  // 'num_workers' <= 0 means one worker per hardware thread
+  explicit thread_pool(int num_workers = 0) { start(num_workers); }
+
+  ~thread_pool() { stop(); }
+
+  thread_pool(const thread_pool&) = delete;
+  thread_pool& operator=(const thread_pool&) = delete;
+
+  // The pool shared by the renderer, scene building and image export
+  static thread_pool& global() {
+    static thread_pool pool;
+    return pool;
+  }
+
+  int size() const { return int(workers.size()); }
+
+  // Finishes the queued tasks, then replaces the workers. Must not be called
+  // from a task running on this pool.
+  void resize(int num_workers) {
+    stop();
+    start(num_workers);
+  }
+
+  template <class F> auto submit(F&& fn) -> std::future<std::invoke_result_t<std::decay_t<F>>> {
+    using R = std::invoke_result_t<std::decay_t<F>>;
+    auto task = std::make_shared<std::packaged_task<R()>>(std::forward<F>(fn));
+    std::future<R> result = task->get_future();
+    {
+      std::lock_guard<std::mutex> lock(mutex);
+      tasks.emplace_back([task] { (*task)(); });
+    }
+    wake.notify_one();
+    return result;
+  }
+
+  // Blocks until 'result' is ready, running queued tasks in the meantime.
+  // Rethrows an exception thrown by the task.
+  template <class R> R wait(std::future<R>& result) {
+    while (result.wait_for(std::chrono::seconds(0)) != std::future_status::ready) {
+      // With nothing left to run, the task is already on another thread
+      if (!run_one()) result.wait();
+    }
+    return result.get();
+  }
+
+  // Blocks until all of 'results' are ready, then rethrows the first exception
+  // any of them threw. Stopping at that one would return while the rest still
+  // run, and they may reference the caller's stack, as parallel_for's do.
+  template <class R> void wait(std::vector<std::future<R>>& results) {
+    std::exception_ptr error;
+    for (auto& result : results) {
+      try {
+        wait(result);
+      } catch (...) {
+        if (!error) error = std::current_exception();
+      }
+    }
+    if (error) std::rethrow_exception(error);
+  }
+
+  // Calls fn(i) for every i in [begin, end), in chunks of 'grain' indices, and
+  // returns once all of them have run.
+  template <class F> void parallel_for(int begin, int end, int grain, F&& fn) {
+    grain = std::max(1, grain);
+    std::vector<std::future<void>> chunks;
+    for (int chunk = begin; chunk < end; chunk += grain) {
+      int chunk_end = std::min(end, chunk + grain);
+      chunks.push_back(submit([&fn, chunk, chunk_end] {
+        for (int i = chunk; i < chunk_end; i++) fn(i);
+      }));
+    }
+    wait(chunks);
+  }
+
+private:
+  std::vector<std::thread> workers;
+  std::deque<std::function<void()>> tasks;
+  std::mutex mutex;
+  std::condition_variable wake;
+  bool stopping = false;
+
+  void start(int num_workers) {
+    if (num_workers <= 0) num_workers = int(std::thread::hardware_concurrency());
+    num_workers = std::max(1, num_workers);
+    stopping = false;
+    workers.reserve(num_workers);
+    for (int i = 0; i < num_workers; i++) {
+      workers.emplace_back([this] { worker_loop(); });
+    }
+  }
+
+  void stop() {
+    {
+      std::lock_guard<std::mutex> lock(mutex);
+      stopping = true;
+    }
+    wake.notify_all();
+    for (auto& worker : workers) {
+      if (worker.joinable()) worker.join();
+    }
+    workers.clear();
+  }
+
+  void worker_loop() {
+    while (true) {
+      std::function<void()> task;
+      {
+        std::unique_lock<std::mutex> lock(mutex);
+        wake.wait(lock, [this] { return stopping || !tasks.empty(); });
+        if (tasks.empty()) return; // stopping, and the queue has drained
+        task = std::move(tasks.front());
+        tasks.pop_front();
+      }
+      task();
+    }
+  }
+
+  bool run_one() {
+    std::function<void()> task;
+    {
+      std::lock_guard<std::mutex> lock(mutex);
+      if (tasks.empty()) return false;
+      task = std::move(tasks.front());
+      tasks.pop_front();
+    }
+    task();
+    return true;
+  }
+};
+
+#endif // !THREAD_POOL_HPP
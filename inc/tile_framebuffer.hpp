@@ -0,0 +1,130 @@
+#ifndef TILE_FRAMEBUFFER_HPP
+#define TILE_FRAMEBUFFER_HPP
+
+#include "tile_scheduler.hpp"
+
+#include <algorithm>
+#include <atomic>
+#include <cstdint>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+// Display image of the CPU renderer, laid out tile by tile on the same grid
+// tile_scheduler deals out. Only the worker currently rendering a tile writes
+// it, and every tile starts on its own cache line, so workers never share
+// lines. Each tile is guarded by a sequence number (a seqlock): the writer
+// makes it odd while copying pixels in and even again when done, and a reader
+// retries a tile whose number was odd or changed under it. Writers never wait
+// for readers, and readers never see half-written tiles.
+class tile_framebuffer {
+public:
+  // Lays the image out for 'tile_size' tiles. Keeps the pixels when nothing
+  // changed; otherwise the image starts black. Must not run while tiles are
+  // being published.
+  void resize(int image_width, int image_height, int tile_size) {
+    tile_size = std::max(1, tile_size);
+    std::lock_guard<std::mutex> lock(layout_mutex);
+    if (image_width == width && image_height == height && tile_size == tile) return;
+
+    width = image_width;
+    height = image_height;
+    tile = tile_size;
+    tiles_x = (width + tile - 1) / tile;
+    tiles_y = (height + tile - 1) / tile;
+    int count = tiles_x * tiles_y;
+
+    slots = std::make_unique<tile_slot[]>(count);
+    block_offset.resize(count);
+    size_t blocks = 0;
+    for (int t = 0; t < count; t++) {
+      block_offset[t] = blocks;
+      image_tile r = tile_rect(t);
+      blocks += (size_t((r.x1 - r.x0) * (r.y1 - r.y0)) + pixels_per_block - 1) / pixels_per_block;
+    }
+    pixels = std::make_unique<pixel_block[]>(blocks);
+  }
+
+  int tile_count() const { return tiles_x * tiles_y; }
+
+  image_tile tile_rect(int index) const {
+    int tx = index % tiles_x;
+    int ty = index / tiles_x;
+    return {tx * tile, ty * tile, std::min((tx + 1) * tile, width), std::min((ty + 1) * tile, height)};
+  }
+
+  // Copies the first 'rows' rows of 'rect' from 'rgb' (3 bytes per pixel, rows
+  // of the tile's width). Only the worker rendering the tile may call this.
+  void publish(const image_tile& rect, const unsigned char* rgb, int rows) {
+    int index = (rect.y0 / tile) * tiles_x + rect.x0 / tile;
+    int tile_w = rect.x1 - rect.x0;
+    std::atomic<uint32_t>& sequence = slots[index].sequence;
+    std::atomic<uint32_t>* dst = tile_pixels(index);
+
+    uint32_t s = sequence.load(std::memory_order_relaxed);
+    sequence.store(s + 1, std::memory_order_relaxed);
+    std::atomic_thread_fence(std::memory_order_release);
+    for (int p = 0; p < rows * tile_w; p++) {
+      const unsigned char* c = rgb + p * 3;
+      dst[p].store(uint32_t(c[0]) | uint32_t(c[1]) << 8 | uint32_t(c[2]) << 16, std::memory_order_relaxed);
+    }
+    sequence.store(s + 2, std::memory_order_release);
+  }
+
+  // Copies the whole image into 'rgb' (3 bytes per pixel, row-major), each
+  // tile as it stood after one complete publish.
+  void snapshot(std::vector<unsigned char>& rgb) const {
+    std::lock_guard<std::mutex> lock(layout_mutex);
+    rgb.resize(size_t(width) * height * 3);
+    std::vector<uint32_t> staged(size_t(tile) * tile);
+
+    for (int t = 0; t < tile_count(); t++) {
+      image_tile r = tile_rect(t);
+      int n = (r.x1 - r.x0) * (r.y1 - r.y0);
+      const std::atomic<uint32_t>& sequence = slots[t].sequence;
+      const std::atomic<uint32_t>* src = tile_pixels(t);
+
+      while (true) {
+        uint32_t before = sequence.load(std::memory_order_acquire);
+        if (before & 1) {
+          std::this_thread::yield(); // the owner is mid-copy
+          continue;
+        }
+        for (int p = 0; p < n; p++) staged[p] = src[p].load(std::memory_order_relaxed);
+        std::atomic_thread_fence(std::memory_order_acquire);
+        if (sequence.load(std::memory_order_relaxed) == before) break;
+      }
+
+      int tile_w = r.x1 - r.x0;
+      for (int p = 0; p < n; p++) {
+        size_t idx = (size_t(r.y0 + p / tile_w) * width + r.x0 + p % tile_w) * 3;
+        rgb[idx + 0] = static_cast<unsigned char>(staged[p]);
+        rgb[idx + 1] = static_cast<unsigned char>(staged[p] >> 8);
+        rgb[idx + 2] = static_cast<unsigned char>(staged[p] >> 16);
+      }
+    }
+  }
+
+private:
+  static constexpr int pixels_per_block = 16; // 16 packed RGB8 pixels per 64-byte line
+
+  struct alignas(64) tile_slot {
+    std::atomic<uint32_t> sequence{0};
+  };
+
+  struct alignas(64) pixel_block {
+    std::atomic<uint32_t> pixels[pixels_per_block] = {};
+  };
+
+  int width = 0, height = 0, tile = 1;
+  int tiles_x = 0, tiles_y = 0;
+  std::unique_ptr<tile_slot[]> slots;
+  std::unique_ptr<pixel_block[]> pixels; // each tile starts on its own block
+  std::vector<size_t> block_offset;
+  mutable std::mutex layout_mutex; // resize vs snapshot only; publish never takes it
+
+  std::atomic<uint32_t>* tile_pixels(int index) const { return pixels[block_offset[index]].pixels; }
+};
+
+#endif // !TILE_FRAMEBUFFER_HPP
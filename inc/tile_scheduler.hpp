@@ -0,0 +1,139 @@
+#ifndef TILE_SCHEDULER_HPP
+#define TILE_SCHEDULER_HPP
+
+#include <algorithm>
+#include <cstdint>
+#include <deque>
+#include <memory>
+#include <mutex>
+#include <vector>
+
+// Order in which image tiles are laid out before being dealt to the workers.
+// Space-filling curves keep consecutive tiles (and the BVH nodes they touch)
+// close together, so each worker walks a cache-warm region of the image.
+enum class TileOrder { SCANLINE, MORTON, HILBERT };
+
+struct image_tile {
+  int x0, y0; // inclusive upper-left pixel
+  int x1, y1; // exclusive lower-right pixel
+};
+
+class tile_scheduler {
+public:
+  tile_scheduler(int image_width, int image_height, int tile_size,
+                 TileOrder order, int num_workers) {
+    tile_size = std::max(1, tile_size);
+    num_workers = std::max(1, num_workers);
+
+    int tiles_x = (image_width + tile_size - 1) / tile_size;
+    int tiles_y = (image_height + tile_size - 1) / tile_size;
+
+    std::vector<std::pair<uint64_t, image_tile>> keyed;
+    keyed.reserve(tiles_x * tiles_y);
+    int grid = 1;
+    while (grid < tiles_x || grid < tiles_y) grid <<= 1;
+
+    for (int ty = 0; ty < tiles_y; ++ty) {
+      for (int tx = 0; tx < tiles_x; ++tx) {
+        image_tile t{tx * tile_size, ty * tile_size,
+                     std::min((tx + 1) * tile_size, image_width),
+                     std::min((ty + 1) * tile_size, image_height)};
+        uint64_t key = uint64_t(ty) * tiles_x + tx;
+        if (order == TileOrder::MORTON) key = morton_key(tx, ty);
+        else if (order == TileOrder::HILBERT) key = hilbert_key(grid, tx, ty);
+        keyed.emplace_back(key, t);
+      }
+    }
+    std::sort(keyed.begin(), keyed.end(), [](const auto& a, const auto& b) {
+      return a.first < b.first;
+    });
+
+    tiles.reserve(keyed.size());
+    for (const auto& k : keyed) tiles.push_back(k.second);
+
+    // Deal contiguous runs of the curve to each worker so that, until stealing
+    // kicks in, every worker stays inside its own compact patch of the image.
+    queues.resize(num_workers);
+    for (int w = 0; w < num_workers; ++w) {
+      queues[w] = std::make_unique<worker_queue>();
+      size_t begin = tiles.size() * w / num_workers;
+      size_t end = tiles.size() * (w + 1) / num_workers;
+      for (size_t i = begin; i < end; ++i) queues[w]->tiles.push_back(int(i));
+    }
+  }
+
+  // Fetch the next tile for 'worker'. Own work is taken from the front of the
+  // worker's deque; when it runs dry, work is stolen from the back of another
+  // worker's deque (the far end of that worker's patch).
+  bool next_tile(int worker, image_tile& out) {
+    int n = int(queues.size());
+    worker %= n;
+    {
+      worker_queue& own = *queues[worker];
+      std::lock_guard<std::mutex> lock(own.mutex);
+      if (!own.tiles.empty()) {
+        out = tiles[own.tiles.front()];
+        own.tiles.pop_front();
+        return true;
+      }
+    }
+    for (int k = 1; k < n; ++k) {
+      worker_queue& victim = *queues[(worker + k) % n];
+      std::lock_guard<std::mutex> lock(victim.mutex);
+      if (!victim.tiles.empty()) {
+        out = tiles[victim.tiles.back()];
+        victim.tiles.pop_back();
+        return true;
+      }
+    }
+    return false;
+  }
+
+  int tile_count() const { return int(tiles.size()); }
+
+private:
+  // Padded to a cache line so that owners popping their own deques never
+  // invalidate each other's lines.
+  struct alignas(64) worker_queue {
+    std::mutex mutex;
+    std::deque<int> tiles;
+  };
+
+  std::vector<image_tile> tiles;
+  std::vector<std::unique_ptr<worker_queue>> queues;
+
+  static uint64_t spread_bits(uint32_t v) {
+    uint64_t x = v;
+    x = (x | (x << 16)) & 0x0000FFFF0000FFFFull;
+    x = (x | (x << 8)) & 0x00FF00FF00FF00FFull;
+    x = (x | (x << 4)) & 0x0F0F0F0F0F0F0F0Full;
+    x = (x | (x << 2)) & 0x3333333333333333ull;
+    x = (x | (x << 1)) & 0x5555555555555555ull;
+    return x;
+  }
+
+  static uint64_t morton_key(int x, int y) {
+    return spread_bits(uint32_t(x)) | (spread_bits(uint32_t(y)) << 1);
+  }
+
+  static uint64_t hilbert_key(int n, int x, int y) {
+    // Distance of (x, y) along the Hilbert curve filling an n x n grid (n is a
+    // power of two).
+    uint64_t d = 0;
+    for (int s = n / 2; s > 0; s /= 2) {
+      int rx = (x & s) > 0;
+      int ry = (y & s) > 0;
+      d += uint64_t(s) * uint64_t(s) * ((3 * rx) ^ ry);
+      if (ry == 0) {
+        if (rx == 1) {
+          x = n - 1 - x;
+          y = n - 1 - y;
+        }
+        std::swap(x, y);
+      }
+    }
+    return d;
+  }
+};
+
+#endif // !TILE_SCHEDULER_HPP
@@ -3,130 +3,183 @@
 
 #include <cmath>
 #include <iostream>
+#include <type_traits>
 
 #include "rt.hpp"
 
-class vec3 {
+// Three-component vector templated on its scalar type. The renderer uses the
+// vec3 alias, which follows 'real'; the other instantiation stays available
+// for code that needs a specific precision regardless of the build.
+template <class T> class basic_vec3 {
 public:
-  double e[3];
-  vec3() : e{0, 0, 0} {}
-  vec3(double e0, double e1, double e2) : e{e0, e1, e2} {}
+  using scalar = T;
 
-  double x() const { return e[0]; }
-  double y() const { return e[1]; }
-  double z() const { return e[2]; }
+  T e[3];
+  basic_vec3() : e{0, 0, 0} {}
+  basic_vec3(T e0, T e1, T e2) : e{e0, e1, e2} {}
 
-  vec3 operator-() const { return vec3(-e[0], -e[1], -e[2]); }
-  double operator[](int i) const { return e[i]; }
-  double& operator[](int i) { return e[i]; }
+  template <class U>
+  explicit basic_vec3(const basic_vec3<U>& v)
+      : e{T(v.e[0]), T(v.e[1]), T(v.e[2])} {}
 
-  vec3& operator+=(const vec3& v) {
+  T x() const { return e[0]; }
+  T y() const { return e[1]; }
+  T z() const { return e[2]; }
+
+  basic_vec3 operator-() const { return basic_vec3(-e[0], -e[1], -e[2]); }
+  T operator[](int i) const { return e[i]; }
+  T& operator[](int i) { return e[i]; }
+
+  basic_vec3& operator+=(const basic_vec3& v) {
     e[0] += v.e[0];
     e[1] += v.e[1];
     e[2] += v.e[2];
     return *this;
   }
 
-  vec3& operator*=(double t) {
+  basic_vec3& operator*=(T t) {
     e[0] *= t;
     e[1] *= t;
     e[2] *= t;
     return *this;
   }
 
-  vec3& operator/=(double t) { return *this *= 1 / t; }
+  basic_vec3& operator/=(T t) { return *this *= 1 / t; }
 
-  double length() const { return std::sqrt(length_squared()); }
-  double length_squared() const {
+  T length() const { return std::sqrt(length_squared()); }
+  T length_squared() const {
     return e[0] * e[0] + e[1] * e[1] + e[2] * e[2];
   }
 
-  static vec3 random() {
-    return vec3(random_double(), random_double(), random_double());
+  static basic_vec3 random() {
+    return basic_vec3(random_double(), random_double(), random_double());
+  }
+
+  static basic_vec3 random(double min, double max) {
+    return basic_vec3(random_double(min, max), random_double(min, max),
+                      random_double(min, max));
   }
 
-  static vec3 random(double min, double max) {
-    return vec3(random_double(min, max), random_double(min, max),
-                random_double(min, max));
+  static basic_vec3 random(sampler& smp, double min, double max) {
+    return basic_vec3(smp.next_double(min, max), smp.next_double(min, max),
+                      smp.next_double(min, max));
   }
 
   bool near_zero() const {
     // Return true if vector is close to zero in all dimensions
-    auto s = 1e-8;
+    auto s = T(1e-8);
     return (std::fabs(e[0]) < s && std::fabs(e[1]) < s && std::fabs(e[2]) < s);
   }
 };
 
+using vec3 = basic_vec3<real>;
+
 // point3 is just an alias for vec3, but useful for geometric clarity
 using point3 = vec3;
 
-// Vector Utiliy Functions
-inline std::ostream& operator<<(std::ostream& out, const vec3& v) {
+// Vector Utiliy Functions. Scalar operands are taken as the vector's own
+// scalar type (std::type_identity_t keeps them out of deduction), so mixed
+// expressions like 2.0 * v compile for either precision.
+template <class T>
+inline std::ostream& operator<<(std::ostream& out, const basic_vec3<T>& v) {
   return out << v.e[0] << ' ' << v.e[1] << ' ' << v.e[2];
 }
 
-inline vec3 operator+(const vec3& u, const vec3& v) {
-  return vec3(u.e[0] + v.e[0], u.e[1] + v.e[1], u.e[2] + v.e[2]);
+template <class T>
+inline basic_vec3<T> operator+(const basic_vec3<T>& u, const basic_vec3<T>& v) {
+  return basic_vec3<T>(u.e[0] + v.e[0], u.e[1] + v.e[1], u.e[2] + v.e[2]);
 }
 
-inline vec3 operator+(const vec3& v, double t) {
-  return vec3(v.e[0] + t, v.e[1] + t, v.e[2] + t);
+template <class T>
+inline basic_vec3<T> operator+(const basic_vec3<T>& v,
+                               std::type_identity_t<T> t) {
+  return basic_vec3<T>(v.e[0] + t, v.e[1] + t, v.e[2] + t);
+}
+template <class T>
+inline basic_vec3<T> operator+(std::type_identity_t<T> t,
+                               const basic_vec3<T>& v) {
+  return v + t;
 }
-inline vec3 operator+(double t, const vec3& v) { return v + t; }
 
-inline vec3 operator-(const vec3& u, const vec3& v) {
-  return vec3(u.e[0] - v.e[0], u.e[1] - v.e[1], u.e[2] - v.e[2]);
+template <class T>
+inline basic_vec3<T> operator-(const basic_vec3<T>& u, const basic_vec3<T>& v) {
+  return basic_vec3<T>(u.e[0] - v.e[0], u.e[1] - v.e[1], u.e[2] - v.e[2]);
 }
 
-inline vec3 operator-(const vec3& v, double t) {
-  return vec3(v.e[0] - t, v.e[1] - t, v.e[2] - t);
+template <class T>
+inline basic_vec3<T> operator-(const basic_vec3<T>& v,
+                               std::type_identity_t<T> t) {
+  return basic_vec3<T>(v.e[0] - t, v.e[1] - t, v.e[2] - t);
 }
 
-inline vec3 operator*(const vec3& u, const vec3& v) {
-  return vec3(u.e[0] * v.e[0], u.e[1] * v.e[1], u.e[2] * v.e[2]);
+template <class T>
+inline basic_vec3<T> operator*(const basic_vec3<T>& u, const basic_vec3<T>& v) {
+  return basic_vec3<T>(u.e[0] * v.e[0], u.e[1] * v.e[1], u.e[2] * v.e[2]);
 }
 
-inline vec3 operator*(const vec3& v, double t) {
-  return vec3(t * v.e[0], t * v.e[1], t * v.e[2]);
+template <class T>
+inline basic_vec3<T> operator*(const basic_vec3<T>& v,
+                               std::type_identity_t<T> t) {
+  return basic_vec3<T>(t * v.e[0], t * v.e[1], t * v.e[2]);
 }
 
-inline vec3 operator*(double t, const vec3& v) { return v * t; }
+template <class T>
+inline basic_vec3<T> operator*(std::type_identity_t<T> t,
+                               const basic_vec3<T>& v) {
+  return v * t;
+}
 
-inline vec3 operator/(const vec3& v, double t) { return (1 / t) * v; }
+template <class T>
+inline basic_vec3<T> operator/(const basic_vec3<T>& v,
+                               std::type_identity_t<T> t) {
+  return (1 / t) * v;
+}
 
-inline double dot(const vec3& u, const vec3& v) {
+template <class T>
+inline T dot(const basic_vec3<T>& u, const basic_vec3<T>& v) {
   return u.e[0] * v.e[0] + u.e[1] * v.e[1] + u.e[2] * v.e[2];
 }
 
-inline vec3 cross(const vec3& u, const vec3& v) {
-  return vec3(u.e[1] * v.e[2] - u.e[2] * v.e[1],
-              u.e[2] * v.e[0] - u.e[0] * v.e[2],
-              u.e[0] * v.e[1] - u.e[1] * v.e[0]);
+template <class T>
+inline basic_vec3<T> cross(const basic_vec3<T>& u, const basic_vec3<T>& v) {
+  return basic_vec3<T>(u.e[1] * v.e[2] - u.e[2] * v.e[1],
+                       u.e[2] * v.e[0] - u.e[0] * v.e[2],
+                       u.e[0] * v.e[1] - u.e[1] * v.e[0]);
 }
 
-inline vec3 unit_vector(const vec3& v) { return v / v.length(); }
+template <class T> inline basic_vec3<T> unit_vector(const basic_vec3<T>& v) {
+  return v / v.length();
+}
 
-inline vec3 random_in_unit_sphere() {
+inline vec3 random_in_unit_sphere(sampler& smp) {
   while (true) {
-    auto p = vec3::random(-1, 1);
+    auto p = vec3::random(smp, -1, 1);
     if (p.length_squared() < 1) {
       return p;
     }
   }
 }
 
-inline vec3 random_in_unit_disk() {
+inline vec3 random_in_unit_sphere() {
+  return random_in_unit_sphere(thread_sampler());
+}
+
+inline vec3 random_in_unit_disk(sampler& smp) {
   while (true) {
-    auto p = vec3(random_double(-1, 1), random_double(-1, 1), 0);
+    auto p = vec3(smp.next_double(-1, 1), smp.next_double(-1, 1), 0);
     if (p.length_squared() < 1) {
       return p;
     }
   }
 }
 
-inline vec3 random_unit_vector() {
+inline vec3 random_in_unit_disk() {
+  return random_in_unit_disk(thread_sampler());
+}
+
+inline vec3 random_unit_vector(sampler& smp) {
   while (true) {
-    auto p = vec3::random(-1, 1);
+    auto p = vec3::random(smp, -1, 1);
     auto lensq = p.length_squared();
     if (1e-160 < lensq && lensq <= 1) {
       return p / sqrt(lensq);
@@ -134,8 +187,12 @@ inline vec3 random_unit_vector() {
   }
 }
 
-inline vec3 random_on_hemisphere(const vec3& normal) {
-  vec3 on_unit_sphere = random_unit_vector();
+inline vec3 random_unit_vector() {
+  return random_unit_vector(thread_sampler());
+}
+
+inline vec3 random_on_hemisphere(const vec3& normal, sampler& smp) {
+  vec3 on_unit_sphere = random_unit_vector(smp);
   if (dot(on_unit_sphere, normal) > 0) { // In the same hemisphere as the normal
     return on_unit_sphere;
   } else {
@@ -143,15 +200,22 @@ inline vec3 random_on_hemisphere(const vec3& normal) {
   }
 }
 
-inline vec3 reflect(const vec3& v, const vec3& n) {
+inline vec3 random_on_hemisphere(const vec3& normal) {
+  return random_on_hemisphere(normal, thread_sampler());
+}
+
+template <class T>
+inline basic_vec3<T> reflect(const basic_vec3<T>& v, const basic_vec3<T>& n) {
   return v - (2 * dot(v, n) * n);
 }
 
-inline vec3 refract(const vec3& uv, const vec3& n, double etai_over_etat) {
-  auto cos_theta = std::fmin(dot(-uv, n), 1.0);
-  vec3 r_out_perp = etai_over_etat * (uv + cos_theta * n);
-  vec3 r_out_parellel =
-      -std::sqrt(std::fabs(1.0 - r_out_perp.length_squared())) * n;
+template <class T>
+inline basic_vec3<T> refract(const basic_vec3<T>& uv, const basic_vec3<T>& n,
+                             std::type_identity_t<T> etai_over_etat) {
+  auto cos_theta = std::fmin(dot(-uv, n), T(1));
+  basic_vec3<T> r_out_perp = etai_over_etat * (uv + cos_theta * n);
+  basic_vec3<T> r_out_parellel =
+      -std::sqrt(std::fabs(1 - r_out_perp.length_squared())) * n;
 
   return r_out_perp + r_out_parellel;
 }
@@ -6,16 +6,25 @@
 #include <GLFW/glfw3.h>
 
 #include <atomic>
+#include <chrono>
+#include <future>
 #include <memory>
-#include <mutex>
 #include <optional>
 #include <string>
-#include <thread>
+#include <unordered_map>
 #include <vector>
 
+#include "bvh_cache.hpp"
+#include "bvh_edit.hpp"
+#include "bvh_metrics.hpp"
+#include "bvh_refit.hpp"
 #include "camera.hpp"
 #include "cuda_structs.hpp"
+#include "flat_bvh.hpp"
+#include "hittable.hpp"
 #include "hittable_list.hpp"
+#include "thread_pool.hpp"
+#include "tile_framebuffer.hpp"
 
 const int kMaxFramesInFlight = 2;
 const std::vector<const char*> kDeviceExtensions = {
@@ -34,15 +43,34 @@ struct SwapchainSupportDetails {
   std::vector<VkPresentModeKHR> present_modes;
 };
 
+// A scene object the animation moves on a circle around the y axis
+struct OrbitingObject {
+  std::shared_ptr<translate> node;
+  float radius;
+  float phase; // angle at animation time 0, in radians
+};
+
 enum class Scenes { STATIC, MOTION, CHECKERED, EARTH, PERLIN, QUAD, LIGHT, CORNELL, SMOKE, FINAL, CUSTOM };
 
 class VulkanApp {
 public:
-  VulkanApp(bool headless = false);
+  // A non-empty 'bvh_cache_dir' caches built BVHs there (bvh_cache.hpp)
+  VulkanApp(bool headless = false, BvhBuildMode bvh_build_mode = BvhBuildMode::SAH,
+            const std::string& bvh_cache_dir = "");
   ~VulkanApp();
 
   void run();
   void run_headless();
+  void run_benchmark(bool all_scenes = false);
+  void run_bvh_report(bool all_scenes = false);
+  int run_bvh_edit_check(); // the number of rays a patched BVH hits differently
+
+  // Incremental scene edits, each patching the flattened BVH instead of
+  // rebuilding it. Handles stay valid until their object is removed or the
+  // scene is switched; world_'s objects get theirs in order, from 0.
+  int add_object(std::shared_ptr<hittable> object);
+  void remove_object(int handle);
+  void update_object(int handle); // after changing it in place, e.g. a translate's offset
 
 private:
   bool headless_;
@@ -97,7 +125,16 @@ private:
   hittable_list world_;
   camera cam_;
   int samples_per_pixel_ = 10;
+  int samples_per_pass_ = 1;
+  bool adaptive_sampling_ = false;
+  float adaptive_threshold_ = 0.02f;
+  int adaptive_min_samples_ = 16;
+  int adaptive_max_samples_ = 1024;
   int max_depth_ = 10;
+  int max_diffuse_depth_ = 0;
+  int max_specular_depth_ = 0;
+  int max_volume_depth_ = 0;
+  int russian_roulette_depth_ = 3;
   float background_color_[3] = {0.70f, 0.80f, 1.00f};
   float camera_pos_[3] = {13, 2, 3};
   float camera_target_[3] = {0, 0, 0};
@@ -105,20 +142,50 @@ private:
   float defocus_angle_ = 0.6f;
   float focus_distance_ = 10.0f;
   int image_width_ = 800;
+  int tile_size_ = 16;
+  TileOrder tile_order_ = TileOrder::HILBERT;
+  CpuPipeline cpu_pipeline_ = CpuPipeline::MEGAKERNEL;
+  bool cpu_use_flat_bvh_ = true;
+  BvhLayout cpu_bvh_layout_ = BvhLayout::WIDE4;
+  bool cpu_treelet_order_ = false;
+  BvhBuildMode bvh_build_mode_ = BvhBuildMode::SAH;
+  int cpu_threads_ = thread_pool::global().size();
   Scenes scene_type_ = Scenes::STATIC;
 
   // GPU Data
   std::vector<LinearBVHNode> gpu_bvh_nodes_;
+  std::vector<int> gpu_escape_links_; // for the stackless traversal
   std::vector<PrimitiveGPU> gpu_primitives_;
   std::vector<MaterialGPU> gpu_materials_;
   std::vector<TextureGPU> gpu_textures_;
   std::vector<PerlinDataGPU> gpu_perlin_;
   std::vector<unsigned char> gpu_image_buffer_;
+  // What animate_scene needs to update the arrays above without a rebuild
+  std::vector<int> gpu_primitive_sources_;
+  std::unordered_map<material*, int> gpu_material_ids_;
+  std::unordered_map<texture*, int> gpu_texture_ids_;
+  bvh_refitter bvh_refitter_;
+  std::optional<bvh_cache> bvh_cache_; // unset: always build
+  bvh_metrics bvh_metrics_; // of the current build, for the BVH Inspector
+
+  // Scene editing: world_'s objects by handle, null once removed, and which
+  // of them each top-level primitive came from (both set up by the first edit)
+  std::vector<std::shared_ptr<hittable>> scene_objects_;
+  bvh_editor bvh_editor_;
+  std::vector<int> added_objects_; // handles of the objects added from the UI, newest last
+
+  // Animation: one turn of the orbiting objects over time [0, 1]
+  std::vector<OrbitingObject> animated_objects_;
+  float animation_time_ = 0.0f;
+
+  // CPU view of the flattened GPU scene above (borrows gpu_bvh_nodes_ and
+  // gpu_primitives_, rebuilt with them in setup_world)
+  std::unique_ptr<flat_bvh> cpu_scene_;
 
   // CPU Render Bridge
-  std::vector<unsigned char> cpu_render_buffer_;
-  std::mutex cpu_buffer_mutex_;
-  std::thread cpu_render_thread_;
+  tile_framebuffer cpu_framebuffer_; // written by the render workers
+  std::vector<unsigned char> cpu_render_buffer_; // the UI thread's snapshot of it
+  std::future<void> cpu_render_task_; // runs on thread_pool::global()
 
   // UI/Render Control
   std::atomic<bool> is_rendering_{false};
@@ -127,10 +194,18 @@ private:
   std::atomic<bool> texture_needs_update_{false};
   bool trigger_render_ = false;
   bool use_gpu_render_ = true;
+  bool gpu_stackless_traversal_ = false;
   float render_time_ = 0.0f;
 
   void setup_world();
+  void build_scene_bvh(bool store_in_cache = false);
+  void bind_scene_bvh();
+  bool begin_scene_edits();
+  bool edit_object(int handle);
+  void finish_scene_edit(bool patched, const char* edit, std::chrono::high_resolution_clock::time_point start);
+  void animate_scene();
   void setup_camera();
+  void run_large_tree_benchmark();
 
   // Vulkan Internal
   void init_window();
@@ -179,6 +254,7 @@ private:
   void setup_debug_messenger();
   bool check_validation_layer_support();
   void export_ppm();
+  void export_sample_map();
 };
 
 #endif
@@ -0,0 +1,89 @@
+#ifndef WAVEFRONT_HPP
+#define WAVEFRONT_HPP
+
+#include "material.hpp"
+#include "sampler.hpp"
+#include "vec3.hpp"
+#include <vector>
+
+// How the CPU renderer organises its work: one sample at a time from camera
+// to termination, or batches of samples advanced bounce by bounce.
+enum class CpuPipeline { MEGAKERNEL, WAVEFRONT };
+
+// CPU counterparts of PathStateSOA / HitResultSOA / MaterialQueues in
+// cuda_structs.hpp. Each field is its own contiguous array indexed by path, so
+// every wavefront stage streams through only the fields it touches. One
+// wavefront_batch lives per render thread and is reused tile after tile; once
+// it has grown to the largest batch the stages no longer allocate.
+struct path_state_soa {
+  // Ray components
+  std::vector<point3> ray_origin;
+  std::vector<vec3> ray_dir;
+  std::vector<real> ray_time;
+
+  // Path state
+  std::vector<color> throughput;
+  std::vector<color> radiance;
+  std::vector<sampler> rng;
+  std::vector<int> pixel_index;
+  std::vector<int> lobe_bounces; // 3 per path, indexed by ScatterLobe
+
+  void resize(size_t n) {
+    ray_origin.resize(n);
+    ray_dir.resize(n);
+    ray_time.resize(n);
+    throughput.resize(n);
+    radiance.resize(n);
+    rng.resize(n);
+    pixel_index.resize(n);
+    lobe_bounces.resize(n * 3);
+  }
+};
+
+struct hit_result_soa {
+  // hit_record components, minus the owning material pointer
+  std::vector<point3> hit_p;
+  std::vector<vec3> hit_normal;
+  std::vector<real> hit_t;
+  std::vector<real> hit_u;
+  std::vector<real> hit_v;
+  std::vector<unsigned char> hit_front_face;
+  std::vector<const material*> hit_material;
+
+  void resize(size_t n) {
+    hit_p.resize(n);
+    hit_normal.resize(n);
+    hit_t.resize(n);
+    hit_u.resize(n);
+    hit_v.resize(n);
+    hit_front_face.resize(n);
+    hit_material.resize(n);
+  }
+};
+
+// Active path indices bucketed by the type of material they hit, plus one
+// bucket for paths that escaped, so each shading loop runs a single
+// material's code over all of its paths.
+struct material_queues {
+  std::vector<int> queues[NUM_MATERIAL_TYPES];
+  std::vector<int> misses;
+
+  void clear() {
+    for (auto& q : queues) q.clear();
+    misses.clear();
+  }
+};
+
+struct wavefront_batch {
+  // Tiles with more samples than this are traced in several batches, which
+  // bounds each thread's batch to about 15 MB
+  static constexpr size_t max_paths = 65536;
+
+  path_state_soa paths;
+  hit_result_soa hits;
+  material_queues queues;
+  std::vector<int> active;
+  std::vector<int> next_active;
+};
+
+#endif // !WAVEFRONT_HPP
@@ -0,0 +1,447 @@
+#ifndef WIDE_BVH_HPP
+#define WIDE_BVH_HPP
+
+#include "cuda/bvh_kernel.cuh"
+#include "cuda_structs.hpp"
+
+#include <algorithm>
+#include <cstddef>
+#include <cstdint>
+#include <functional>
+#include <limits>
+#include <new>
+#include <utility>
+#include <vector>
+
+#if defined(__SSE2__) || defined(_M_X64)
+#include <immintrin.h>
+#define WIDE_BVH_SSE 1
+#endif
+
+// Allocator for node arrays that start on a page boundary, so the treelets
+// cluster_treelets lays out in page-sized runs of nodes each sit in one page
+template <class T> struct page_allocator {
+  using value_type = T;
+  static constexpr std::size_t page_bytes = 4096;
+
+  page_allocator() = default;
+  template <class U> page_allocator(const page_allocator<U>&) {}
+
+  T* allocate(std::size_t n) {
+    return static_cast<T*>(
+        ::operator new(n * sizeof(T), std::align_val_t(page_bytes)));
+  }
+  void deallocate(T* p, std::size_t) {
+    ::operator delete(p, std::align_val_t(page_bytes));
+  }
+
+  template <class U> bool operator==(const page_allocator<U>&) const {
+    return true;
+  }
+};
+
+// CPU-only Width-ary BVH (Width = 4 or 8) collapsed from the binary
+// LinearBVHNode tree that flatten_hittable builds. Each node stores the bounds
+// of all its children in SoA form, so one visit tests every child with a
+// single vector slab test (SSE per four lanes, AVX for all eight when the
+// compiler targets it) instead of one box per binary node. Leaves are the
+// binary tree's leaves, still pointing into the same PrimitiveGPU array. Only
+// the top-level tree is collapsed; instances keep their binary bottom-level
+// trees.
+template <int Width> struct alignas(32) WideBVHNode {
+  static_assert(Width == 4 || Width == 8,
+                "wide BVH nodes hold 4 or 8 children");
+
+  // Child boxes as lower x, y, z then upper x, y, z. Empty slots are inverted
+  // boxes (+inf lower, -inf upper), which every ray misses.
+  float bounds[6][Width];
+  int child[Width]; // interior child: node index; leaf child: first primitive
+  uint16_t n_primitives[Width]; // 0 for an interior child or an empty slot
+};
+
+template <int Width> class wide_bvh {
+public:
+  bool empty() const { return nodes.empty(); }
+  size_t size() const { return nodes.size(); }
+  // Root first
+  const WideBVHNode<Width>& node(size_t index) const { return nodes[index]; }
+
+  // Rebuilds the wide tree from a binary one. Each wide node starts from a
+  // binary node's two children and keeps opening the interior child with the
+  // largest surface area until it holds Width children or only leaves remain,
+  // so the subtrees rays are most likely to enter are flattened first.
+  void collapse(cuda::span<LinearBVHNode> binary) {
+    nodes.clear();
+    if (binary.empty()) return;
+    nodes.reserve(binary.size() / (Width - 1) + 1);
+    if (binary[0].n_primitives > 0) {
+      // A lone leaf still needs a node around it
+      nodes.emplace_back();
+      clear_node(nodes[0]);
+      set_child(nodes[0], 0, binary[0], 0);
+      return;
+    }
+    collapse_node(binary, 0);
+  }
+
+  // Reorders the nodes into treelets of up to 'nodes_per_treelet' nodes stored
+  // contiguously, so the nodes a ray is likely to visit after one another
+  // share pages and cache-line pairs. collapse leaves them depth first, where
+  // a node's later children sit behind the whole subtree of its first one.
+  // Each treelet grows from its root by adding the frontier child with the
+  // largest surface area, the one a random ray most likely enters next; the
+  // children left on its frontier root the following treelets, in the order
+  // they were cut off. With the node array page aligned and a page holding
+  // 'nodes_per_treelet' nodes, no treelet straddles two pages: one that would
+  // is started on the next page. The rest of the current page takes the next
+  // few subtrees small enough to fit in it whole, and empty nodes pad what
+  // they leave.
+  void cluster_treelets(int nodes_per_treelet) {
+    if (nodes.size() <= 1 || nodes_per_treelet <= 1) return;
+    // Children follow their parent in collapse's depth-first order
+    std::vector<int> subtree_size(nodes.size(), 1);
+    for (size_t i = nodes.size(); i-- > 0;) {
+      for (int lane = 0; lane < Width; lane++) {
+        if (is_interior_child(nodes[i], lane)) {
+          subtree_size[i] += subtree_size[nodes[i].child[lane]];
+        }
+      }
+    }
+
+    std::vector<int> order; // old indices in their new order, -1 for padding
+    order.reserve(nodes.size());
+    std::vector<int> roots = {0};
+    std::vector<bool> placed = {false};
+    using frontier_entry = std::pair<float, int>; // surface area, node
+    std::vector<frontier_entry> frontier;
+    auto grow = [&](int root) {
+      frontier.assign(1, {std::numeric_limits<float>::infinity(), root});
+      for (int taken = 0; taken < nodes_per_treelet && !frontier.empty();
+           taken++) {
+        std::pop_heap(frontier.begin(), frontier.end());
+        int index = frontier.back().second;
+        frontier.pop_back();
+        order.push_back(index);
+        const WideBVHNode<Width>& node = nodes[index];
+        for (int lane = 0; lane < Width; lane++) {
+          if (!is_interior_child(node, lane)) continue;
+          frontier.push_back(
+              {lane_surface_area(node, lane), node.child[lane]});
+          std::push_heap(frontier.begin(), frontier.end());
+        }
+      }
+      std::sort(frontier.begin(), frontier.end(),
+                std::greater<frontier_entry>());
+      for (const frontier_entry& entry : frontier) {
+        roots.push_back(entry.second);
+        placed.push_back(false);
+      }
+    };
+    for (size_t r = 0; r < roots.size(); r++) {
+      if (placed[r]) continue;
+      int room = nodes_per_treelet - int(order.size() % nodes_per_treelet);
+      if (subtree_size[roots[r]] > room && room < nodes_per_treelet) {
+        // Fill the rest of the page with the next few subtrees that fit
+        // whole, and pad what they leave
+        size_t end = std::min(roots.size(), r + 64);
+        for (size_t next = r + 1; next < end && room > 0; next++) {
+          if (placed[next] || subtree_size[roots[next]] > room) continue;
+          grow(roots[next]);
+          placed[next] = true;
+          room -= subtree_size[roots[next]];
+        }
+        order.insert(order.end(), room, -1);
+      }
+      grow(roots[r]);
+      placed[r] = true;
+    }
+
+    std::vector<int> new_index(nodes.size());
+    for (size_t i = 0; i < order.size(); i++) {
+      if (order[i] >= 0) new_index[order[i]] = int(i);
+    }
+    node_array reordered(order.size());
+    for (size_t i = 0; i < order.size(); i++) {
+      WideBVHNode<Width>& node = reordered[i];
+      if (order[i] < 0) {
+        clear_node(node);
+        continue;
+      }
+      node = nodes[order[i]];
+      for (int lane = 0; lane < Width; lane++) {
+        if (is_interior_child(node, lane)) {
+          node.child[lane] = new_index[node.child[lane]];
+        }
+      }
+    }
+    nodes.swap(reordered);
+  }
+
+  // Same contract as hit_linear_bvh: closest hit in (t_min, t_max), reported
+  // in 'rec'. Instances are traced through their bottom-level trees in
+  // 'binary', the tree this one was collapsed from.
+  template <class Rng>
+  bool hit(cuda::span<LinearBVHNode> binary,
+           cuda::span<PrimitiveGPU> primitives, const ray_gpu& ray,
+           float t_min, float t_max, HitRecordGPU& rec, Rng* local_rand_state,
+           int* nodes_visited = nullptr) const {
+    if (nodes.empty()) return false;
+
+    // A near-to-far push order needs to know, per axis, which plane the ray
+    // enters through
+    ray_box_setup setup;
+    for (int a = 0; a < 3; a++) {
+      setup.origin[a] = ray.origin()[a];
+      setup.inv_dir[a] = 1.0f / ray.direction()[a];
+      setup.near_plane[a] = setup.inv_dir[a] < 0.0f ? a + 3 : a;
+    }
+
+    struct stack_entry {
+      int index;
+      int n_primitives; // 0 for an interior node
+      float t_near;
+    };
+    stack_entry stack[stack_size];
+    int stack_ptr = 0;
+    stack[stack_ptr++] = {0, 0, t_min};
+
+    bool hit_anything = false;
+    float closest_so_far = t_max;
+    int visited = 0;
+
+    while (stack_ptr > 0) {
+      stack_entry entry = stack[--stack_ptr];
+      // Pushed while a farther hit was still the closest
+      if (entry.t_near >= closest_so_far) continue;
+
+      if (entry.n_primitives > 0) {
+        for (int i = 0; i < entry.n_primitives; i++) {
+          HitRecordGPU temp_rec;
+          const PrimitiveGPU& prim = primitives[entry.index + i];
+          bool hit =
+              prim.type == PrimitiveType::INSTANCE
+                  ? hit_instance(prim, binary, primitives, ray, t_min,
+                                 closest_so_far, temp_rec, local_rand_state,
+                                 visited)
+                  : hit_primitive(prim, ray, t_min, closest_so_far, temp_rec,
+                                  local_rand_state);
+          if (hit) {
+            hit_anything = true;
+            closest_so_far = temp_rec.t;
+            rec = temp_rec;
+          }
+        }
+        continue;
+      }
+
+      const WideBVHNode<Width>& node = nodes[entry.index];
+      visited++;
+      float t_near[Width];
+      unsigned mask =
+          intersect_children(node, setup, t_min, closest_so_far, t_near);
+
+      // Sort the hit children nearest first, then push them farthest first so
+      // the nearest pops next
+      int order[Width];
+      int hits = 0;
+      for (; mask; mask &= mask - 1) {
+        int lane = count_trailing_zeros(mask);
+        int j = hits++;
+        for (; j > 0 && t_near[order[j - 1]] > t_near[lane]; j--) {
+          order[j] = order[j - 1];
+        }
+        order[j] = lane;
+      }
+      for (int j = hits - 1; j >= 0; j--) {
+        int lane = order[j];
+        stack[stack_ptr++] = {node.child[lane], node.n_primitives[lane],
+                              t_near[lane]};
+      }
+    }
+
+    if (nodes_visited) *nodes_visited = visited;
+    return hit_anything;
+  }
+
+private:
+  // Each wide level removes at least one binary level from every path, and
+  // the binary traversal already assumes fewer than 64 levels; every visit
+  // pops one entry and pushes at most Width.
+  static constexpr int stack_size = 64 * (Width - 1) + 1;
+
+  struct ray_box_setup {
+    float origin[3];
+    float inv_dir[3];
+    // Row of WideBVHNode::bounds the ray enters through on each axis
+    int near_plane[3];
+  };
+
+  using node_array =
+      std::vector<WideBVHNode<Width>, page_allocator<WideBVHNode<Width>>>;
+  node_array nodes;
+
+  static void clear_node(WideBVHNode<Width>& node) {
+    for (int lane = 0; lane < Width; lane++) {
+      for (int a = 0; a < 3; a++) {
+        node.bounds[a][lane] = std::numeric_limits<float>::infinity();
+        node.bounds[a + 3][lane] = -std::numeric_limits<float>::infinity();
+      }
+      node.child[lane] = -1;
+      node.n_primitives[lane] = 0;
+    }
+  }
+
+  static void set_child(WideBVHNode<Width>& node, int lane,
+                        const LinearBVHNode& src, int index) {
+    const float* lo = &src.aabb_min.x;
+    const float* hi = &src.aabb_max.x;
+    for (int a = 0; a < 3; a++) {
+      node.bounds[a][lane] = lo[a];
+      node.bounds[a + 3][lane] = hi[a];
+    }
+    node.child[lane] = src.n_primitives > 0 ? src.primitive_offset : index;
+    node.n_primitives[lane] = src.n_primitives;
+  }
+
+  static bool is_interior_child(const WideBVHNode<Width>& node, int lane) {
+    return node.n_primitives[lane] == 0 && node.child[lane] >= 0;
+  }
+
+  static float lane_surface_area(const WideBVHNode<Width>& node, int lane) {
+    float dx = node.bounds[3][lane] - node.bounds[0][lane];
+    float dy = node.bounds[4][lane] - node.bounds[1][lane];
+    float dz = node.bounds[5][lane] - node.bounds[2][lane];
+    return dx * dy + dy * dz + dz * dx;
+  }
+
+  static float surface_area(const LinearBVHNode& n) {
+    float dx = n.aabb_max.x - n.aabb_min.x;
+    float dy = n.aabb_max.y - n.aabb_min.y;
+    float dz = n.aabb_max.z - n.aabb_min.z;
+    return dx * dy + dy * dz + dz * dx;
+  }
+
+  // Writes the wide node for binary interior node 'index' and its subtrees,
+  // depth first; returns its wide index
+  int collapse_node(cuda::span<LinearBVHNode> binary, int index) {
+    int children[Width];
+    int count = 0;
+    children[count++] = index + 1;
+    children[count++] = binary[index].second_child_offset;
+
+    while (count < Width) {
+      int widest = -1;
+      float widest_area = -1.0f;
+      for (int i = 0; i < count; i++) {
+        const LinearBVHNode& c = binary[children[i]];
+        if (c.n_primitives == 0 && surface_area(c) > widest_area) {
+          widest = i;
+          widest_area = surface_area(c);
+        }
+      }
+      if (widest < 0) break;
+      // Open it in place so children stay in the binary tree's left-to-right
+      // order
+      int opened = children[widest];
+      for (int i = count; i > widest + 1; i--) children[i] = children[i - 1];
+      children[widest] = opened + 1;
+      children[widest + 1] = binary[opened].second_child_offset;
+      count++;
+    }
+
+    int wide_index = int(nodes.size());
+    nodes.emplace_back();
+    clear_node(nodes[wide_index]);
+    for (int lane = 0; lane < count; lane++) {
+      const LinearBVHNode& c = binary[children[lane]];
+      int child_index =
+          c.n_primitives > 0 ? 0 : collapse_node(binary, children[lane]);
+      // nodes may have grown, so index it again rather than holding a
+      // reference across the recursion
+      set_child(nodes[wide_index], lane, c, child_index);
+    }
+    return wide_index;
+  }
+
+  static int count_trailing_zeros(unsigned mask) {
+#if defined(__GNUC__) || defined(__clang__)
+    return __builtin_ctz(mask);
+#else
+    int n = 0;
+    while (!(mask & 1u)) {
+      mask >>= 1;
+      n++;
+    }
+    return n;
+#endif
+  }
+
+  // The same conservative slab test as aabb_hit, run on every child at once.
+  // Returns a bit per child whose box the ray crosses within (t_min, t_max)
+  // and stores the entry distances in 't_near'.
+  static unsigned intersect_children(const WideBVHNode<Width>& node,
+                                     const ray_box_setup& s, float t_min,
+                                     float t_max, float* t_near) {
+#if defined(WIDE_BVH_SSE) && defined(__AVX__)
+    if constexpr (Width == 8) {
+      __m256 lo = _mm256_set1_ps(t_min), hi = _mm256_set1_ps(t_max);
+      for (int a = 0; a < 3; a++) {
+        __m256 o = _mm256_set1_ps(s.origin[a]);
+        __m256 inv = _mm256_set1_ps(s.inv_dir[a]);
+        __m256 near_bound = _mm256_load_ps(node.bounds[s.near_plane[a]]);
+        __m256 far_bound = _mm256_load_ps(node.bounds[far_plane(s, a)]);
+        __m256 t0 = _mm256_mul_ps(_mm256_sub_ps(near_bound, o), inv);
+        __m256 t1 = _mm256_mul_ps(_mm256_sub_ps(far_bound, o), inv);
+        t1 = _mm256_mul_ps(t1, _mm256_set1_ps(1.0000004f));
+        lo = _mm256_max_ps(t0, lo);
+        hi = _mm256_min_ps(t1, hi);
+      }
+      _mm256_storeu_ps(t_near, lo);
+      return unsigned(_mm256_movemask_ps(_mm256_cmp_ps(lo, hi, _CMP_LT_OQ)));
+    }
+#endif
+    unsigned mask = 0;
+    for (int base = 0; base < Width; base += 4) {
+#if defined(WIDE_BVH_SSE)
+      __m128 lo = _mm_set1_ps(t_min), hi = _mm_set1_ps(t_max);
+      for (int a = 0; a < 3; a++) {
+        __m128 o = _mm_set1_ps(s.origin[a]);
+        __m128 inv = _mm_set1_ps(s.inv_dir[a]);
+        __m128 near_bound = _mm_load_ps(node.bounds[s.near_plane[a]] + base);
+        __m128 far_bound = _mm_load_ps(node.bounds[far_plane(s, a)] + base);
+        __m128 t0 = _mm_mul_ps(_mm_sub_ps(near_bound, o), inv);
+        __m128 t1 = _mm_mul_ps(_mm_sub_ps(far_bound, o), inv);
+        t1 = _mm_mul_ps(t1, _mm_set1_ps(1.0000004f));
+        // maxps/minps return their second operand when either is NaN (a zero
+        // direction component on a slab plane), which keeps the running bound
+        // just as aabb_hit's comparisons do
+        lo = _mm_max_ps(t0, lo);
+        hi = _mm_min_ps(t1, hi);
+      }
+      _mm_storeu_ps(t_near + base, lo);
+      mask |= unsigned(_mm_movemask_ps(_mm_cmplt_ps(lo, hi))) << base;
+#else
+      for (int lane = base; lane < base + 4; lane++) {
+        float lo = t_min, hi = t_max;
+        for (int a = 0; a < 3; a++) {
+          float near_bound = node.bounds[s.near_plane[a]][lane];
+          float far_bound = node.bounds[far_plane(s, a)][lane];
+          float t0 = (near_bound - s.origin[a]) * s.inv_dir[a];
+          float t1 = (far_bound - s.origin[a]) * s.inv_dir[a] * 1.0000004f;
+          lo = t0 > lo ? t0 : lo;
+          hi = t1 < hi ? t1 : hi;
+        }
+        t_near[lane] = lo;
+        if (lo < hi) mask |= 1u << lane;
+      }
+#endif
+    }
+    return mask;
+  }
+
+  static int far_plane(const ray_box_setup& s, int axis) {
+    return s.near_plane[axis] == axis ? axis + 3 : axis;
+  }
+};
+
+#endif // !WIDE_BVH_HPP
@@ -49,16 +49,24 @@ __global__ void render_init(int total_rays, curandState* rand_state) {
   curand_init(1984, idx, 0, &rand_state[idx]);
 }
 
+// Stackless walks the tree along escape links (traverse_bvh_stackless) instead
+// of with a per-thread stack, which frees its local memory for occupancy
+template <bool Stackless>
 __global__ void intersect_bvh(PathStateSOA paths, HitResultSOA hits, int* active_indices, int num_active,
-                              const cuda::span<LinearBVHNode> bvh_nodes, const cuda::span<PrimitiveGPU> primitives,
-                              curandState* rand_state) {
+                              const cuda::span<LinearBVHNode> bvh_nodes, const cuda::span<const int> escape_links,
+                              const cuda::span<PrimitiveGPU> primitives, curandState* rand_state) {
   int idx = blockIdx.x * blockDim.x + threadIdx.x;
   if (idx >= num_active) return;
   int path_idx = active_indices[idx];
 
   ray_gpu r(paths.ray_origin[path_idx], paths.ray_dir[path_idx], paths.ray_time[path_idx]);
   HitRecordGPU rec;
-  bool hit = hit_linear_bvh(bvh_nodes, primitives, r, 0.001f, 1e20f, rec, &rand_state[path_idx]);
+  bool hit;
+  if constexpr (Stackless) {
+    hit = hit_linear_bvh_stackless(bvh_nodes, escape_links, primitives, r, 0.001f, 1e20f, rec, &rand_state[path_idx]);
+  } else {
+    hit = hit_linear_bvh(bvh_nodes, primitives, r, 0.001f, 1e20f, rec, &rand_state[path_idx]);
+  }
 
   hits.hit_anything[idx] = hit;
   if (hit) {
@@ -293,9 +301,11 @@ static void free_hit_result_soa(HitResultSOA& h) {
   cudaFree(h.hit_anything);
 }
 
-extern "C" void launch_render(RenderConfig config, cuda::span<LinearBVHNode> h_bvh, cuda::span<PrimitiveGPU> h_prims,
-                              cuda::span<MaterialGPU> h_mats, cuda::span<TextureGPU> h_texs,
-                              cuda::span<PerlinDataGPU> h_perlin, cuda::span<unsigned char> h_images) {
+// An empty 'h_escape_links' traces with the stack-based traversal
+extern "C" void launch_render(RenderConfig config, cuda::span<LinearBVHNode> h_bvh, cuda::span<int> h_escape_links,
+                              cuda::span<PrimitiveGPU> h_prims, cuda::span<MaterialGPU> h_mats,
+                              cuda::span<TextureGPU> h_texs, cuda::span<PerlinDataGPU> h_perlin,
+                              cuda::span<unsigned char> h_images) {
   int width = config.width, height = config.height;
   int BATCH_SIZE = 16, total_rays = width * height * BATCH_SIZE;
 
@@ -310,6 +320,7 @@ extern "C" void launch_render(RenderConfig config, cuda::span<LinearBVHNode> h_b
   }
 
   LinearBVHNode* d_bvh;
+  int* d_escape = nullptr;
   PrimitiveGPU* d_prims;
   MaterialGPU* d_mats;
   TextureGPU* d_texs = nullptr;
@@ -321,6 +332,10 @@ extern "C" void launch_render(RenderConfig config, cuda::span<LinearBVHNode> h_b
   cudaMemcpy(d_bvh, h_bvh.data(), h_bvh.size_bytes(), cudaMemcpyHostToDevice);
   cudaMemcpy(d_prims, h_prims.data(), h_prims.size_bytes(), cudaMemcpyHostToDevice);
   cudaMemcpy(d_mats, h_mats.data(), h_mats.size_bytes(), cudaMemcpyHostToDevice);
+  if (!h_escape_links.empty()) {
+    cudaMalloc(&d_escape, h_escape_links.size_bytes());
+    cudaMemcpy(d_escape, h_escape_links.data(), h_escape_links.size_bytes(), cudaMemcpyHostToDevice);
+  }
   if (!h_texs.empty()) {
     cudaMalloc(&d_texs, h_texs.size_bytes());
     cudaMemcpy(d_texs, h_texs.data(), h_texs.size_bytes(), cudaMemcpyHostToDevice);
@@ -365,6 +380,7 @@ extern "C" void launch_render(RenderConfig config, cuda::span<LinearBVHNode> h_b
   cudaMalloc(&d_cnt, sizeof(int));
 
   cuda::span<LinearBVHNode> d_bvh_span = {d_bvh, h_bvh.size()};
+  cuda::span<const int> d_escape_span = {d_escape, h_escape_links.size()};
   cuda::span<PrimitiveGPU> d_prims_span = {d_prims, h_prims.size()};
   cuda::span<MaterialGPU> d_mats_span = {d_mats, h_mats.size()};
   cuda::span<TextureGPU> d_texs_span = {d_texs, h_texs.size()};
@@ -379,8 +395,13 @@ extern "C" void launch_render(RenderConfig config, cuda::span<LinearBVHNode> h_b
     generate_rays<<<(active + 255) / 256, 256>>>(d_paths, cam, d_rand_state, width, height, cur);
     for (int bounce = 0; bounce < config.max_depth && active > 0; bounce++) {
       cudaMemset(d_hits.hit_anything, 0, active * sizeof(bool));
-      intersect_bvh<<<(active + 255) / 256, 256>>>(d_paths, d_hits, d_active, active, d_bvh_span, d_prims_span,
-                                                   d_rand_state);
+      if (d_escape) {
+        intersect_bvh<true><<<(active + 255) / 256, 256>>>(d_paths, d_hits, d_active, active, d_bvh_span,
+                                                           d_escape_span, d_prims_span, d_rand_state);
+      } else {
+        intersect_bvh<false><<<(active + 255) / 256, 256>>>(d_paths, d_hits, d_active, active, d_bvh_span,
+                                                            d_escape_span, d_prims_span, d_rand_state);
+      }
       cudaMemset(d_cnt, 0, sizeof(int));
       shade_kernel<<<(active + 255) / 256, 256>>>(d_paths, d_hits, d_active, active, d_mats_span, d_texs_span,
                                                   d_perlin_span, d_imgs_span, d_rand_state, d_next, d_cnt, cam);
@@ -400,6 +421,7 @@ extern "C" void launch_render(RenderConfig config, cuda::span<LinearBVHNode> h_b
   cudaFree(d_next);
   cudaFree(d_cnt);
   cudaFree(d_bvh);
+  if (d_escape) cudaFree(d_escape);
   cudaFree(d_prims);
   cudaFree(d_mats);
   if (d_texs) cudaFree(d_texs);
@@ -1,8 +1,13 @@
 #include "constant_medium.hpp"
 #include "cuda_structs.hpp"
+#include "lbvh_builder.hpp"
 #include "material.hpp"
+#include "sah_builder.hpp"
+#include "sbvh_builder.hpp"
 #include "texture.hpp"
 
+#include <cstring>
+
 // Define CumTransform locally
 struct CumTransform {
   vec3 offset{0, 0, 0};
@@ -37,6 +42,16 @@ struct CumTransform {
     return pr + offset;
   }
 
+  bool is_identity() const { return !has_rot && offset.near_zero(); }
+
+  // The inverse of apply, as an INSTANCE primitive's world-to-object matrix
+  void set_instance_transform(PrimitiveGPU& prim) const {
+    double c = has_rot ? cos_t : 1.0, s = has_rot ? sin_t : 0.0;
+    vec3 rows[3] = {vec3(c, 0, -s), vec3(0, 1, 0), vec3(s, 0, c)};
+    for (int i = 0; i < 3; i++) prim.instance.rows[i] = to_vec3f(rows[i]);
+    prim.instance.translation = to_vec3f(-vec3(dot(rows[0], offset), dot(rows[1], offset), dot(rows[2], offset)));
+  }
+
   vec3 apply_vec(const vec3& v) const {
     if (!has_rot) return v;
     return vec3(cos_t * v.x() + sin_t * v.z(), v.y(), -sin_t * v.x() + cos_t * v.z());
@@ -71,7 +86,7 @@ int get_or_add_texture(std::shared_ptr<texture> tex_ptr, std::vector<TextureGPU>
   auto it = tex_map.find(tex_ptr.get());
   if (it != tex_map.end()) return it->second;
 
-  TextureGPU gpu_tex;
+  TextureGPU gpu_tex{};
 
   if (auto solid = dynamic_cast<solid_color*>(tex_ptr.get())) {
     gpu_tex.type = TextureType::SOLID;
@@ -106,7 +121,7 @@ int get_or_add_texture(std::shared_ptr<texture> tex_ptr, std::vector<TextureGPU>
     gpu_tex.noise.scale = static_cast<float>(noise_tex->scale);
     gpu_tex.noise.perlin_data_idx = linear_perlin.size();
 
-    PerlinDataGPU p_data;
+    PerlinDataGPU p_data{};
     for (int i = 0; i < 256; ++i) {
       p_data.randvec[i] = to_vec3f(noise_tex->noise.randvec[i]);
       p_data.perm_x[i] = noise_tex->noise.perm_x[i];
@@ -130,13 +145,13 @@ int get_or_add_material(std::shared_ptr<material> mat_ptr, std::vector<MaterialG
   auto it = mat_map.find(mat_ptr.get());
   if (it != mat_map.end()) return it->second;
 
-  MaterialGPU gpu_mat;
+  MaterialGPU gpu_mat{};
   if (auto lambert = dynamic_cast<lambertian*>(mat_ptr.get())) {
     gpu_mat.type = MaterialType::LAMBERTIAN;
     gpu_mat.albedo_tex_id = get_or_add_texture(lambert->tex, linear_textures, linear_perlin, image_buffer, tex_map);
   } else if (auto met = dynamic_cast<metal*>(mat_ptr.get())) {
     gpu_mat.type = MaterialType::METAL;
-    TextureGPU gpu_tex;
+    TextureGPU gpu_tex{};
     gpu_tex.type = TextureType::SOLID;
     gpu_tex.solid.color = to_vec3f(met->get_albedo());
     gpu_mat.albedo_tex_id = linear_textures.size();
@@ -144,7 +159,7 @@ int get_or_add_material(std::shared_ptr<material> mat_ptr, std::vector<MaterialG
     gpu_mat.fuzz = static_cast<float>(met->get_fuzz());
   } else if (auto die = dynamic_cast<dielectric*>(mat_ptr.get())) {
     gpu_mat.type = MaterialType::DIELECTRIC;
-    TextureGPU gpu_tex;
+    TextureGPU gpu_tex{};
     gpu_tex.type = TextureType::SOLID;
     gpu_tex.solid.color = Vec3f{1.0f, 1.0f, 1.0f};
     gpu_mat.albedo_tex_id = linear_textures.size();
@@ -164,34 +179,255 @@ int get_or_add_material(std::shared_ptr<material> mat_ptr, std::vector<MaterialG
   return new_id;
 }
 
+// Object-space geometry of the subtrees that instances share, one
+// bottom-level BVH each
+struct instance_geometry {
+  struct blas {
+    std::vector<PrimitiveGPU> primitives;
+    std::vector<primitive_ref> refs;
+  };
+  std::vector<blas> blases;
+  std::unordered_map<hittable*, int> blas_ids; // subtree -> index into blases
+};
+
+// A primitive with every byte zeroed. Brace-initializing it sets only the
+// union's first member, leaving the rest of larger members indeterminate, and
+// bvh_cache hashes primitives byte for byte.
+static PrimitiveGPU blank_primitive() {
+  PrimitiveGPU prim;
+  std::memset(&prim, 0, sizeof(prim));
+  return prim;
+}
+
 // Forward declaration
-int flatten_hittable_internal(std::shared_ptr<hittable> node, std::vector<LinearBVHNode>& linear_nodes,
-                              std::vector<PrimitiveGPU>& linear_primitives, std::vector<MaterialGPU>& linear_materials,
-                              std::vector<TextureGPU>& linear_textures, std::vector<PerlinDataGPU>& linear_perlin,
-                              std::vector<unsigned char>& image_buffer, std::unordered_map<material*, int>& mat_map,
-                              std::unordered_map<texture*, int>& tex_map, CumTransform current_trans);
+void collect_primitives(std::shared_ptr<hittable> node, std::vector<PrimitiveGPU>& primitives,
+                        std::vector<primitive_ref>& refs, std::vector<MaterialGPU>& linear_materials,
+                        std::vector<TextureGPU>& linear_textures, std::vector<PerlinDataGPU>& linear_perlin,
+                        std::vector<unsigned char>& image_buffer, std::unordered_map<material*, int>& mat_map,
+                        std::unordered_map<texture*, int>& tex_map, instance_geometry* instances,
+                        CumTransform current_trans);
+
+// builder.build, additionally recording in 'primitive_sources' (if given)
+// which of 'primitives' each appended primitive is, offset by 'source_base'
+template <class Builder>
+static int build_tracking_sources(const Builder& builder, std::vector<primitive_ref>& refs,
+                                  std::vector<PrimitiveGPU>& primitives, std::vector<LinearBVHNode>& linear_nodes,
+                                  std::vector<PrimitiveGPU>& linear_primitives, std::vector<int>* primitive_sources,
+                                  int source_base) {
+  if (!primitive_sources) return builder.build(refs, primitives, linear_nodes, linear_primitives);
+
+  // Builders reorder (and the SBVH duplicates) primitives without reporting
+  // where they came from, so tag each with its index while building
+  std::vector<int> material_ids(primitives.size());
+  for (size_t i = 0; i < primitives.size(); i++) {
+    material_ids[i] = primitives[i].material_id;
+    primitives[i].material_id = int(i);
+  }
+  size_t first = linear_primitives.size();
+  int root = builder.build(refs, primitives, linear_nodes, linear_primitives);
+  for (size_t k = first; k < linear_primitives.size(); k++) {
+    int source = linear_primitives[k].material_id;
+    primitive_sources->push_back(source_base + source);
+    linear_primitives[k].material_id = material_ids[source];
+  }
+  return root;
+}
+
+template <class Builder>
+static int flatten_with(std::shared_ptr<hittable> node, std::vector<LinearBVHNode>& linear_nodes,
+                        std::vector<PrimitiveGPU>& linear_primitives, std::vector<MaterialGPU>& linear_materials,
+                        std::vector<TextureGPU>& linear_textures, std::vector<PerlinDataGPU>& linear_perlin,
+                        std::vector<unsigned char>& image_buffer, std::unordered_map<material*, int>& mat_map,
+                        std::unordered_map<texture*, int>& tex_map, const Builder& builder,
+                        std::vector<int>* primitive_sources) {
+  // Any BVHs already in the scene graph are dissolved: the builder sees every
+  // primitive in world space and builds one hierarchy over all of them, except
+  // that transformed subtrees become instances of bottom-level trees.
+  std::vector<PrimitiveGPU> primitives;
+  std::vector<primitive_ref> refs;
+  instance_geometry instances;
+  collect_primitives(node, primitives, refs, linear_materials, linear_textures, linear_perlin, image_buffer, mat_map,
+                     tex_map, &instances, CumTransform());
+  if (primitive_sources) primitive_sources->clear();
+  // Builders reserve room for their own tree only, which would reallocate
+  // once per bottom-level tree
+  size_t total = primitives.size();
+  for (const instance_geometry::blas& blas : instances.blases) total += blas.primitives.size();
+  linear_nodes.reserve(linear_nodes.size() + 2 * total);
+  linear_primitives.reserve(linear_primitives.size() + total);
+
+  // The top-level tree goes first, so it is rooted where traversal starts
+  size_t top_first = linear_primitives.size();
+  int root = build_tracking_sources(builder, refs, primitives, linear_nodes, linear_primitives, primitive_sources, 0);
+  size_t top_end = linear_primitives.size();
+
+  int source_base = int(primitives.size());
+  std::vector<int> blas_roots;
+  for (instance_geometry::blas& blas : instances.blases) {
+    blas_roots.push_back(build_tracking_sources(builder, blas.refs, blas.primitives, linear_nodes, linear_primitives,
+                                                primitive_sources, source_base));
+    source_base += int(blas.primitives.size());
+  }
+  for (size_t k = top_first; k < top_end; k++) {
+    PrimitiveGPU& prim = linear_primitives[k];
+    if (prim.type == PrimitiveType::INSTANCE) prim.instance.blas_root = blas_roots[prim.instance.blas_root];
+  }
+  return root;
+}
+
+int flatten_hittable(std::shared_ptr<hittable> node, std::vector<LinearBVHNode>& linear_nodes,
+                     std::vector<PrimitiveGPU>& linear_primitives, std::vector<MaterialGPU>& linear_materials,
+                     std::vector<TextureGPU>& linear_textures, std::vector<PerlinDataGPU>& linear_perlin,
+                     std::vector<unsigned char>& image_buffer, std::unordered_map<material*, int>& mat_map,
+                     std::unordered_map<texture*, int>& tex_map, const sah_builder& builder,
+                     std::vector<int>* primitive_sources) {
+  return flatten_with(node, linear_nodes, linear_primitives, linear_materials, linear_textures, linear_perlin,
+                      image_buffer, mat_map, tex_map, builder, primitive_sources);
+}
+
+int flatten_hittable(std::shared_ptr<hittable> node, std::vector<LinearBVHNode>& linear_nodes,
+                     std::vector<PrimitiveGPU>& linear_primitives, std::vector<MaterialGPU>& linear_materials,
+                     std::vector<TextureGPU>& linear_textures, std::vector<PerlinDataGPU>& linear_perlin,
+                     std::vector<unsigned char>& image_buffer, std::unordered_map<material*, int>& mat_map,
+                     std::unordered_map<texture*, int>& tex_map, const lbvh_builder& builder,
+                     std::vector<int>* primitive_sources) {
+  return flatten_with(node, linear_nodes, linear_primitives, linear_materials, linear_textures, linear_perlin,
+                      image_buffer, mat_map, tex_map, builder, primitive_sources);
+}
+
+int flatten_hittable(std::shared_ptr<hittable> node, std::vector<LinearBVHNode>& linear_nodes,
+                     std::vector<PrimitiveGPU>& linear_primitives, std::vector<MaterialGPU>& linear_materials,
+                     std::vector<TextureGPU>& linear_textures, std::vector<PerlinDataGPU>& linear_perlin,
+                     std::vector<unsigned char>& image_buffer, std::unordered_map<material*, int>& mat_map,
+                     std::unordered_map<texture*, int>& tex_map, const sbvh_builder& builder,
+                     std::vector<int>* primitive_sources) {
+  return flatten_with(node, linear_nodes, linear_primitives, linear_materials, linear_textures, linear_perlin,
+                      image_buffer, mat_map, tex_map, builder, primitive_sources);
+}
+
+int flatten_hittable(std::shared_ptr<hittable> node, std::vector<LinearBVHNode>& linear_nodes,
+                     std::vector<PrimitiveGPU>& linear_primitives, std::vector<MaterialGPU>& linear_materials,
+                     std::vector<TextureGPU>& linear_textures, std::vector<PerlinDataGPU>& linear_perlin,
+                     std::vector<unsigned char>& image_buffer, std::unordered_map<material*, int>& mat_map,
+                     std::unordered_map<texture*, int>& tex_map, BvhBuildMode mode,
+                     std::vector<int>* primitive_sources) {
+  if (mode == BvhBuildMode::SAH) {
+    return flatten_hittable(node, linear_nodes, linear_primitives, linear_materials, linear_textures, linear_perlin,
+                            image_buffer, mat_map, tex_map, sah_builder(), primitive_sources);
+  }
+  if (mode == BvhBuildMode::SBVH) {
+    return flatten_hittable(node, linear_nodes, linear_primitives, linear_materials, linear_textures, linear_perlin,
+                            image_buffer, mat_map, tex_map, sbvh_builder(), primitive_sources);
+  }
+  lbvh_builder builder;
+  builder.optimize_treelets = mode == BvhBuildMode::LBVH_TREELET;
+  return flatten_hittable(node, linear_nodes, linear_primitives, linear_materials, linear_textures, linear_perlin,
+                          image_buffer, mat_map, tex_map, builder, primitive_sources);
+}
 
 int flatten_hittable(std::shared_ptr<hittable> node, std::vector<LinearBVHNode>& linear_nodes,
                      std::vector<PrimitiveGPU>& linear_primitives, std::vector<MaterialGPU>& linear_materials,
                      std::vector<TextureGPU>& linear_textures, std::vector<PerlinDataGPU>& linear_perlin,
                      std::vector<unsigned char>& image_buffer, std::unordered_map<material*, int>& mat_map,
                      std::unordered_map<texture*, int>& tex_map) {
+  return flatten_hittable(node, linear_nodes, linear_primitives, linear_materials, linear_textures, linear_perlin,
+                          image_buffer, mat_map, tex_map, sah_builder());
+}
 
-  return flatten_hittable_internal(node, linear_nodes, linear_primitives, linear_materials, linear_textures,
-                                   linear_perlin, image_buffer, mat_map, tex_map, CumTransform());
+void collect_flattened_primitives(std::shared_ptr<hittable> node, std::vector<PrimitiveGPU>& primitives,
+                                  std::vector<MaterialGPU>& linear_materials, std::vector<TextureGPU>& linear_textures,
+                                  std::vector<PerlinDataGPU>& linear_perlin, std::vector<unsigned char>& image_buffer,
+                                  std::unordered_map<material*, int>& mat_map,
+                                  std::unordered_map<texture*, int>& tex_map) {
+  // The refs are only needed for a build
+  std::vector<primitive_ref> refs;
+  instance_geometry instances;
+  collect_primitives(node, primitives, refs, linear_materials, linear_textures, linear_perlin, image_buffer, mat_map,
+                     tex_map, &instances, CumTransform());
+  // Sources number the top level first, then each bottom-level tree's
+  for (const instance_geometry::blas& blas : instances.blases) {
+    primitives.insert(primitives.end(), blas.primitives.begin(), blas.primitives.end());
+  }
 }
 
-int flatten_hittable_internal(std::shared_ptr<hittable> node, std::vector<LinearBVHNode>& linear_nodes,
-                              std::vector<PrimitiveGPU>& linear_primitives, std::vector<MaterialGPU>& linear_materials,
-                              std::vector<TextureGPU>& linear_textures, std::vector<PerlinDataGPU>& linear_perlin,
-                              std::vector<unsigned char>& image_buffer, std::unordered_map<material*, int>& mat_map,
-                              std::unordered_map<texture*, int>& tex_map, CumTransform current_trans) {
+void collect_object_primitives(std::shared_ptr<hittable> object, bool instanced,
+                               std::vector<PrimitiveGPU>& primitives, std::vector<MaterialGPU>& linear_materials,
+                               std::vector<TextureGPU>& linear_textures, std::vector<PerlinDataGPU>& linear_perlin,
+                               std::vector<unsigned char>& image_buffer, std::unordered_map<material*, int>& mat_map,
+                               std::unordered_map<texture*, int>& tex_map) {
+  std::vector<primitive_ref> refs;
+  instance_geometry instances;
+  size_t first = primitives.size();
+  collect_primitives(object, primitives, refs, linear_materials, linear_textures, linear_perlin, image_buffer,
+                     mat_map, tex_map, instanced ? &instances : nullptr, CumTransform());
+  for (size_t k = first; k < primitives.size(); k++) {
+    if (primitives[k].type == PrimitiveType::INSTANCE) primitives[k].instance.blas_root = -1;
+  }
+}
+
+void update_flattened_primitives(std::shared_ptr<hittable> node, const std::vector<int>& primitive_sources,
+                                 std::vector<PrimitiveGPU>& linear_primitives,
+                                 std::vector<MaterialGPU>& linear_materials, std::vector<TextureGPU>& linear_textures,
+                                 std::vector<PerlinDataGPU>& linear_perlin, std::vector<unsigned char>& image_buffer,
+                                 std::unordered_map<material*, int>& mat_map,
+                                 std::unordered_map<texture*, int>& tex_map) {
+  // Materials and textures are already in the maps, so this only re-reads
+  // geometry
+  std::vector<PrimitiveGPU> primitives;
+  collect_flattened_primitives(node, primitives, linear_materials, linear_textures, linear_perlin, image_buffer,
+                               mat_map, tex_map);
+  size_t first = linear_primitives.size() - primitive_sources.size();
+  for (size_t k = 0; k < primitive_sources.size(); k++) {
+    PrimitiveGPU& prim = linear_primitives[first + k];
+    // Instances collect with their tree's index, not where the build put it
+    int blas_root = prim.instance.blas_root;
+    prim = primitives[primitive_sources[k]];
+    if (prim.type == PrimitiveType::INSTANCE) prim.instance.blas_root = blas_root;
+  }
+}
+
+void collect_primitives(std::shared_ptr<hittable> node, std::vector<PrimitiveGPU>& primitives,
+                        std::vector<primitive_ref>& refs, std::vector<MaterialGPU>& linear_materials,
+                        std::vector<TextureGPU>& linear_textures, std::vector<PerlinDataGPU>& linear_perlin,
+                        std::vector<unsigned char>& image_buffer, std::unordered_map<material*, int>& mat_map,
+                        std::unordered_map<texture*, int>& tex_map, instance_geometry* instances,
+                        CumTransform current_trans) {
+
+  // A transformed subtree is collected once, in its own space, for every
+  // instance of it to share. Inside it transforms are baked in, so instances
+  // are only one level deep.
+  if (instances && !current_trans.is_identity() &&
+      (dynamic_cast<hittable_list*>(node.get()) || dynamic_cast<bvh_node*>(node.get()))) {
+    auto [it, added] = instances->blas_ids.try_emplace(node.get(), int(instances->blases.size()));
+    if (added) {
+      instance_geometry::blas blas;
+      collect_primitives(node, blas.primitives, blas.refs, linear_materials, linear_textures, linear_perlin,
+                         image_buffer, mat_map, tex_map, nullptr, CumTransform());
+      instances->blases.push_back(std::move(blas));
+    }
+    const instance_geometry::blas& blas = instances->blases[it->second];
+    if (blas.refs.empty()) return;
+
+    aabb object_bounds = aabb::empty;
+    for (const primitive_ref& ref : blas.refs) object_bounds = aabb(object_bounds, ref.bounds);
+    PrimitiveGPU prim = blank_primitive();
+    prim.type = PrimitiveType::INSTANCE;
+    current_trans.set_instance_transform(prim);
+    prim.instance.blas_root = it->second; // flatten_with swaps in the node index once the tree is built
+    aabb bounds = instance_bounds(prim, object_bounds);
+    point3 centroid = 0.5 * (point3(bounds.x.min, bounds.y.min, bounds.z.min) +
+                             point3(bounds.x.max, bounds.y.max, bounds.z.max));
+    refs.push_back({bounds, centroid, int(primitives.size())});
+    primitives.push_back(prim);
+    return;
+  }
 
   // Process Pass-through Wrappers
   if (auto t_node = dynamic_cast<translate*>(node.get())) {
     current_trans.apply_translate(t_node->offset);
-    return flatten_hittable_internal(t_node->object, linear_nodes, linear_primitives, linear_materials, linear_textures,
-                                     linear_perlin, image_buffer, mat_map, tex_map, current_trans);
+    collect_primitives(t_node->object, primitives, refs, linear_materials, linear_textures, linear_perlin,
+                       image_buffer, mat_map, tex_map, instances, current_trans);
+    return;
   }
   if (auto r_node = dynamic_cast<rotate_y*>(node.get())) {
     // Note, rotate_y stores sin_theta and cos_theta. We can just derive angle
@@ -200,202 +436,161 @@ int flatten_hittable_internal(std::shared_ptr<hittable> node, std::vector<Linear
     // atan2 for safety.
     double angle = std::atan2(r_node->sin_theta, r_node->cos_theta) * 180.0 / 3.1415926535897932385;
     current_trans.apply_rotate_y(angle);
-    return flatten_hittable_internal(r_node->object, linear_nodes, linear_primitives, linear_materials, linear_textures,
-                                     linear_perlin, image_buffer, mat_map, tex_map, current_trans);
+    collect_primitives(r_node->object, primitives, refs, linear_materials, linear_textures, linear_perlin,
+                       image_buffer, mat_map, tex_map, instances, current_trans);
+    return;
   }
   if (auto hl = dynamic_cast<hittable_list*>(node.get())) {
-    auto bvh_wrap = std::make_shared<bvh_node>(*hl);
-    return flatten_hittable_internal(bvh_wrap, linear_nodes, linear_primitives, linear_materials, linear_textures,
-                                     linear_perlin, image_buffer, mat_map, tex_map, current_trans);
+    for (const auto& object : hl->objects) {
+      collect_primitives(object, primitives, refs, linear_materials, linear_textures, linear_perlin, image_buffer,
+                         mat_map, tex_map, instances, current_trans);
+    }
+    return;
   }
-
-  // Handle actual primitives & BVH
   if (auto bvh = dynamic_cast<bvh_node*>(node.get())) {
-    if (bvh->left() == bvh->right()) {
-      return flatten_hittable_internal(bvh->left(), linear_nodes, linear_primitives, linear_materials, linear_textures,
-                                       linear_perlin, image_buffer, mat_map, tex_map, current_trans);
+    collect_primitives(bvh->left(), primitives, refs, linear_materials, linear_textures, linear_perlin, image_buffer,
+                       mat_map, tex_map, instances, current_trans);
+    if (bvh->right() != bvh->left()) {
+      collect_primitives(bvh->right(), primitives, refs, linear_materials, linear_textures, linear_perlin,
+                         image_buffer, mat_map, tex_map, instances, current_trans);
     }
+    return;
+  }
 
-    int curr_idx = linear_nodes.size();
-    linear_nodes.emplace_back();
-
-    flatten_hittable_internal(bvh->left(), linear_nodes, linear_primitives, linear_materials, linear_textures,
-                              linear_perlin, image_buffer, mat_map, tex_map, current_trans);
+  // Handle actual primitives
+  PrimitiveGPU prim = blank_primitive();
 
-    int right_offset =
-        flatten_hittable_internal(bvh->right(), linear_nodes, linear_primitives, linear_materials, linear_textures,
-                                  linear_perlin, image_buffer, mat_map, tex_map, current_trans);
+  if (auto c_med = dynamic_cast<constant_medium*>(node.get())) {
+    // Volume: Extract boundary.
+    // We look at the immediate boundary to see if it's a sphere or
+    // translated/rotated hittable_list (box)
+    std::shared_ptr<hittable> unwrap = c_med->boundary;
+    CumTransform vol_trans = current_trans;
 
-    aabb box = current_trans.transform_bbox(bvh->bounding_box());
-    double delta = 0.0001;
-    if (box.x.max - box.x.min < delta) {
-      box.x.min -= delta / 2.0;
-      box.x.max += delta / 2.0;
-    }
-    if (box.y.max - box.y.min < delta) {
-      box.y.min -= delta / 2.0;
-      box.y.max += delta / 2.0;
+    while (auto t = dynamic_cast<translate*>(unwrap.get())) {
+      vol_trans.apply_translate(t->offset);
+      unwrap = t->object;
     }
-    if (box.z.max - box.z.min < delta) {
-      box.z.min -= delta / 2.0;
-      box.z.max += delta / 2.0;
-    }
-    linear_nodes[curr_idx].aabb_min = Vec3f{float(box.x.min), float(box.y.min), float(box.z.min)};
-    linear_nodes[curr_idx].aabb_max = Vec3f{float(box.x.max), float(box.y.max), float(box.z.max)};
-    linear_nodes[curr_idx].n_primitives = 0;
-    linear_nodes[curr_idx].second_child_offset = right_offset;
-
-    return curr_idx;
-
-  } else {
-    int curr_idx = linear_nodes.size();
-    linear_nodes.emplace_back();
-
-    int prim_idx = linear_primitives.size();
-    PrimitiveGPU prim;
-
-    if (auto c_med = dynamic_cast<constant_medium*>(node.get())) {
-      // Volume: Extract boundary.
-      // We look at the immediate boundary to see if it's a sphere or
-      // translated/rotated hittable_list (box)
-      std::shared_ptr<hittable> unwrap = c_med->boundary;
-      CumTransform vol_trans = current_trans;
-
-      while (auto t = dynamic_cast<translate*>(unwrap.get())) {
+    // Note rotate_y wrapper could be inside or outside.
+    // Actually simply using dynamic_cast iteratively.
+    bool drilling = true;
+    while (drilling) {
+      if (auto t = dynamic_cast<translate*>(unwrap.get())) {
         vol_trans.apply_translate(t->offset);
         unwrap = t->object;
-      }
-      // Note rotate_y wrapper could be inside or outside.
-      // Actually simply using dynamic_cast iteratively.
-      bool drilling = true;
-      while (drilling) {
-        if (auto t = dynamic_cast<translate*>(unwrap.get())) {
-          vol_trans.apply_translate(t->offset);
-          unwrap = t->object;
-        } else if (auto r = dynamic_cast<rotate_y*>(unwrap.get())) {
-          double angle = std::atan2(r->sin_theta, r->cos_theta) * 180.0 / 3.1415926535897932385;
-          vol_trans.apply_rotate_y(angle);
-          unwrap = r->object;
-        } else {
-          drilling = false;
-        }
-      }
-
-      if (auto sph = dynamic_cast<sphere*>(unwrap.get())) {
-        prim.type = PrimitiveType::VOLUME_SPHERE;
-        prim.volume_sphere.center = to_vec3f(vol_trans.apply(sph->get_center().origin()));
-        prim.volume_sphere.radius = static_cast<float>(sph->get_radius());
-        prim.volume_sphere.neg_inv_density = static_cast<float>(c_med->neg_inv_density);
-      } else if (auto hl = dynamic_cast<hittable_list*>(unwrap.get())) {
-        // Box: Find local AABB.
-        prim.type = PrimitiveType::VOLUME_BOX;
-        aabb local_box = hl->bounding_box();
-        prim.volume_box.local_min = to_vec3f(vec3(local_box.x.min, local_box.y.min, local_box.z.min));
-        prim.volume_box.local_max = to_vec3f(vec3(local_box.x.max, local_box.y.max, local_box.z.max));
-        prim.volume_box.offset = to_vec3f(vol_trans.offset);
-        prim.volume_box.sin_theta = static_cast<float>(vol_trans.sin_t);
-        prim.volume_box.cos_theta = static_cast<float>(vol_trans.cos_t);
-        prim.volume_box.neg_inv_density = static_cast<float>(c_med->neg_inv_density);
-      }
-
-      prim.material_id = get_or_add_material(c_med->phase_function, linear_materials, linear_textures, linear_perlin,
-                                             image_buffer, mat_map, tex_map);
-
-    } else if (auto sphere_ptr = dynamic_cast<sphere*>(node.get())) {
-      vec3 dist_vec = sphere_ptr->get_center().direction();
-      if (dist_vec.length_squared() > 1e-8) {
-        prim.type = PrimitiveType::MOVING_SPHERE;
-        // The start and vec map over time in World Space natively!
-        prim.moving_sphere.center_start = to_vec3f(current_trans.apply(sphere_ptr->get_center().origin()));
-        prim.moving_sphere.center_vec = to_vec3f(current_trans.apply_vec(dist_vec));
-        prim.moving_sphere.radius = static_cast<float>(sphere_ptr->get_radius());
+      } else if (auto r = dynamic_cast<rotate_y*>(unwrap.get())) {
+        double angle = std::atan2(r->sin_theta, r->cos_theta) * 180.0 / 3.1415926535897932385;
+        vol_trans.apply_rotate_y(angle);
+        unwrap = r->object;
       } else {
-        prim.type = PrimitiveType::SPHERE;
-        prim.sphere.center = to_vec3f(current_trans.apply(sphere_ptr->get_center().origin()));
-        prim.sphere.radius = static_cast<float>(sphere_ptr->get_radius());
+        drilling = false;
       }
-
-      prim.material_id = get_or_add_material(sphere_ptr->get_material(), linear_materials, linear_textures,
-                                             linear_perlin, image_buffer, mat_map, tex_map);
-
-    } else if (auto quad_ptr = dynamic_cast<quad*>(node.get())) {
-      prim.type = PrimitiveType::QUAD;
-      prim.quad.Q = to_vec3f(current_trans.apply(quad_ptr->Q));
-      prim.quad.u = to_vec3f(current_trans.apply_vec(quad_ptr->u));
-      prim.quad.v = to_vec3f(current_trans.apply_vec(quad_ptr->v));
-
-      [[maybe_unused]] vec3 w = quad_ptr->w;
-      [[maybe_unused]] vec3 n = quad_ptr->normal;
-
-      // recalculate w and normal properly in world space!
-      vec3 u_w = current_trans.apply_vec(quad_ptr->u);
-      vec3 v_w = current_trans.apply_vec(quad_ptr->v);
-      vec3 n_w = cross(u_w, v_w);
-      vec3 normal_w = unit_vector(n_w);
-      point3 Q_w = current_trans.apply(quad_ptr->Q);
-      float D_w = dot(normal_w, Q_w);
-      vec3 w_new = n_w / dot(n_w, n_w);
-
-      prim.quad.w = to_vec3f(w_new);
-      prim.quad.normal = to_vec3f(normal_w);
-      prim.quad.D = D_w;
-
-      prim.material_id = get_or_add_material(quad_ptr->mat, linear_materials, linear_textures, linear_perlin,
-                                             image_buffer, mat_map, tex_map);
-    } else if (auto m_quad_ptr = dynamic_cast<moving_quad*>(node.get())) {
-      prim.type = PrimitiveType::MOVING_QUAD;
-
-      // Interpolate Q and D in world space
-      point3 Q1_w = current_trans.apply(m_quad_ptr->Q1);
-      point3 Q2_w = current_trans.apply(m_quad_ptr->Q2);
-      prim.moving_quad.Q_start = to_vec3f(Q1_w);
-      prim.moving_quad.Q_vec = to_vec3f(Q2_w - Q1_w);
-
-      vec3 u_w = current_trans.apply_vec(m_quad_ptr->u);
-      vec3 v_w = current_trans.apply_vec(m_quad_ptr->v);
-      vec3 n_w = cross(u_w, v_w);
-      vec3 normal_w = unit_vector(n_w);
-
-      prim.moving_quad.u = to_vec3f(u_w);
-      prim.moving_quad.v = to_vec3f(v_w);
-      prim.moving_quad.w = to_vec3f(n_w / dot(n_w, n_w));
-      prim.moving_quad.normal = to_vec3f(normal_w);
-
-      float D1_w = dot(normal_w, Q1_w);
-      float D2_w = dot(normal_w, Q2_w);
-      prim.moving_quad.D_start = D1_w;
-      prim.moving_quad.D_vec = D2_w - D1_w;
-
-      prim.material_id = get_or_add_material(m_quad_ptr->mat, linear_materials, linear_textures, linear_perlin,
-                                             image_buffer, mat_map, tex_map);
     }
 
-    // Set AABB in World space using transform_bbox
-    aabb box = current_trans.transform_bbox(node->bounding_box());
-
-    // Pad zero-thickness AABBs to prevent GPU traversal misses
-    double delta = 0.0001;
-    if (box.x.max - box.x.min < delta) {
-      box.x.min -= delta / 2.0;
-      box.x.max += delta / 2.0;
-    }
-    if (box.y.max - box.y.min < delta) {
-      box.y.min -= delta / 2.0;
-      box.y.max += delta / 2.0;
-    }
-    if (box.z.max - box.z.min < delta) {
-      box.z.min -= delta / 2.0;
-      box.z.max += delta / 2.0;
+    if (auto sph = dynamic_cast<sphere*>(unwrap.get())) {
+      prim.type = PrimitiveType::VOLUME_SPHERE;
+      prim.volume_sphere.center = to_vec3f(vol_trans.apply(sph->get_center().origin()));
+      prim.volume_sphere.radius = static_cast<float>(sph->get_radius());
+      prim.volume_sphere.neg_inv_density = static_cast<float>(c_med->neg_inv_density);
+    } else if (auto hl = dynamic_cast<hittable_list*>(unwrap.get())) {
+      // Box: Find local AABB.
+      prim.type = PrimitiveType::VOLUME_BOX;
+      aabb local_box = hl->bounding_box();
+      prim.volume_box.local_min = to_vec3f(vec3(local_box.x.min, local_box.y.min, local_box.z.min));
+      prim.volume_box.local_max = to_vec3f(vec3(local_box.x.max, local_box.y.max, local_box.z.max));
+      prim.volume_box.offset = to_vec3f(vol_trans.offset);
+      prim.volume_box.sin_theta = static_cast<float>(vol_trans.sin_t);
+      prim.volume_box.cos_theta = static_cast<float>(vol_trans.cos_t);
+      prim.volume_box.neg_inv_density = static_cast<float>(c_med->neg_inv_density);
     }
 
-    linear_nodes[curr_idx].aabb_min = to_vec3f(vec3{box.x.min, box.y.min, box.z.min});
-    linear_nodes[curr_idx].aabb_max = to_vec3f(vec3{box.x.max, box.y.max, box.z.max});
+    prim.material_id = get_or_add_material(c_med->phase_function, linear_materials, linear_textures, linear_perlin,
+                                           image_buffer, mat_map, tex_map);
+
+  } else if (auto sphere_ptr = dynamic_cast<sphere*>(node.get())) {
+    vec3 dist_vec = sphere_ptr->get_center().direction();
+    if (dist_vec.length_squared() > 1e-8) {
+      prim.type = PrimitiveType::MOVING_SPHERE;
+      // The start and vec map over time in World Space natively!
+      prim.moving_sphere.center_start = to_vec3f(current_trans.apply(sphere_ptr->get_center().origin()));
+      prim.moving_sphere.center_vec = to_vec3f(current_trans.apply_vec(dist_vec));
+      prim.moving_sphere.radius = static_cast<float>(sphere_ptr->get_radius());
+    } else {
+      prim.type = PrimitiveType::SPHERE;
+      prim.sphere.center = to_vec3f(current_trans.apply(sphere_ptr->get_center().origin()));
+      prim.sphere.radius = static_cast<float>(sphere_ptr->get_radius());
+    }
 
-    linear_primitives.push_back(prim);
+    prim.material_id = get_or_add_material(sphere_ptr->get_material(), linear_materials, linear_textures,
+                                           linear_perlin, image_buffer, mat_map, tex_map);
+
+  } else if (auto quad_ptr = dynamic_cast<quad*>(node.get())) {
+    prim.type = PrimitiveType::QUAD;
+    prim.quad.Q = to_vec3f(current_trans.apply(quad_ptr->Q));
+    prim.quad.u = to_vec3f(current_trans.apply_vec(quad_ptr->u));
+    prim.quad.v = to_vec3f(current_trans.apply_vec(quad_ptr->v));
+
+    [[maybe_unused]] vec3 w = quad_ptr->w;
+    [[maybe_unused]] vec3 n = quad_ptr->normal;
+
+    // recalculate w and normal properly in world space!
+    vec3 u_w = current_trans.apply_vec(quad_ptr->u);
+    vec3 v_w = current_trans.apply_vec(quad_ptr->v);
+    vec3 n_w = cross(u_w, v_w);
+    vec3 normal_w = unit_vector(n_w);
+    point3 Q_w = current_trans.apply(quad_ptr->Q);
+    float D_w = dot(normal_w, Q_w);
+    vec3 w_new = n_w / dot(n_w, n_w);
+
+    prim.quad.w = to_vec3f(w_new);
+    prim.quad.normal = to_vec3f(normal_w);
+    prim.quad.D = D_w;
+
+    prim.material_id = get_or_add_material(quad_ptr->mat, linear_materials, linear_textures, linear_perlin,
+                                           image_buffer, mat_map, tex_map);
+  } else if (auto m_quad_ptr = dynamic_cast<moving_quad*>(node.get())) {
+    prim.type = PrimitiveType::MOVING_QUAD;
+
+    // Interpolate Q and D in world space
+    point3 Q1_w = current_trans.apply(m_quad_ptr->Q1);
+    point3 Q2_w = current_trans.apply(m_quad_ptr->Q2);
+    prim.moving_quad.Q_start = to_vec3f(Q1_w);
+    prim.moving_quad.Q_vec = to_vec3f(Q2_w - Q1_w);
+
+    vec3 u_w = current_trans.apply_vec(m_quad_ptr->u);
+    vec3 v_w = current_trans.apply_vec(m_quad_ptr->v);
+    vec3 n_w = cross(u_w, v_w);
+    vec3 normal_w = unit_vector(n_w);
+
+    prim.moving_quad.u = to_vec3f(u_w);
+    prim.moving_quad.v = to_vec3f(v_w);
+    prim.moving_quad.w = to_vec3f(n_w / dot(n_w, n_w));
+    prim.moving_quad.normal = to_vec3f(normal_w);
+
+    float D1_w = dot(normal_w, Q1_w);
+    float D2_w = dot(normal_w, Q2_w);
+    prim.moving_quad.D_start = D1_w;
+    prim.moving_quad.D_vec = D2_w - D1_w;
+
+    prim.material_id = get_or_add_material(m_quad_ptr->mat, linear_materials, linear_textures, linear_perlin,
+                                           image_buffer, mat_map, tex_map);
+  }
 
-    linear_nodes[curr_idx].n_primitives = 1;
-    linear_nodes[curr_idx].primitive_offset = prim_idx;
+  // World-space bounds for the builder
+  aabb bounds = current_trans.transform_bbox(node->bounding_box());
+  point3 centroid = 0.5 * (point3(bounds.x.min, bounds.y.min, bounds.z.min) +
+                           point3(bounds.x.max, bounds.y.max, bounds.z.max));
+  refs.push_back({bounds, centroid, int(primitives.size())});
+  primitives.push_back(prim);
+}
 
-    return curr_idx;
+std::vector<int> build_escape_links(cuda::span<const LinearBVHNode> nodes) {
+  // Every subtree occupies a contiguous range ending with its right child's
+  // range, so a node's escape is the end of its right child's. Children come
+  // after their parent, so one backwards sweep resolves every node.
+  std::vector<int> escape_links(nodes.size());
+  for (int i = int(nodes.size()) - 1; i >= 0; i--) {
+    escape_links[i] = nodes[i].n_primitives > 0 ? i + 1 : escape_links[nodes[i].second_child_offset];
   }
+  return escape_links;
 }
@@ -1,22 +1,83 @@
+#include "thread_pool.hpp"
 #include "vulkan_app.hpp"
+#include <cstdlib>
 #include <iostream>
 #include <string>
 #include <vector>
 
 int main(int argc, char* argv[]) {
   bool headless = false;
+  bool benchmark = false;
+  bool benchmark_all_scenes = false;
+  bool bvh_report = false;
+  bool bvh_report_all_scenes = false;
+  bool bvh_edit_check = false;
+  BvhBuildMode bvh_build_mode = BvhBuildMode::SAH;
+  std::string bvh_cache_dir;
 
   // Simple argument parsing
   for (int i = 1; i < argc; ++i) {
     std::string arg = argv[i];
     if (arg == "--headless") {
       headless = true;
+    } else if (arg == "--threads" && i + 1 < argc) {
+      // CPU worker threads; defaults to one per hardware thread
+      thread_pool::global().resize(std::atoi(argv[++i]));
+    } else if (arg == "--bvh" && i + 1 < argc) {
+      // BVH builder: sah (default), lbvh, lbvh-treelet or sbvh
+      std::string mode = argv[++i];
+      if (mode == "sah") {
+        bvh_build_mode = BvhBuildMode::SAH;
+      } else if (mode == "lbvh") {
+        bvh_build_mode = BvhBuildMode::LBVH;
+      } else if (mode == "lbvh-treelet") {
+        bvh_build_mode = BvhBuildMode::LBVH_TREELET;
+      } else if (mode == "sbvh") {
+        bvh_build_mode = BvhBuildMode::SBVH;
+      } else {
+        std::cerr << "Unknown BVH builder '" << mode << "' (expected sah, lbvh, lbvh-treelet or sbvh)" << std::endl;
+        return EXIT_FAILURE;
+      }
+    } else if (arg == "--bvh-cache" && i + 1 < argc) {
+      // Directory to cache built BVHs in, loaded instead of rebuilding when the scene and builder match
+      bvh_cache_dir = argv[++i];
+    } else if (arg == "--bench") {
+      // CPU rays/sec on the default scene; needs no window
+      headless = true;
+      benchmark = true;
+    } else if (arg == "--bench-scenes") {
+      // The same, on every built-in scene in turn
+      headless = true;
+      benchmark = true;
+      benchmark_all_scenes = true;
+    } else if (arg == "--bvh-report") {
+      // BVH metrics of the default scene with every builder; needs no window
+      headless = true;
+      bvh_report = true;
+    } else if (arg == "--bvh-report-scenes") {
+      // The same, on every built-in scene in turn
+      headless = true;
+      bvh_report = true;
+      bvh_report_all_scenes = true;
+    } else if (arg == "--bvh-edit-check") {
+      // Edits the default scene with every builder and checks each patched
+      // BVH against a fresh build; fails if any ray hits differently
+      headless = true;
+      bvh_edit_check = true;
     }
   }
 
   try {
-    VulkanApp app(headless);
-    app.run();
+    VulkanApp app(headless, bvh_build_mode, bvh_cache_dir);
+    if (benchmark) {
+      app.run_benchmark(benchmark_all_scenes);
+    } else if (bvh_report) {
+      app.run_bvh_report(bvh_report_all_scenes);
+    } else if (bvh_edit_check) {
+      if (app.run_bvh_edit_check() > 0) return EXIT_FAILURE;
+    } else {
+      app.run();
+    }
   } catch (const std::exception& e) {
     std::cerr << "CRITICAL ERROR: " << e.what() << std::endl;
     return EXIT_FAILURE;
@@ -9,6 +9,7 @@
 #include "rt.hpp"
 #include "sphere.hpp"
 #include "texture.hpp"
+#include "thread_pool.hpp"
 #include "vulkan_app.hpp"
 
 #include <algorithm>
@@ -20,15 +21,19 @@
 #include <map>
 #include <set>
 #include <stdexcept>
+#include <string>
+#include <thread>
 #include <unordered_map>
+#include <utility>
 
 #include <cuda_profiler_api.h>
 #include <cuda_runtime.h>
 #include <unistd.h>
 
-extern "C" void launch_render(RenderConfig config, cuda::span<LinearBVHNode> h_bvh, cuda::span<PrimitiveGPU> h_prims,
-                              cuda::span<MaterialGPU> h_mats, cuda::span<TextureGPU> h_texs,
-                              cuda::span<PerlinDataGPU> h_perlin, cuda::span<unsigned char> h_images);
+extern "C" void launch_render(RenderConfig config, cuda::span<LinearBVHNode> h_bvh, cuda::span<int> h_escape_links,
+                              cuda::span<PrimitiveGPU> h_prims, cuda::span<MaterialGPU> h_mats,
+                              cuda::span<TextureGPU> h_texs, cuda::span<PerlinDataGPU> h_perlin,
+                              cuda::span<unsigned char> h_images);
 
 extern "C" void* import_vulkan_memory(int fd, size_t size);
 extern "C" void cleanup_cuda_interop();
@@ -48,7 +53,9 @@ uint32_t VulkanApp::find_memory_type(uint32_t typeFilter, VkMemoryPropertyFlags
   throw std::runtime_error("failed to find suitable memory type!");
 }
 
-VulkanApp::VulkanApp(bool headless) : headless_(headless) {
+VulkanApp::VulkanApp(bool headless, BvhBuildMode bvh_build_mode, const std::string& bvh_cache_dir)
+    : headless_(headless), bvh_build_mode_(bvh_build_mode) {
+  if (!bvh_cache_dir.empty()) bvh_cache_.emplace(bvh_cache_dir);
   if (!headless_) {
     init_window();
     init_vulkan();
@@ -161,6 +168,8 @@ void VulkanApp::draw_frame() {
       config.focus_dist = focus_distance_;
 
       cuda::span<LinearBVHNode> bvh = {gpu_bvh_nodes_.data(), gpu_bvh_nodes_.size()};
+      cuda::span<int> escape;
+      if (gpu_stackless_traversal_) escape = {gpu_escape_links_.data(), gpu_escape_links_.size()};
       cuda::span<PrimitiveGPU> p_buf = {gpu_primitives_.data(), gpu_primitives_.size()};
       cuda::span<MaterialGPU> m_buf = {gpu_materials_.data(), gpu_materials_.size()};
       cuda::span<TextureGPU> t_buf = {gpu_textures_.data(), gpu_textures_.size()};
@@ -168,7 +177,7 @@ void VulkanApp::draw_frame() {
       cuda::span<unsigned char> i_buf = {gpu_image_buffer_.data(), gpu_image_buffer_.size()};
 
       if (cuda_interop_pointer_) {
-        launch_render(config, bvh, p_buf, m_buf, t_buf, per_buf, i_buf);
+        launch_render(config, bvh, escape, p_buf, m_buf, t_buf, per_buf, i_buf);
         cudaDeviceSynchronize();
       }
 
@@ -198,12 +207,14 @@ void VulkanApp::draw_frame() {
       render_time_ = std::chrono::duration<float>(end - start).count();
       is_rendering_ = false;
     } else {
-      if (cpu_render_thread_.joinable()) cpu_render_thread_.join();
+      if (cpu_render_task_.valid()) cpu_render_task_.wait();
       auto start = std::chrono::high_resolution_clock::now();
-      cpu_render_thread_ = std::thread([this, start]() {
+      cpu_render_task_ = thread_pool::global().submit([this, start]() {
         setup_camera();
-        cam_.render_to_buffer_with_progress(world_, cpu_render_buffer_, cpu_buffer_mutex_, render_progress_,
-                                            should_stop_render_, texture_needs_update_);
+        const hittable& scene = (cpu_use_flat_bvh_ && cpu_scene_) ? static_cast<const hittable&>(*cpu_scene_)
+                                                                  : static_cast<const hittable&>(world_);
+        cam_.render_to_buffer_with_progress(scene, cpu_framebuffer_, render_progress_, should_stop_render_,
+                                            texture_needs_update_);
         auto end = std::chrono::high_resolution_clock::now();
         render_time_ = std::chrono::duration<float>(end - start).count();
         is_rendering_ = false;
@@ -214,15 +225,15 @@ void VulkanApp::draw_frame() {
   if (texture_needs_update_) {
     texture_needs_update_ = false;
     std::vector<float> float_buffer(current_width_ * current_height_ * 4);
-    {
-      std::lock_guard<std::mutex> lock(cpu_buffer_mutex_);
-      if (cpu_render_buffer_.size() >= (size_t)current_width_ * current_height_ * 3) {
-        for (int i = 0; i < current_width_ * current_height_; i++) {
-          float_buffer[i * 4 + 0] = cpu_render_buffer_[i * 3 + 0] / 255.0f;
-          float_buffer[i * 4 + 1] = cpu_render_buffer_[i * 3 + 1] / 255.0f;
-          float_buffer[i * 4 + 2] = cpu_render_buffer_[i * 3 + 2] / 255.0f;
-          float_buffer[i * 4 + 3] = 1.0f;
-        }
+    // Snapshotting never blocks the render workers; tiles still being written
+    // are retried rather than locked
+    cpu_framebuffer_.snapshot(cpu_render_buffer_);
+    if (cpu_render_buffer_.size() >= (size_t)current_width_ * current_height_ * 3) {
+      for (int i = 0; i < current_width_ * current_height_; i++) {
+        float_buffer[i * 4 + 0] = cpu_render_buffer_[i * 3 + 0] / 255.0f;
+        float_buffer[i * 4 + 1] = cpu_render_buffer_[i * 3 + 1] / 255.0f;
+        float_buffer[i * 4 + 2] = cpu_render_buffer_[i * 3 + 2] / 255.0f;
+        float_buffer[i * 4 + 3] = 1.0f;
       }
     }
     if (cuda_interop_pointer_) {
@@ -263,6 +274,7 @@ void VulkanApp::draw_frame() {
   ImGui::Begin("Raytracer Controls", nullptr, ImGuiWindowFlags_AlwaysAutoResize);
   if (ImGui::CollapsingHeader("Rendering Options", ImGuiTreeNodeFlags_DefaultOpen)) {
     ImGui::Checkbox("Use GPU Acceleration (CUDA)", &use_gpu_render_);
+    ImGui::Checkbox("GPU: Stackless Traversal", &gpu_stackless_traversal_);
     const char* scenes[] = {"Static", "Motion Blur", "Checkered",     "Earth",       "Perlin",         "Quad",
                             "Light",  "Cornell Box", "Cornell Smoke", "Final Scene", "Custom Showcase"};
     int s_idx = (int)scene_type_;
@@ -272,8 +284,77 @@ void VulkanApp::draw_frame() {
     }
     ImGui::ColorEdit3("Background", background_color_);
     ImGui::SliderInt("Samples", &samples_per_pixel_, 1, 10000);
+    ImGui::SliderInt("Samples / Pass", &samples_per_pass_, 1, 64);
+    ImGui::Checkbox("Adaptive Sampling", &adaptive_sampling_);
+    if (adaptive_sampling_) {
+      ImGui::SliderFloat("Rel. Error", &adaptive_threshold_, 0.001f, 0.2f, "%.3f", ImGuiSliderFlags_Logarithmic);
+      ImGui::SliderInt("Min Samples", &adaptive_min_samples_, 2, 256);
+      ImGui::SliderInt("Max Samples", &adaptive_max_samples_, 16, 16384);
+    }
     ImGui::SliderInt("Max Depth", &max_depth_, 1, 50);
+    if (ImGui::TreeNode("Bounce Budgets (0 = Max Depth)")) {
+      ImGui::SliderInt("Diffuse", &max_diffuse_depth_, 0, 50);
+      ImGui::SliderInt("Specular", &max_specular_depth_, 0, 50);
+      ImGui::SliderInt("Volume", &max_volume_depth_, 0, 50);
+      ImGui::SliderInt("Roulette After", &russian_roulette_depth_, 1, 50);
+      ImGui::TreePop();
+    }
     ImGui::SliderInt("Image Width", &image_width_, 100, 1600);
+    ImGui::SliderInt("Tile Size", &tile_size_, 4, 128);
+    const char* tile_orders[] = {"Scanline", "Morton", "Hilbert"};
+    int t_idx = (int)tile_order_;
+    if (ImGui::Combo("Tile Order", &t_idx, tile_orders, IM_ARRAYSIZE(tile_orders))) {
+      tile_order_ = (TileOrder)t_idx;
+    }
+    const char* pipelines[] = {"Megakernel", "Wavefront"};
+    int p_idx = (int)cpu_pipeline_;
+    if (ImGui::Combo("CPU Pipeline", &p_idx, pipelines, IM_ARRAYSIZE(pipelines))) {
+      cpu_pipeline_ = (CpuPipeline)p_idx;
+    }
+    if (ImGui::Checkbox("CPU: Flat BVH", &cpu_use_flat_bvh_)) cam_.reset_accumulation();
+    // The pool can only be resized, and the BVH rebuilt, while no render uses them
+    ImGui::BeginDisabled(is_rendering_);
+    const char* bvh_builders[] = {"SAH (binned)", "LBVH (Morton)", "LBVH + Treelets", "SBVH (spatial splits)"};
+    int b_idx = (int)bvh_build_mode_;
+    if (ImGui::Combo("BVH Builder", &b_idx, bvh_builders, IM_ARRAYSIZE(bvh_builders))) {
+      bvh_build_mode_ = (BvhBuildMode)b_idx;
+      build_scene_bvh();
+    }
+    const char* bvh_layouts[] = {"Binary", "BVH4 (SIMD)", "BVH8 (SIMD)", "BVH4 (quantized)", "Binary (stackless)"};
+    int l_idx = (int)cpu_bvh_layout_;
+    if (ImGui::Combo("CPU BVH Layout", &l_idx, bvh_layouts, IM_ARRAYSIZE(bvh_layouts))) {
+      cpu_bvh_layout_ = (BvhLayout)l_idx;
+      cpu_scene_->set_layout(cpu_bvh_layout_);
+    }
+    if (ImGui::Checkbox("CPU: Treelet Node Order", &cpu_treelet_order_)) {
+      cpu_scene_->set_treelet_order(cpu_treelet_order_);
+    }
+    if (!animated_objects_.empty()) {
+      // Moves the objects and refits the BVH, rebuilding it only when refitting has degraded it too far
+      ImGui::SliderFloat("Animation Time", &animation_time_, 0.0f, 1.0f);
+      if (ImGui::IsItemEdited()) animate_scene();
+    }
+    if (ImGui::TreeNode("Edit Scene")) {
+      // Patches the BVH in place rather than rebuilding it
+      if (ImGui::Button("Add Sphere")) {
+        point3 target(camera_target_[0], camera_target_[1], camera_target_[2]);
+        double size = (point3(camera_pos_[0], camera_pos_[1], camera_pos_[2]) - target).length();
+        point3 center = target + 0.3 * size * vec3(random_double(-1, 1), random_double(0, 1), random_double(-1, 1));
+        added_objects_.push_back(add_object(
+            std::make_shared<sphere>(center, 0.03 * size, std::make_shared<lambertian>(color::random()))));
+      }
+      ImGui::SameLine();
+      ImGui::BeginDisabled(added_objects_.empty());
+      if (ImGui::Button("Remove Last Added")) {
+        remove_object(added_objects_.back());
+        added_objects_.pop_back();
+      }
+      ImGui::EndDisabled();
+      ImGui::TreePop();
+    }
+    ImGui::SliderInt("CPU Threads", &cpu_threads_, 1, std::max(2, 2 * int(std::thread::hardware_concurrency())));
+    if (ImGui::IsItemDeactivatedAfterEdit()) thread_pool::global().resize(cpu_threads_);
+    ImGui::EndDisabled();
   }
   if (ImGui::CollapsingHeader("Camera", ImGuiTreeNodeFlags_DefaultOpen)) {
     ImGui::SliderFloat("FOV", &camera_fov_, 10.0f, 120.0f);
@@ -282,6 +363,26 @@ void VulkanApp::draw_frame() {
     ImGui::SliderFloat3("Position", camera_pos_, -20.0f, 20.0f);
     ImGui::SliderFloat3("Target", camera_target_, -20.0f, 20.0f);
   }
+  if (ImGui::CollapsingHeader("BVH Inspector")) {
+    const bvh_metrics& m = bvh_metrics_;
+    ImGui::Text("Nodes: %d (%d leaves)", m.node_count, m.leaf_count);
+    ImGui::Text("Primitive refs: %d", m.primitive_refs);
+    if (m.instance_count > 0) {
+      ImGui::Text("Instance refs: %d to %d bottom-level trees", m.instance_count, m.bottom_level_trees);
+    }
+    ImGui::Text("SAH cost: %.2f", m.sah_cost);
+    ImGui::Text("Depth: max %d, avg %.1f", m.max_depth, m.average_depth);
+    ImGui::Text("Sibling overlap: %.4g (%.2f%% of root volume)", m.sibling_overlap,
+                m.root_volume > 0.0 ? 100.0 * m.sibling_overlap / m.root_volume : 0.0);
+    float leaves[bvh_metrics::leaf_histogram_buckets];
+    for (int b = 0; b < bvh_metrics::leaf_histogram_buckets; b++) leaves[b] = float(m.leaf_histogram[b]);
+    ImGui::PlotHistogram("Leaf Sizes", leaves, bvh_metrics::leaf_histogram_buckets, 0, "1, 2, 3-4, ... 65+", 0.0f,
+                         FLT_MAX, ImVec2(0, 60));
+    if (m.leaf_count > 1 && m.largest_leaf_area > 0.5f) {
+      ImGui::TextColored(ImVec4(1.0f, 0.6f, 0.2f, 1.0f), "A leaf spans %.0f%% of the root's area",
+                         100.0f * m.largest_leaf_area);
+    }
+  }
   ImGui::Separator();
   if (is_rendering_) {
     float p = render_progress_.load();
@@ -295,6 +396,12 @@ void VulkanApp::draw_frame() {
       trigger_render_ = true;
     }
     if (render_time_ > 0) ImGui::Text("Last Render Time: %.3fs", render_time_);
+    if (!use_gpu_render_) {
+      ImGui::Text("Accumulated: %.1f spp", cam_.average_samples());
+      ImGui::SameLine();
+      if (ImGui::Button("Reset")) cam_.reset_accumulation();
+      if (ImGui::Button("Export Sample Map")) export_sample_map();
+    }
   }
   ImGui::Text("FPS: %.1f", ImGui::GetIO().Framerate);
   ImGui::End();
@@ -729,7 +836,7 @@ void VulkanApp::transition_image_layout(VkCommandBuffer cb, VkImage im, VkFormat
 
 void VulkanApp::cleanup() {
   should_stop_render_ = true;
-  if (cpu_render_thread_.joinable()) cpu_render_thread_.join();
+  if (cpu_render_task_.valid()) cpu_render_task_.wait();
   ImGui_ImplVulkan_Shutdown();
   ImGui_ImplGlfw_Shutdown();
   ImGui::DestroyContext();
@@ -762,7 +869,15 @@ void VulkanApp::cleanup() {
 
 void VulkanApp::setup_world() {
   using std::make_shared;
+  // Scenes are generated from the thread's sampler; restarting it makes each
+  // scene the same every time it is selected, so it can hit the BVH cache
+  thread_sampler() = sampler(0x853c49e6748fea9bULL, 0);
   world_.clear();
+  scene_objects_.clear();
+  added_objects_.clear();
+  animated_objects_.clear();
+  animation_time_ = 0.0f;
+  cam_.reset_accumulation();
 
   // Reset camera defaults
   camera_pos_[0] = 13.0f;
@@ -1014,13 +1129,15 @@ void VulkanApp::setup_world() {
     auto light_mat = make_shared<diffuse_light>(color(10, 10, 10));
     world_.add(make_shared<sphere>(point3(0, 1.8, 0), 0.1, light_mat));
     auto metal_mat = make_shared<metal>(color(0.8, 0.8, 0.8), 0.0);
+    // One pillar, placed four times: the flattened scene instances it
+    std::shared_ptr<hittable> pillar = box(point3(-0.5, 0, -0.5), point3(0.5, 3.0, 0.5), metal_mat);
     for (int i = 0; i < 4; i++) {
       float angle = i * 90.0f, rad = angle * 3.14159f / 180.0f;
       float x = 4.0f * cosf(rad), z = 4.0f * sinf(rad);
-      std::shared_ptr<hittable> cp = box(point3(-0.5, 0, -0.5), point3(0.5, 3.0, 0.5), metal_mat);
-      cp = make_shared<rotate_y>(cp, angle + 45);
-      cp = make_shared<translate>(cp, vec3(x, 0, z));
-      world_.add(cp);
+      std::shared_ptr<hittable> cp = make_shared<rotate_y>(pillar, angle + 45);
+      auto orbit = make_shared<translate>(cp, vec3(x, 0, z));
+      animated_objects_.push_back({orbit, 4.0f, rad});
+      world_.add(orbit);
     }
     auto blur_mat = make_shared<lambertian>(color(0.7, 0.3, 0.1));
     for (int i = 0; i < 5; i++) {
@@ -1031,23 +1148,224 @@ void VulkanApp::setup_world() {
                                  make_shared<diffuse_light>(color(4, 4, 4))));
   }
 
+  build_scene_bvh(true);
+}
+
+// Flattens world_ into the GPU arrays with the selected BVH builder. Any build
+// may load its tree from the BVH cache, but only a freshly set up scene
+// ('store_in_cache') writes one: an animated or edited scene rarely recurs, so
+// storing its rebuilds would only fill the cache.
+void VulkanApp::build_scene_bvh(bool store_in_cache) {
+  cam_.reset_accumulation();
   gpu_bvh_nodes_.clear();
   gpu_primitives_.clear();
   gpu_materials_.clear();
   gpu_textures_.clear();
   gpu_perlin_.clear();
   gpu_image_buffer_.clear();
-  std::unordered_map<material*, int> mm;
-  std::unordered_map<texture*, int> tm;
-  flatten_hittable(std::make_shared<bvh_node>(world_), gpu_bvh_nodes_, gpu_primitives_, gpu_materials_, gpu_textures_,
-                   gpu_perlin_, gpu_image_buffer_, mm, tm);
+  gpu_material_ids_.clear();
+  gpu_texture_ids_.clear();
+
+  auto start = std::chrono::high_resolution_clock::now();
+  auto scene = std::make_shared<hittable_list>(world_);
+  bool cached = false;
+  uint64_t cache_key = 0;
+  if (bvh_cache_) {
+    // Collecting the scene is cheap next to building its BVH, and is needed
+    // anyway for the material and texture ids the CPU renderer looks up. It
+    // leaves them in the maps, so a build after a miss adds none twice.
+    std::vector<PrimitiveGPU> collected;
+    collect_flattened_primitives(scene, collected, gpu_materials_, gpu_textures_, gpu_perlin_, gpu_image_buffer_,
+                                 gpu_material_ids_, gpu_texture_ids_);
+    cache_key = bvh_cache::scene_key(collected, gpu_materials_, gpu_textures_, gpu_perlin_, gpu_image_buffer_,
+                                     bvh_build_mode_);
+    cached = bvh_cache_->load(cache_key, gpu_bvh_nodes_, gpu_primitives_, gpu_materials_, gpu_textures_,
+                              gpu_perlin_, gpu_image_buffer_, gpu_primitive_sources_);
+  }
+  if (!cached) {
+    flatten_hittable(scene, gpu_bvh_nodes_, gpu_primitives_, gpu_materials_, gpu_textures_, gpu_perlin_,
+                     gpu_image_buffer_, gpu_material_ids_, gpu_texture_ids_, bvh_build_mode_, &gpu_primitive_sources_);
+    if (bvh_cache_ && store_in_cache &&
+        !bvh_cache_->store(cache_key, gpu_bvh_nodes_, gpu_primitives_, gpu_materials_, gpu_textures_, gpu_perlin_,
+                           gpu_image_buffer_, gpu_primitive_sources_)) {
+      std::cerr << "Could not write the BVH cache file " << bvh_cache_->path(cache_key) << std::endl;
+    }
+  }
+  auto end = std::chrono::high_resolution_clock::now();
+  bvh_editor_.reset({}); // the next edit tags the new arrays
+  bvh_refitter_.reset(gpu_bvh_nodes_, gpu_primitives_);
+  bind_scene_bvh();
+
+  std::cout << "BVH: " << gpu_primitives_.size() << " primitives, " << gpu_bvh_nodes_.size() << " nodes "
+            << (cached ? "loaded from cache" : "built") << " in "
+            << std::chrono::duration<double, std::milli>(end - start).count() << " ms" << std::endl;
+}
+
+// Points everything derived from the flattened arrays at them again after a
+// build or an edit: the CPU scene, the escape links and the metrics
+void VulkanApp::bind_scene_bvh() {
+  cpu_scene_ = std::make_unique<flat_bvh>(gpu_bvh_nodes_, gpu_primitives_, gpu_material_ids_);
+  cpu_scene_->set_treelet_order(cpu_treelet_order_);
+  cpu_scene_->set_layout(cpu_bvh_layout_);
+  gpu_escape_links_ = build_escape_links(gpu_bvh_nodes_);
+  bvh_metrics_ = measure_bvh(gpu_bvh_nodes_, gpu_primitives_);
+}
+
+// Hands out handles to world_'s objects and tags the flattened primitives with
+// them. That takes one more collection pass over the scene, so it waits for
+// the first edit after a build. False if the arrays cannot be edited.
+bool VulkanApp::begin_scene_edits() {
+  if (!bvh_editor_.empty()) return true;
+  if (scene_objects_.empty()) scene_objects_ = world_.objects;
+  // flatten_hittable collects world_'s objects in turn, top-level primitives
+  // first: find each object's span of the primitive sources
+  std::vector<int> first;
+  int total = 0;
+  for (const std::shared_ptr<hittable>& object : scene_objects_) {
+    first.push_back(total);
+    if (!object) continue;
+    std::vector<PrimitiveGPU> primitives;
+    collect_object_primitives(object, true, primitives, gpu_materials_, gpu_textures_, gpu_perlin_,
+                              gpu_image_buffer_, gpu_material_ids_, gpu_texture_ids_);
+    total += int(primitives.size());
+  }
+  std::vector<primitive_tag> tags;
+  for (size_t k = 0; k < gpu_primitive_sources_.size() && gpu_primitive_sources_[k] < total; k++) {
+    int source = gpu_primitive_sources_[k];
+    int owner = int(std::upper_bound(first.begin(), first.end(), source) - first.begin()) - 1;
+    tags.push_back({owner, source - first[owner]});
+  }
+  bvh_editor_.reset(std::move(tags));
+  return !bvh_editor_.empty();
+}
+
+int VulkanApp::add_object(std::shared_ptr<hittable> object) {
+  auto start = std::chrono::high_resolution_clock::now();
+  bool patched = begin_scene_edits();
+  int handle = int(scene_objects_.size());
+  scene_objects_.push_back(object);
+  world_.add(object);
+  if (patched) {
+    // Transformed subtrees are baked into world space: instancing them would
+    // need a new bottom-level tree, which only a build adds
+    std::vector<PrimitiveGPU> primitives;
+    collect_object_primitives(object, false, primitives, gpu_materials_, gpu_textures_, gpu_perlin_,
+                              gpu_image_buffer_, gpu_material_ids_, gpu_texture_ids_);
+    patched = bvh_editor_.insert(handle, primitives, gpu_bvh_nodes_, gpu_primitives_);
+  }
+  finish_scene_edit(patched, "insert", start);
+  return handle;
+}
+
+void VulkanApp::remove_object(int handle) {
+  auto start = std::chrono::high_resolution_clock::now();
+  bool patched = begin_scene_edits();
+  if (handle < 0 || handle >= int(scene_objects_.size()) || !scene_objects_[handle]) return;
+  world_.objects.erase(std::find(world_.objects.begin(), world_.objects.end(), scene_objects_[handle]));
+  scene_objects_[handle] = nullptr;
+  patched = patched && bvh_editor_.remove(handle, gpu_bvh_nodes_, gpu_primitives_);
+  finish_scene_edit(patched, "remove", start);
+}
+
+void VulkanApp::update_object(int handle) {
+  auto start = std::chrono::high_resolution_clock::now();
+  bool patched = begin_scene_edits();
+  if (handle < 0 || handle >= int(scene_objects_.size()) || !scene_objects_[handle]) return;
+  patched = patched && edit_object(handle);
+  finish_scene_edit(patched, "update", start);
+}
+
+// Reinserts an object that changed into the flattened BVH
+bool VulkanApp::edit_object(int handle) {
+  std::vector<PrimitiveGPU> primitives;
+  collect_object_primitives(scene_objects_[handle], true, primitives, gpu_materials_, gpu_textures_, gpu_perlin_,
+                            gpu_image_buffer_, gpu_material_ids_, gpu_texture_ids_);
+  return bvh_editor_.update(handle, std::move(primitives), gpu_bvh_nodes_, gpu_primitives_);
+}
+
+// Edits degrade the tree much like refits do, so the same threshold on its
+// SAH cost decides when to rebuild it instead; as does an edit that could not
+// be patched in
+void VulkanApp::finish_scene_edit(bool patched, const char* edit,
+                                  std::chrono::high_resolution_clock::time_point start) {
+  cam_.reset_accumulation();
+  if (!patched) {
+    std::cout << "Scene " << edit << ": rebuilding the BVH" << std::endl;
+    build_scene_bvh();
+    return;
+  }
+  bind_scene_bvh();
+  auto end = std::chrono::high_resolution_clock::now();
+  std::cout << "Scene " << edit << ": BVH patched in " << std::chrono::duration<double, std::milli>(end - start).count()
+            << " ms, SAH cost " << bvh_metrics_.sah_cost << " (built: " << bvh_refitter_.reference_cost() << ")"
+            << std::endl;
+  if (bvh_metrics_.sah_cost > bvh_refitter_.rebuild_threshold * bvh_refitter_.reference_cost()) {
+    std::cout << "BVH degraded past " << bvh_refitter_.rebuild_threshold << "x, rebuilding" << std::endl;
+    build_scene_bvh();
+  }
+}
+
+// Moves the animated objects to animation_time_ and refits the flattened BVH
+// to them, which is O(n) where a rebuild is O(n log n). Refitting keeps the
+// tree's topology, so once objects have moved far enough that its SAH cost
+// degrades past the refitter's threshold, the BVH is rebuilt instead.
+void VulkanApp::animate_scene() {
+  cam_.reset_accumulation();
+  float angle = animation_time_ * 2.0f * 3.14159f;
+  for (const OrbitingObject& obj : animated_objects_) {
+    obj.node->set_offset(vec3(obj.radius * cosf(obj.phase + angle), obj.node->offset.y(),
+                              obj.radius * sinf(obj.phase + angle)));
+  }
+
+  if (!bvh_editor_.empty()) {
+    // The scene was edited since the last build, so the primitive sources no
+    // longer match the arrays: reinsert the moved objects instead
+    auto start = std::chrono::high_resolution_clock::now();
+    bool patched = true;
+    for (const OrbitingObject& obj : animated_objects_) {
+      auto it = std::find(scene_objects_.begin(), scene_objects_.end(), obj.node);
+      if (it != scene_objects_.end()) patched = patched && edit_object(int(it - scene_objects_.begin()));
+    }
+    finish_scene_edit(patched, "animation", start);
+    return;
+  }
+
+  auto start = std::chrono::high_resolution_clock::now();
+  update_flattened_primitives(std::make_shared<hittable_list>(world_), gpu_primitive_sources_, gpu_primitives_,
+                              gpu_materials_, gpu_textures_, gpu_perlin_, gpu_image_buffer_, gpu_material_ids_,
+                              gpu_texture_ids_);
+  bool still_good = bvh_refitter_.refit(gpu_bvh_nodes_, gpu_primitives_);
+  auto end = std::chrono::high_resolution_clock::now();
+  std::cout << "BVH refit in " << std::chrono::duration<double, std::milli>(end - start).count()
+            << " ms, SAH cost " << bvh_refitter_.cost() << " (built: " << bvh_refitter_.reference_cost() << ")"
+            << std::endl;
+
+  if (!still_good) {
+    std::cout << "BVH degraded past " << bvh_refitter_.rebuild_threshold << "x, rebuilding" << std::endl;
+    build_scene_bvh();
+    return;
+  }
+  cpu_scene_->refitted();
+  bvh_metrics_ = measure_bvh(gpu_bvh_nodes_, gpu_primitives_);
 }
 
 void VulkanApp::setup_camera() {
   cam_.aspect_ratio = aspect_ratio_;
   cam_.image_width = current_width_;
   cam_.samples_per_pixel = samples_per_pixel_;
+  cam_.samples_per_pass = samples_per_pass_;
+  cam_.adaptive_sampling = adaptive_sampling_;
+  cam_.adaptive_threshold = adaptive_threshold_;
+  cam_.adaptive_min_samples = adaptive_min_samples_;
+  cam_.adaptive_max_samples = adaptive_max_samples_;
   cam_.max_depth = max_depth_;
+  cam_.max_diffuse_depth = max_diffuse_depth_;
+  cam_.max_specular_depth = max_specular_depth_;
+  cam_.max_volume_depth = max_volume_depth_;
+  cam_.russian_roulette_depth = russian_roulette_depth_;
+  cam_.tile_size = tile_size_;
+  cam_.tile_order = tile_order_;
+  cam_.pipeline = cpu_pipeline_;
   cam_.lookfrom = point3(camera_pos_[0], camera_pos_[1], camera_pos_[2]);
   cam_.lookat = point3(camera_target_[0], camera_target_[1], camera_target_[2]);
   cam_.vup = vec3(0, 1, 0);
@@ -1146,20 +1464,31 @@ void VulkanApp::export_ppm() {
   // If we are in GUI mode, it was mapped from Vulkan
   cudaMemcpy(host_buffer.data(), cuda_interop_pointer_, width * height * sizeof(float4), cudaMemcpyDeviceToHost);
 
-  std::ofstream ofs("output.ppm");
-  ofs << "P3\n" << width << " " << height << "\n255\n";
-  for (int j = 0; j < height; ++j) {
+  // Rows are formatted in parallel, then written in order
+  std::vector<std::string> rows(height);
+  thread_pool::global().parallel_for(0, height, 16, [&](int j) {
+    std::string& row = rows[j];
     for (int i = 0; i < width; ++i) {
       float4 pixel = host_buffer[j * width + i];
       int r = int(255.999 * std::clamp(pixel.x, 0.0f, 1.0f));
       int g = int(255.999 * std::clamp(pixel.y, 0.0f, 1.0f));
       int b = int(255.999 * std::clamp(pixel.z, 0.0f, 1.0f));
-      ofs << r << " " << g << " " << b << "\n";
+      row += std::to_string(r) + " " + std::to_string(g) + " " + std::to_string(b) + "\n";
     }
-  }
+  });
+
+  std::ofstream ofs("output.ppm");
+  ofs << "P3\n" << width << " " << height << "\n255\n";
+  for (const std::string& row : rows) ofs << row;
   std::cout << "Render saved to output.ppm" << std::endl;
 }
 
+void VulkanApp::export_sample_map() {
+  std::ofstream ofs("sample_map.pgm");
+  cam_.write_sample_map(ofs);
+  std::cout << "Sample counts saved to sample_map.pgm" << std::endl;
+}
+
 void VulkanApp::run_headless() {
   std::cout << "Starting headless render (" << current_width_ << "x" << current_height_ << ")..." << std::endl;
 
@@ -1182,6 +1511,8 @@ void VulkanApp::run_headless() {
   config.focus_dist = focus_distance_;
 
   cuda::span<LinearBVHNode> bvh = {gpu_bvh_nodes_.data(), gpu_bvh_nodes_.size()};
+  cuda::span<int> escape;
+  if (gpu_stackless_traversal_) escape = {gpu_escape_links_.data(), gpu_escape_links_.size()};
   cuda::span<PrimitiveGPU> p_buf = {gpu_primitives_.data(), gpu_primitives_.size()};
   cuda::span<MaterialGPU> m_buf = {gpu_materials_.data(), gpu_materials_.size()};
   cuda::span<TextureGPU> t_buf = {gpu_textures_.data(), gpu_textures_.size()};
@@ -1190,7 +1521,7 @@ void VulkanApp::run_headless() {
 
   auto start = std::chrono::high_resolution_clock::now();
 
-  launch_render(config, bvh, p_buf, m_buf, t_buf, per_buf, i_buf);
+  launch_render(config, bvh, escape, p_buf, m_buf, t_buf, per_buf, i_buf);
   cudaDeviceSynchronize();
 
   auto end = std::chrono::high_resolution_clock::now();
@@ -1201,4 +1532,259 @@ void VulkanApp::run_headless() {
 
   cudaFree(cuda_interop_pointer_);
 }
+
+void VulkanApp::run_benchmark(bool all_scenes) {
+  // CPU throughput on the current scene and camera settings (or on every
+  // built-in scene), through the pointer BVH and each flat BVH layout. The
+  // geometry precision is fixed at build time, so compare a default build
+  // against one configured with -DRT_DOUBLE_PRECISION=ON.
+  const char* precision = sizeof(real) == sizeof(float) ? "float" : "double";
+  std::cout << "CPU benchmark: " << precision << " geometry, " << current_width_ << "x" << current_height_ << ", "
+            << samples_per_pixel_ << " spp, " << thread_pool::global().size() << " threads" << std::endl;
+
+  const char* scene_names[] = {"Static", "Motion Blur", "Checkered",     "Earth",       "Perlin",         "Quad",
+                               "Light",  "Cornell Box", "Cornell Smoke", "Final Scene", "Custom Showcase"};
+  int first = all_scenes ? 0 : (int)scene_type_;
+  int last = all_scenes ? (int)Scenes::CUSTOM : (int)scene_type_;
+
+  for (int s = first; s <= last; s++) {
+    if (all_scenes) {
+      scene_type_ = (Scenes)s;
+      setup_world();
+      setup_camera();
+      std::cout << scene_names[s] << ":" << std::endl;
+    }
+
+    bvh_node tree(world_);
+    struct BenchTarget {
+      const char* name;
+      const hittable* scene;
+      BvhLayout layout;
+      bool treelets = false;
+    };
+    const BenchTarget targets[] = {{"BVH", &tree, BvhLayout::BINARY},
+                                   {"flat BVH", cpu_scene_.get(), BvhLayout::BINARY},
+                                   {"flat BVH4", cpu_scene_.get(), BvhLayout::WIDE4},
+                                   {"flat BVH8", cpu_scene_.get(), BvhLayout::WIDE8},
+                                   {"flat BVH4q", cpu_scene_.get(), BvhLayout::QUANTIZED4},
+                                   {"flat BVH, stackless", cpu_scene_.get(), BvhLayout::STACKLESS},
+                                   {"flat BVH4, treelets", cpu_scene_.get(), BvhLayout::WIDE4, true},
+                                   {"flat BVH8, treelets", cpu_scene_.get(), BvhLayout::WIDE8, true},
+                                   {"flat BVH4q, treelets", cpu_scene_.get(), BvhLayout::QUANTIZED4, true}};
+
+    for (const BenchTarget& target : targets) {
+      if (!target.scene) continue;
+      if (target.scene == cpu_scene_.get()) {
+        cpu_scene_->set_treelet_order(target.treelets);
+        cpu_scene_->set_layout(target.layout);
+      }
+      cam_.reset_accumulation();
+
+      auto start = std::chrono::high_resolution_clock::now();
+      cam_.render_to_buffer(*target.scene, cpu_render_buffer_);
+      auto end = std::chrono::high_resolution_clock::now();
+
+      double duration = std::chrono::duration<double>(end - start).count();
+      long long rays = cam_.get_rays_traced();
+      std::cout << "  " << target.name << ": " << rays << " rays in " << duration << "s, "
+                << (duration > 0 ? rays / duration / 1e6 : 0.0) << " Mrays/s";
+
+      if (target.scene == cpu_scene_.get()) {
+        // Node visits come from a separate 1 spp pass, so counting does not
+        // skew the timing above
+        int spp = cam_.samples_per_pixel;
+        cam_.samples_per_pixel = 1;
+        cam_.reset_accumulation();
+        cpu_scene_->count_traversals(true);
+        cam_.render_to_buffer(*cpu_scene_, cpu_render_buffer_);
+        std::cout << ", " << cpu_scene_->nodes_per_traversal() << " nodes/ray";
+        cpu_scene_->count_traversals(false);
+        cam_.samples_per_pixel = spp;
+
+        size_t node_count = cpu_scene_->node_count();
+        std::cout << ", " << node_count << " nodes of " << (node_count ? cpu_scene_->node_bytes() / node_count : 0)
+                  << " B (" << cpu_scene_->node_bytes() / 1024.0 << " KiB)";
+      }
+      std::cout << std::endl;
+    }
+    if (cpu_scene_) {
+      cpu_scene_->set_treelet_order(cpu_treelet_order_);
+      cpu_scene_->set_layout(cpu_bvh_layout_);
+    }
+  }
+  run_large_tree_benchmark();
+}
+
+// The built-in scenes' wide trees fit in L2, where the order of their nodes
+// hardly matters. This one, a million small spheres in a cube traced with
+// random rays from inside it, takes tens of MiB in every layout, so node
+// fetches miss L2 and L3 and treelet order can show what it saves.
+void VulkanApp::run_large_tree_benchmark() {
+  constexpr int sphere_count = 1 << 20;
+  constexpr int ray_count = 1 << 20;
+  constexpr int rays_per_chunk = 4096;
+  hittable_list spheres;
+  auto white = std::make_shared<lambertian>(color(0.73, 0.73, 0.73));
+  for (int i = 0; i < sphere_count; i++) {
+    point3 center(random_double(-100, 100), random_double(-100, 100), random_double(-100, 100));
+    spheres.add(std::make_shared<sphere>(center, random_double(0.05, 0.3), white));
+  }
+  std::vector<LinearBVHNode> nodes;
+  std::vector<PrimitiveGPU> primitives;
+  std::vector<MaterialGPU> materials;
+  std::vector<TextureGPU> textures;
+  std::vector<PerlinDataGPU> perlin;
+  std::vector<unsigned char> images;
+  std::unordered_map<material*, int> material_ids;
+  std::unordered_map<texture*, int> texture_ids;
+  flatten_hittable(std::make_shared<hittable_list>(spheres), nodes, primitives, materials, textures, perlin, images,
+                   material_ids, texture_ids, bvh_build_mode_);
+  flat_bvh scene(nodes, primitives, material_ids);
+
+  std::vector<ray> rays;
+  rays.reserve(ray_count);
+  for (int k = 0; k < ray_count; k++) {
+    point3 origin(random_double(-100, 100), random_double(-100, 100), random_double(-100, 100));
+    rays.emplace_back(origin, random_unit_vector(), 0.0);
+  }
+
+  struct BenchTarget {
+    const char* name;
+    BvhLayout layout;
+    bool treelets;
+  };
+  const BenchTarget targets[] = {{"flat BVH4", BvhLayout::WIDE4, false},
+                                 {"flat BVH8", BvhLayout::WIDE8, false},
+                                 {"flat BVH4q", BvhLayout::QUANTIZED4, false},
+                                 {"flat BVH4, treelets", BvhLayout::WIDE4, true},
+                                 {"flat BVH8, treelets", BvhLayout::WIDE8, true},
+                                 {"flat BVH4q, treelets", BvhLayout::QUANTIZED4, true}};
+  std::cout << "Large tree: " << sphere_count << " spheres, " << ray_count << " random rays" << std::endl;
+  for (const BenchTarget& target : targets) {
+    scene.set_treelet_order(target.treelets);
+    scene.set_layout(target.layout);
+
+    auto start = std::chrono::high_resolution_clock::now();
+    thread_pool::global().parallel_for(0, ray_count / rays_per_chunk, 1, [&](int chunk) {
+      sampler rng(0x853c49e6748fea9bULL, uint64_t(chunk));
+      for (int k = chunk * rays_per_chunk; k < (chunk + 1) * rays_per_chunk; k++) {
+        hit_record rec;
+        scene.hit(rays[k], interval(0.001, infinity), rec, rng);
+      }
+    });
+    auto end = std::chrono::high_resolution_clock::now();
+
+    double duration = std::chrono::duration<double>(end - start).count();
+    size_t node_count = scene.node_count();
+    std::cout << "  " << target.name << ": " << (duration > 0 ? ray_count / duration / 1e6 : 0.0) << " Mrays/s, "
+              << node_count << " nodes of " << (node_count ? scene.node_bytes() / node_count : 0) << " B ("
+              << scene.node_bytes() / 1024.0 << " KiB)" << std::endl;
+  }
+}
+
+void VulkanApp::run_bvh_report(bool all_scenes) {
+  // Builds the current scene (or every built-in scene) with each builder and
+  // prints the resulting tree's metrics, to compare builders side by side
+  const char* scene_names[] = {"Static", "Motion Blur", "Checkered",     "Earth",       "Perlin",         "Quad",
+                               "Light",  "Cornell Box", "Cornell Smoke", "Final Scene", "Custom Showcase"};
+  const char* builder_names[] = {"SAH", "LBVH", "LBVH + treelets", "SBVH"};
+  BvhBuildMode selected = bvh_build_mode_;
+  int first = all_scenes ? 0 : (int)scene_type_;
+  int last = all_scenes ? (int)Scenes::CUSTOM : (int)scene_type_;
+
+  for (int s = first; s <= last; s++) {
+    if (all_scenes) {
+      scene_type_ = (Scenes)s;
+      setup_world();
+    }
+    std::cout << scene_names[s] << ":" << std::endl;
+    for (int b = 0; b <= (int)BvhBuildMode::SBVH; b++) {
+      bvh_build_mode_ = (BvhBuildMode)b;
+      build_scene_bvh();
+      std::cout << " " << builder_names[b] << ":" << std::endl;
+      print_bvh_metrics(std::cout, bvh_metrics_, "    ");
+    }
+  }
+  bvh_build_mode_ = selected;
+}
+
+int VulkanApp::run_bvh_edit_check() {
+  // Adds, moves and removes spheres in the current scene with each builder,
+  // and after every edit traces the same rays through the patched BVH and
+  // through a fresh build of the edited scene. Returns how many rays the two
+  // disagree on.
+  const char* builder_names[] = {"SAH", "LBVH", "LBVH + treelets", "SBVH"};
+  const int edits = 60;
+  const int rays_per_edit = 1000;
+  BvhBuildMode selected = bvh_build_mode_;
+  int total_mismatches = 0;
+
+  for (int b = 0; b <= (int)BvhBuildMode::SBVH; b++) {
+    bvh_build_mode_ = (BvhBuildMode)b;
+    setup_world();
+    point3 origin(camera_pos_[0], camera_pos_[1], camera_pos_[2]);
+    point3 target(camera_target_[0], camera_target_[1], camera_target_[2]);
+    double size = (origin - target).length();
+    auto near_target = [&] {
+      return target + 0.3 * size * vec3(random_double(-1, 1), random_double(0, 1), random_double(-1, 1));
+    };
+
+    // Removals pick from the scene's own objects too, whose handles are their
+    // indices in world_
+    std::vector<int> removable;
+    for (int handle = 0; handle < int(world_.objects.size()); handle++) removable.push_back(handle);
+    std::vector<std::pair<int, std::shared_ptr<translate>>> added;
+    int mismatches = 0;
+    for (int e = 0; e < edits; e++) {
+      int edit = added.empty() ? 0 : e % 3;
+      if (edit == 0) {
+        auto moved = std::make_shared<translate>(
+            std::make_shared<sphere>(point3(0, 0, 0), 0.03 * size, std::make_shared<lambertian>(color::random())),
+            near_target());
+        added.push_back({add_object(moved), moved});
+        removable.push_back(added.back().first);
+      } else if (edit == 1) {
+        auto it = removable.begin() + int(random_double(0, double(removable.size())));
+        remove_object(*it);
+        added.erase(std::remove_if(added.begin(), added.end(), [&](const auto& object) { return object.first == *it; }),
+                    added.end());
+        removable.erase(it);
+      } else {
+        auto& [handle, moved] = added[int(random_double(0, double(added.size())))];
+        moved->set_offset(near_target());
+        update_object(handle);
+      }
+
+      std::vector<LinearBVHNode> nodes;
+      std::vector<PrimitiveGPU> primitives;
+      std::vector<MaterialGPU> materials;
+      std::vector<TextureGPU> textures;
+      std::vector<PerlinDataGPU> perlin;
+      std::vector<unsigned char> images;
+      std::unordered_map<material*, int> material_ids;
+      std::unordered_map<texture*, int> texture_ids;
+      flatten_hittable(std::make_shared<hittable_list>(world_), nodes, primitives, materials, textures, perlin, images,
+                       material_ids, texture_ids, bvh_build_mode_);
+      flat_bvh built(nodes, primitives, material_ids);
+      // Aim at random objects, so that rays reach every part of the tree
+      sampler rng;
+      for (int k = 0; k < rays_per_edit; k++) {
+        const aabb& box = world_.objects[int(random_double(0, double(world_.objects.size())))]->bounding_box();
+        point3 aim(random_double(box.x.min, box.x.max), random_double(box.y.min, box.y.max),
+                   random_double(box.z.min, box.z.max));
+        ray r(origin, aim - origin, 0.0);
+        hit_record patched_hit, built_hit;
+        bool patched = cpu_scene_->hit(r, interval(0.001, infinity), patched_hit, rng);
+        bool hit = built.hit(r, interval(0.001, infinity), built_hit, rng);
+        if (patched != hit || (hit && std::fabs(patched_hit.t - built_hit.t) > 1e-3 * built_hit.t)) mismatches++;
+      }
+    }
+    std::cout << builder_names[b] << ": " << mismatches << " of " << edits * rays_per_edit
+              << " rays differ after edits" << std::endl;
+    total_mismatches += mismatches;
+  }
+  bvh_build_mode_ = selected;
+  return total_mismatches;
+}
+
 bool VulkanApp::check_validation_layer_support() { return true; }